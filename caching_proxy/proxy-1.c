@@ -1,9 +1,10 @@
 /* 
 * Basic TCP Caching Proxy
-* usage: server <port> <cache expiration time>
+* usage: server <port> <cache expiration time> [prefetch budget]
 * client <-> proxy <-> server/host
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -18,9 +19,96 @@
 #include <arpa/inet.h>
 #include <dirent.h> 
 #include <signal.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #define BUFSIZE 8192
 #define LISTENQ 1024 /*maximum number of client connections */
+#define MAX_URL 2048 /* maximum length of a normalized url */
+#define MAX_KEY (MAX_URL + 1024) /* url plus Vary'd request header values */
+
+/*
+* Cache layout: objects are appended to large slab files (cache/slab.N) and
+* located through a fixed-size open-addressed index (cache/index) that is
+* mmapped shared by every child. Each slab object is the normalized URL
+* followed by the raw response, so a hit is verified against the full key.
+* Slots are keyed by the hash of that key, so the variants of a Vary'd url
+* each get their own; the url's own slot then holds a CE_VARY marker whose
+* stored key is just the url and the Vary header, naming what to hash.
+* Slabs are never rewritten: space is reclaimed a whole slab at a time, by
+* dropping the oldest one, and every entry in it, once CACHE_SLABS exist.
+*/
+#define CACHE_DIR "./cache"
+#define INDEX_PATH CACHE_DIR "/index"
+#define INDEX_MAGIC "PXIDX001"
+#define INDEX_SLOTS 65536 /* must be a power of two */
+#define INDEX_PROBES 8 /* linear probe limit before evicting */
+#define SLAB_MAX (256L * 1024 * 1024) /* start a new slab past this size */
+#define CACHE_SLABS 16 /* slabs kept on disk, so at most CACHE_SLABS * SLAB_MAX bytes */
+
+#define CE_VALID 0x1
+#define CE_VARY 0x2 /* no object: look up the variant the stored Vary header picks */
+
+#define FILL_POLL_US 10000 /* how often a waiter checks a fill in progress */
+#define SPLICE_CHUNK 65536 /* bytes moved per splice, one default pipe's worth */
+
+#define PREFETCH_MAX 32 /* links taken from one page */
+#define PREFETCH_SCAN (512 * 1024) /* bytes of a page scanned for links */
+#define PREFETCH_TIMEOUT 30 /* seconds a prefetching child may run */
+
+struct cache_entry {
+    uint64_t h[2];     /* keyed 128-bit hash of the cache key */
+    uint32_t slab;     /* slab file number */
+    uint32_t key_len;  /* length of the key stored ahead of the object */
+    uint64_t off;      /* offset of the url within the slab */
+    uint64_t size;     /* size of the cached response */
+    int64_t expires;   /* absolute expiry time */
+    uint32_t flags;
+    uint32_t pad;
+};
+
+struct cache_index {
+    char magic[8];
+    uint8_t key[16];   /* siphash key, random per cache directory */
+    uint32_t nslots;
+    uint32_t cur_slab; /* slab currently being appended to */
+    uint64_t slab_tail; /* next free offset in cur_slab */
+    struct cache_entry slots[];
+};
+
+static struct cache_index *cache_idx; /* shared mapping of INDEX_PATH */
+static int cache_idx_fd;
+
+// what a child that times out must not leave behind: its staging file and,
+// while it is a filler, the fill name waiters find that file under
+static char *stage_path;
+static char *fill_path;
+
+/*
+* Caching-relevant fields of a response header. Parsing merges into an
+* existing struct, so a 304 can be layered over the stored response.
+*/
+struct http_meta {
+    int status;
+    int no_store;
+    int no_cache;
+    int is_private;
+    long max_age;         /* -1 if absent */
+    long s_maxage;        /* -1 if absent */
+    long age;
+    time_t date;          /* -1 if absent */
+    time_t expires;       /* -1 if absent, 0 if unparseable (already expired) */
+    time_t last_modified; /* -1 if absent */
+    long content_length;  /* -1 if absent */
+    int chunked;
+    char etag[128];
+    char last_mod[64];    /* raw Last-Modified, echoed in If-Modified-Since */
+    char vary[256];
+};
 
 /*
 * error - wrapper for error
@@ -33,6 +121,12 @@ void error(char *msg) {
 // Timeout handler
 void timeout_handler(int signum) {
     printf("Child process timed out. Exiting...\n");
+    if(fill_path != NULL) {
+        unlink(fill_path);
+    }
+    if(stage_path != NULL) {
+        unlink(stage_path);
+    }
     exit(1);
 }
 
@@ -49,14 +143,35 @@ int in_blocklist(char *host_name);
 int build_err_response(int connfd, char* req_ver, char* status_code);
 int sendall(int connfd, char *b, int len);
 int recv_header(int connfd, char *buf);
-int check_cache(char *res, int connfd, char *fn, int timeout);
-unsigned long hash_func( char *str);
+int recv_res_header(int serverfd, char *buf);
+int cache_open(void);
+int cache_lookup(char *url, char *req, struct cache_entry *e);
+int cache_store(char *url, char *key, int objfd, uint64_t size, int64_t expires);
+int cache_refresh(struct cache_entry *e, int64_t expires);
+int cached_headers(struct cache_entry *e, char *out);
+int serve_cached(int connfd, struct cache_entry *e);
+int get_header(const char *hdrs, const char *name, char *out, int outlen);
+void http_meta_init(struct http_meta *m);
+void parse_response_meta(const char *hdrs, struct http_meta *m);
+int64_t freshness_expiry(struct http_meta *m, int has_query, int default_ttl);
+void build_cache_key(char *url, char *req, const char *vary, char *key, int keylen);
+int add_conditional(char *req, struct http_meta *m);
+int join_fill(int connfd, char *url, char *fill_fn, char *stage_fn, int *stagefd);
+void leave_fill(char *fill_fn, char *stage_fn, int *stagefd);
+void mark_fill_complete(int stagefd);
+int writeall(int fd, char *b, int len);
+long relay_splice(int serverfd, int connfd, int stagefd);
+int find_links(int objfd, off_t body_off, off_t obj_sz, char *page_path, char *host_name, char *host_port, char links[][MAX_URL]);
+void prefetch_links(struct sockaddr_in *serveraddr, char *host_name, char *host_port, char links[][MAX_URL], int nlinks, int budget, int timeout);
+int response_complete(struct http_meta *m, int stagefd, off_t hdr_len, off_t obj_sz);
+void siphash128(const uint8_t *in, size_t inlen, const uint8_t *k, uint64_t out[2]);
 
 int main(int argc, char **argv) {
     int sockfd; /* socket */
     int connfd; /* connection*/
     int portno; /* port to listen on */
     int cache_timeout;
+    int prefetch_budget = 0; /* concurrent prefetches per page, 0 disables prefetching */
     int clientlen; /* byte size of client's address */
     struct sockaddr_in proxyaddr; /* server's addr */
     struct sockaddr_in clientaddr; /* client addr */
@@ -69,12 +184,21 @@ int main(int argc, char **argv) {
     /* 
     * check command line arguments 
     */
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <port> <cache_timeout>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <port> <cache_timeout> [prefetch_budget]\n", argv[0]);
         exit(1);
     }
     portno = atoi(argv[1]);
     cache_timeout = atoi(argv[2]);
+    if (argc == 4) {
+        prefetch_budget = atoi(argv[3]);
+    }
+
+    // open (or create) the shared cache index before forking any children
+    if (cache_open() == -1) {
+        fprintf(stderr, "Could not open cache index\n");
+        exit(1);
+    }
 
     /* 
     * socket: create the parent socket 
@@ -145,7 +269,7 @@ int main(int argc, char **argv) {
                 printf("%s %s\n","String received from the client:\n", buf);
 
                 char* req_method;
-                char req_url[288];
+                char req_url[MAX_URL];
                 char* req_ver;
                 char status_code[32];
 
@@ -160,23 +284,45 @@ int main(int argc, char **argv) {
                     exit(0);
                 }
 
-                // check if in cache, if in cache, send from cache
-                if(check_cache(buf, connfd, req_url, cache_timeout) == 0) { 
+                // keep the client's request, buf is reused for the response
+                char req[BUFSIZE];
+                strcpy(req, buf);
+
+                // check if in cache, if fresh, send from cache
+                struct cache_entry e;
+                int cached = (cache_lookup(req_url, req, &e) == 0);
+                if(cached && time(NULL) <= e.expires) {
+                    printf("Sending from cache...\n");
+                    serve_cached(connfd, &e);
                     exit(0);
                 }
 
-                // open file for writing to
-                FILE *fp;
-                char hash_fn[128];
-                if(is_dynamic == 0) {
-                    unsigned long ul = hash_func(req_url);
-                    sprintf(hash_fn, "cache/%ld", ul);
-                    fp = fopen(hash_fn, "w");
-                    if(fp == NULL) {
-                        error("File could not be opened for writing\n");
+                // stale: revalidate with the stored validators instead of refetching
+                struct http_meta meta;
+                http_meta_init(&meta);
+                int revalidating = 0;
+                if(cached && cached_headers(&e, buf) == 0) {
+                    parse_response_meta(buf, &meta);
+                    if(add_conditional(req, &meta) == 0) {
+                        printf("In cache but stale, revalidating.\n");
+                        revalidating = 1;
                     }
                 }
 
+                // if another child is already fetching this url, stream its
+                // response instead of going to the origin again
+                char stage_fn[128];
+                char fill_fn[128];
+                int stagefd;
+                sprintf(stage_fn, CACHE_DIR "/tmp.%d", getpid());
+                stage_path = stage_fn;
+                int filling = join_fill(connfd, req_url, fill_fn, stage_fn, &stagefd);
+                if(filling == 0) {
+                    exit(0);
+                } else if(filling == 1) {
+                    fill_path = fill_fn;
+                }
+
                 // connect to server:
                 // create socket
                 int serversockfd;
@@ -201,37 +347,138 @@ int main(int argc, char **argv) {
                 }
 
                 // pass req to server
-                sendall(serversockfd, buf, strlen(buf));
-
-                // recv request from server
-                int n;
-                while(1) {
-                    bzero(buf, BUFSIZE);
-                    n = recv(serversockfd, buf, BUFSIZE, 0);
-                    // printf("%s\n", buf);
-                    // printf("%d\n", n);
-                    // printf("%ld\n", strlen(buf));
-                    if(n == 0) {
-                        printf("Connection closed by server.\n");
-                        break;
-                    } else if (n < 0) {
-                        error("Recv error");
+                sendall(serversockfd, req, strlen(req));
+
+                // recv the response header and decide what to do with it
+                bzero(buf, BUFSIZE);
+                int n = recv_res_header(serversockfd, buf);
+                if(n <= 0) {
+                    printf("No response from server.\n");
+                    exit(0);
+                }
+                struct http_meta res_meta;
+                http_meta_init(&res_meta);
+                parse_response_meta(buf, &res_meta);
+
+                if(revalidating && res_meta.status == 304) {
+                    // nothing for waiters to share, they will revalidate themselves
+                    if(filling == 1) {
+                        leave_fill(fill_fn, stage_fn, &stagefd);
+                    } else if(stagefd != -1) {
+                        close(stagefd);
+                        unlink(stage_fn);
+                    }
+
+                    // still valid: refresh freshness from the 304 and serve the stored copy
+                    int cached_status = meta.status;
+                    parse_response_meta(buf, &meta);
+                    meta.status = cached_status;
+                    int64_t expires = freshness_expiry(&meta, is_dynamic, cache_timeout);
+                    if(expires != -1) {
+                        cache_refresh(&e, expires);
+                    }
+                    printf("Not modified, sending from cache...\n");
+                    serve_cached(connfd, &e);
+                    close(serversockfd);
+                    exit(0);
+                }
+
+                // only cacheable responses are shared with waiters; a Vary'd one
+                // may not match their request, so keep staging it privately
+                int64_t expires = freshness_expiry(&res_meta, is_dynamic, cache_timeout);
+                char *hdr_end = strstr(buf, "\r\n\r\n");
+                if(hdr_end == NULL) {
+                    expires = -1; // header larger than buf, can't validate the object
+                }
+
+                // uncompressed html pages are scanned for links to prefetch
+                char ctype[64];
+                int scan_links = prefetch_budget > 0 && expires != -1 &&
+                    get_header(buf, "Content-Type", ctype, sizeof(ctype)) != -1 &&
+                    strncasecmp(ctype, "text/html", 9) == 0 &&
+                    get_header(buf, "Content-Encoding", ctype, sizeof(ctype)) == -1;
+                if(expires == -1 || res_meta.vary[0] != '\0') {
+                    if(filling == 1) {
+                        leave_fill(fill_fn, stage_fn, &stagefd);
+                        filling = -1;
                     }
+                    if(expires == -1) {
+                        printf("Response is not cacheable.\n");
+                        if(stagefd != -1) {
+                            close(stagefd);
+                            unlink(stage_fn);
+                            stagefd = -1;
+                        }
+                    } else if(stagefd == -1) {
+                        stagefd = open(stage_fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+                    }
+                }
+
+                // the header (and any body bytes read with it) went through buf
+                sendall(connfd, buf, n);
+                if(stagefd != -1) {
+                    if(writeall(stagefd, buf, n) == -1) {
+                        error("Writing to file failed");
+                    }
+                }
 
-                    // send partial res body to client
-                    sendall(connfd, buf, n);
+                // relay the rest without copying through user space, falling
+                // back to recv/send if the kernel won't splice these fds
+                if(relay_splice(serversockfd, connfd, stagefd) == -1) {
+                    while(1) {
+                        n = recv(serversockfd, buf, BUFSIZE, 0);
+                        if(n == 0) {
+                            printf("Connection closed by server.\n");
+                            break;
+                        } else if (n < 0) {
+                            error("Recv error");
+                        }
+
+                        // send partial res body to client
+                        sendall(connfd, buf, n);
 
-                    // write to the file if request was not for dynamic content
-                    if(is_dynamic == 0) {
-                        if(fwrite(buf, 1, n, fp) == -1) {
-                            error("Writing to file failed");
+                        // write to the file if the response is cacheable
+                        if(stagefd != -1) {
+                            if(writeall(stagefd, buf, n) == -1) {
+                                error("Writing to file failed");
+                            }
                         }
                     }
                 }
-                if(is_dynamic == 0) {
-                    fclose(fp);
+                char links[PREFETCH_MAX][MAX_URL];
+                int nlinks = 0;
+                if(stagefd != -1) {
+                    // publish only complete objects; the index entry appears atomically,
+                    // so a truncated response is never served as a hit
+                    off_t obj_sz = lseek(stagefd, 0, SEEK_CUR);
+                    char key[MAX_KEY];
+                    build_cache_key(req_url, req, res_meta.vary, key, sizeof(key));
+                    if(response_complete(&res_meta, stagefd, hdr_end + 4 - buf, obj_sz) == -1) {
+                        printf("Response truncated, not caching.\n");
+                    } else {
+                        mark_fill_complete(stagefd);
+                        if(cache_store(req_url, key, stagefd, obj_sz, expires) == -1) {
+                            printf("Failed to store response in cache.\n");
+                        } else if(scan_links) {
+                            nlinks = find_links(stagefd, hdr_end + 4 - buf, obj_sz, strchr(req_url, '/'), host_name, host_port, links);
+                        }
+                    }
+                    // published (or failed): new requests go to the index from here on,
+                    // waiters already attached drain the file once our lock is gone
+                    if(filling == 1) {
+                        unlink(fill_fn);
+                        fill_path = NULL;
+                    }
+                    unlink(stage_fn);
+                    close(stagefd);
                 }
                 close(serversockfd);
+
+                // the client is done; warm the cache with the page's resources
+                if(nlinks > 0) {
+                    close(connfd);
+                    prefetch_links(&serveraddr, host_name, host_port, links, nlinks, prefetch_budget, cache_timeout);
+                }
                 printf("Child exiting.\n");
                 exit(0);
             }
@@ -283,7 +530,7 @@ char* status_code, char* host_name, struct hostent **host, char* host_port, int
     char *q_mark = strstr(req_url_token, "?");
     if(q_mark != NULL) {
         *is_dynamic = 1;
-        printf("Dynamic content will not be cached.\n");
+        printf("Query URL, cached only with explicit freshness.\n");
     }
 
     // Parse host and port number from headers
@@ -311,9 +558,25 @@ char* status_code, char* host_name, struct hostent **host, char* host_port, int
         strcpy(host_port, port_tok);
     }
 
-    strcat(req_url, host_name); // concat host name for identification
-    if(strncmp(req_url_token, "/", 1) != 0) {
-        strcat(req_url, req_url_token);
+    // normalized cache key: lowercase host, explicit port, path without fragment
+    char *path = req_url_token;
+    if(strncasecmp(path, "http://", 7) == 0) {
+        path = strchr(path + 7, '/');
+        if(path == NULL) {
+            path = "/";
+        }
+    }
+    char *frag = strchr(path, '#');
+    if(frag != NULL) {
+        *frag = '\0';
+    }
+    int k = snprintf(req_url, MAX_URL, "%s:%s%s", host_name, host_port, path);
+    if(k < 0 || k >= MAX_URL) {
+        strcpy(status_code, "414 Request-URI Too Long");
+        return -1;
+    }
+    for(char *c = req_url; *c != ':'; c++) {
+        *c = tolower((unsigned char) *c);
     }
 
     printf("host_name: %s\n", host_name);
@@ -424,99 +687,1066 @@ int recv_header(int connfd, char *buf) {
     return 1;
 }
 
-int check_cache(char *res, int connfd, char *fn, int timeout) {
+// recv from the server until the whole response header is in buf (or buf is
+// full); returns the number of bytes read, which may include body bytes
+int recv_res_header(int serverfd, char *buf) {
+    int tot = 0;
+    while(tot < BUFSIZE - 1) {
+        int n = recv(serverfd, buf + tot, BUFSIZE - 1 - tot, 0);
+        if(n <= 0) {
+            break;
+        }
+        tot += n;
+        buf[tot] = '\0';
+        if(strstr(buf, "\r\n\r\n") != NULL) {
+            break;
+        }
+    }
+    return tot;
+}
+
+int writeall(int fd, char *b, int len) {
+    int total = 0;
+    while(total < len) {
+        int n = write(fd, b + total, len - total);
+        if(n == -1) {
+            return -1;
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Relay the origin's response to the client through a pipe with splice. If
+// stagefd is set, the pipe contents are first duplicated with tee into a
+// second pipe that is spliced into the staging file. Returns bytes relayed,
+// or -1 if splice is unavailable before anything was moved.
+long relay_splice(int serverfd, int connfd, int stagefd) {
+    int p[2];
+    int tp[2] = {-1, -1};
+    if(pipe(p) == -1) {
+        return -1;
+    }
+    if(stagefd != -1 && pipe(tp) == -1) {
+        close(p[0]);
+        close(p[1]);
+        return -1;
+    }
+
+    long total = 0;
+    while(1) {
+        ssize_t n = splice(serverfd, NULL, p[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n == 0) {
+            printf("Connection closed by server.\n");
+            break;
+        } else if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+                total = -1;
+                break;
+            }
+            error("Recv error");
+        }
+
+        // tee duplicates the pipe's buffers without consuming them, so take the
+        // staging copy before the client splice drains p. Both pipes have the
+        // same capacity and tp is empty here, so the whole chunk fits.
+        if(stagefd != -1) {
+            if(tee(p[0], tp[1], n, 0) != n) {
+                error("Tee failed");
+            }
+            for(ssize_t moved = 0; moved < n; ) {
+                ssize_t m = splice(tp[0], NULL, stagefd, NULL, n - moved, SPLICE_F_MOVE);
+                if(m <= 0) {
+                    error("Writing to file failed");
+                }
+                moved += m;
+            }
+        }
+
+        for(ssize_t sent = 0; sent < n; ) {
+            ssize_t m = splice(p[0], NULL, connfd, NULL, n - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(m <= 0) {
+                error("Send failed");
+            }
+            sent += m;
+        }
+        total += n;
+    }
+
+    close(p[0]);
+    close(p[1]);
+    if(stagefd != -1) {
+        close(tp[0]);
+        close(tp[1]);
+    }
+    return total;
+}
+
+// check the staged object holds the whole response: the full Content-Length
+// body, or the last-chunk marker of a chunked body. Responses delimited only
+// by the origin closing the connection can't be checked and are accepted.
+int response_complete(struct http_meta *m, int stagefd, off_t hdr_len, off_t obj_sz) {
+    if(m->chunked) {
+        char tail[5];
+        if(obj_sz < hdr_len + 5 || pread(stagefd, tail, 5, obj_sz - 5) != 5) {
+            return -1;
+        }
+        return memcmp(tail, "0\r\n\r\n", 5) == 0 ? 0 : -1;
+    }
+    if(m->content_length >= 0 && obj_sz - hdr_len != m->content_length) {
+        return -1;
+    }
+    return 0;
+}
+
+// take or release a whole-file record lock on the index; fcntl locks are per
+// process, so forked children exclude each other even though they share the fd
+static int lock_index(short type) {
+    struct flock fl;
+    bzero(&fl, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while(fcntl(cache_idx_fd, F_SETLKW, &fl) == -1) {
+        if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int open_slab(uint32_t slab, int flags) {
+    char slab_fn[128];
+    sprintf(slab_fn, CACHE_DIR "/slab.%u", slab);
+    return open(slab_fn, flags, 0600);
+}
+
+// locate the slot holding h, or -1. Caller holds the index lock. Dropping a
+// slab leaves holes in probe runs, so the whole run is always searched.
+static int find_slot(uint64_t h[2]) {
+    uint32_t mask = cache_idx->nslots - 1;
+    for(int i = 0; i < INDEX_PROBES; i++) {
+        struct cache_entry *e = &cache_idx->slots[(h[0] + i) & mask];
+        if((e->flags & CE_VALID) && e->h[0] == h[0] && e->h[1] == h[1]) {
+            return (h[0] + i) & mask;
+        }
+    }
+    return -1;
+}
 
+int cache_open(void) {
     // create ./cache if does not exist
-    struct stat fstat = {0};
-    if (stat("./cache", &fstat) == -1) {
+    struct stat st = {0};
+    if (stat(CACHE_DIR, &st) == -1) {
         printf("Creating ./cache directory.\n");
-        mkdir("./cache", 0700);
+        mkdir(CACHE_DIR, 0700);
+    }
+
+    cache_idx_fd = open(INDEX_PATH, O_RDWR | O_CREAT, 0600);
+    if(cache_idx_fd < 0) {
+        return -1;
+    }
+    size_t idx_sz = sizeof(struct cache_index) + INDEX_SLOTS * sizeof(struct cache_entry);
+
+    lock_index(F_WRLCK);
+    if(fstat(cache_idx_fd, &st) == -1 || st.st_size != (off_t) idx_sz) {
+        // new or incompatible index, start over with a fresh key
+        printf("Initializing cache index.\n");
+        if(ftruncate(cache_idx_fd, 0) == -1 || ftruncate(cache_idx_fd, idx_sz) == -1) {
+            lock_index(F_UNLCK);
+            return -1;
+        }
+    }
+    cache_idx = mmap(NULL, idx_sz, PROT_READ | PROT_WRITE, MAP_SHARED, cache_idx_fd, 0);
+    if(cache_idx == MAP_FAILED) {
+        lock_index(F_UNLCK);
+        return -1;
     }
+    if(memcmp(cache_idx->magic, INDEX_MAGIC, 8) != 0) {
+        bzero(cache_idx, idx_sz);
+        int rfd = open("/dev/urandom", O_RDONLY);
+        if(rfd < 0 || read(rfd, cache_idx->key, sizeof(cache_idx->key)) != sizeof(cache_idx->key)) {
+            if(rfd >= 0) {
+                close(rfd);
+            }
+            lock_index(F_UNLCK);
+            return -1;
+        }
+        close(rfd);
+        cache_idx->nslots = INDEX_SLOTS;
+        memcpy(cache_idx->magic, INDEX_MAGIC, 8);
+    }
+    lock_index(F_UNLCK);
+    return 0;
+}
+
+// start a new slab; once there are more than CACHE_SLABS, the oldest goes,
+// along with the entries in it. Children already sending from it keep their
+// open fd. Caller holds the index write lock.
+static void next_slab(void) {
+    cache_idx->cur_slab++;
+    cache_idx->slab_tail = 0;
+    if(cache_idx->cur_slab < CACHE_SLABS) {
+        return;
+    }
+    uint32_t old = cache_idx->cur_slab - CACHE_SLABS;
+    for(uint32_t i = 0; i < cache_idx->nslots; i++) {
+        if(cache_idx->slots[i].slab <= old) {
+            cache_idx->slots[i].flags = 0;
+        }
+    }
+    char slab_fn[128];
+    sprintf(slab_fn, CACHE_DIR "/slab.%u", old);
+    unlink(slab_fn);
+    printf("Dropped slab %u.\n", old);
+}
 
-    // get hash
-    char hash[128];
-    unsigned long ul = hash_func(fn);
-    sprintf(hash, "cache/%ld", ul);
-    // printf("%s", hash);
+// copy len bytes of the staging file into a slab at off
+static int copy_range(int infd, int outfd, off_t out_off, uint64_t len) {
+    off_t in_off = 0;
+    while(len > 0) {
+        ssize_t n = copy_file_range(infd, &in_off, outfd, &out_off, len, 0);
+        if(n <= 0) {
+            break;
+        }
+        len -= n;
+    }
+    // fall back to a plain read/write loop if copy_file_range is unsupported
+    char b[BUFSIZE];
+    while(len > 0) {
+        ssize_t n = pread(infd, b, len < BUFSIZE ? len : BUFSIZE, in_off);
+        if(n <= 0 || pwrite(outfd, b, n, out_off) != n) {
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// put e in the slot for its key, else the first free one, else evict the
+// home slot. Caller holds the index write lock.
+static void publish_entry(struct cache_entry *e) {
+    uint32_t mask = cache_idx->nslots - 1;
+    int slot = find_slot(e->h);
+    for(int i = 0; slot == -1 && i < INDEX_PROBES; i++) {
+        if(!(cache_idx->slots[(e->h[0] + i) & mask].flags & CE_VALID)) {
+            slot = (e->h[0] + i) & mask;
+        }
+    }
+    if(slot == -1) {
+        slot = e->h[0] & mask;
+    }
+    cache_idx->slots[slot] = *e;
+}
+
+int cache_store(char *url, char *key, int objfd, uint64_t size, int64_t expires) {
+    struct cache_entry e;
+    bzero(&e, sizeof(e));
+    e.key_len = strlen(key);
+    e.size = size;
+    e.expires = expires;
+    siphash128((uint8_t *) key, e.key_len, cache_idx->key, e.h);
+
+    // reserve room at the tail of the current slab
+    uint64_t len = e.key_len + size;
+    if(lock_index(F_WRLCK) == -1) {
+        return -1;
+    }
+    if(cache_idx->slab_tail > 0 && cache_idx->slab_tail + len > SLAB_MAX) {
+        next_slab();
+    }
+    e.slab = cache_idx->cur_slab;
+    e.off = cache_idx->slab_tail;
+    cache_idx->slab_tail += len;
+    lock_index(F_UNLCK);
+
+    // fill the reservation without holding the lock
+    int slabfd = open_slab(e.slab, O_RDWR | O_CREAT);
+    if(slabfd < 0) {
+        return -1;
+    }
+    if(pwrite(slabfd, key, e.key_len, e.off) != e.key_len ||
+        copy_range(objfd, slabfd, e.off + e.key_len, size) == -1) {
+        close(slabfd);
+        return -1;
+    }
+    close(slabfd);
+
+    // publish: reuse the slot for this key, else the first free one, else evict the home slot
+    if(lock_index(F_WRLCK) == -1) {
+        return -1;
+    }
+    if(e.slab + CACHE_SLABS <= cache_idx->cur_slab) {
+        // the slab was dropped while we wrote to it, and our open made it again
+        lock_index(F_UNLCK);
+        char slab_fn[128];
+        sprintf(slab_fn, CACHE_DIR "/slab.%u", e.slab);
+        unlink(slab_fn);
+        return -1;
+    }
+    e.flags = CE_VALID;
+    publish_entry(&e);
+    char *vary = strchr(key, '\n');
+    if(vary != NULL) {
+        // the marker's key is the url and Vary lines at the head of ours
+        struct cache_entry m = e;
+        char *values = strchr(vary + 1, '\n');
+        m.key_len = values != NULL ? values - key : e.key_len;
+        m.size = 0;
+        m.flags = CE_VALID | CE_VARY;
+        siphash128((uint8_t *) url, strlen(url), cache_idx->key, m.h);
+        publish_entry(&m);
+    }
+    lock_index(F_UNLCK);
+
+    printf("Cached %s in slab %u at offset %lu.\n", url, e.slab, (unsigned long) e.off);
+    return 0;
+}
+
+// copy out the entry for key and the key stored with it (MAX_KEY bytes), or -1
+static int find_entry(char *key, struct cache_entry *e, char *stored) {
+    uint64_t h[2];
+    siphash128((uint8_t *) key, strlen(key), cache_idx->key, h);
+
+    // copy the entry out under the read lock
+    if(lock_index(F_RDLCK) == -1) {
+        return -1;
+    }
+    int slot = find_slot(h);
+    if(slot != -1) {
+        *e = cache_idx->slots[slot];
+    }
+    lock_index(F_UNLCK);
+    if(slot == -1) {
+        return -1;
+    }
+
+    int slabfd = open_slab(e->slab, O_RDONLY);
+    if(slabfd < 0) {
+        printf("Failed to open slab\n");
+        return -1;
+    }
+    if(e->key_len >= MAX_KEY || pread(slabfd, stored, e->key_len, e->off) != e->key_len) {
+        close(slabfd);
+        return -1;
+    }
+    close(slabfd);
+    stored[e->key_len] = '\0';
+    return 0;
+}
+
+// the Vary line of a stored key, "" if it has none
+static void stored_vary(char *stored, char *vary, int len) {
+    char *nl = strchr(stored, '\n');
+    vary[0] = '\0';
+    if(nl != NULL) {
+        strncpy(vary, nl + 1, len - 1);
+        vary[len - 1] = '\0';
+        vary[strcspn(vary, "\n")] = '\0';
+    }
+}
+
+// find the entry for url and check that its stored key (url plus the request
+// headers named by the response's Vary) matches this request
+int cache_lookup(char *url, char *req, struct cache_entry *e) {
+    char stored[MAX_KEY];
+    char vary[256];
+    char key[MAX_KEY];
 
     // return if file not in cache
-    if(access(hash, F_OK) == -1) {
+    if(find_entry(url, e, stored) == -1) {
         printf("Not in cache.\n");
         return -1;
-    } 
+    }
+
+    // a Vary'd url: the variant for this request has a slot of its own
+    if(e->flags & CE_VARY) {
+        stored_vary(stored, vary, sizeof(vary));
+        build_cache_key(url, req, vary, key, sizeof(key));
+        if(find_entry(key, e, stored) == -1 || (e->flags & CE_VARY)) {
+            printf("Variant not in cache.\n");
+            return -1;
+        }
+    }
+
+    // verify the full key in case of a hash collision; the stored key records
+    // the Vary header it was built from, so rebuild ours the same way
+    stored_vary(stored, vary, sizeof(vary));
+    build_cache_key(url, req, vary, key, sizeof(key));
+    if(strcmp(stored, key) != 0) {
+        printf("Cache key mismatch.\n");
+        return -1;
+    }
 
     // in cache
     printf("In cache.\n");
+    return 0;
+}
 
-    // check if expired
-    if(stat(hash, &fstat) == -1) {
-        printf("Error calling stat.\n");
-        return- 1;
+// update the expiry of e after a successful revalidation, unless the slot was replaced meanwhile
+int cache_refresh(struct cache_entry *e, int64_t expires) {
+    if(lock_index(F_WRLCK) == -1) {
+        return -1;
+    }
+    int slot = find_slot(e->h);
+    if(slot != -1 && cache_idx->slots[slot].slab == e->slab && cache_idx->slots[slot].off == e->off) {
+        cache_idx->slots[slot].expires = expires;
+    }
+    lock_index(F_UNLCK);
+    return 0;
+}
+
+// copy the stored response header of e into out (BUFSIZE bytes), NUL-terminated
+int cached_headers(struct cache_entry *e, char *out) {
+    int slabfd = open_slab(e->slab, O_RDONLY);
+    if(slabfd < 0) {
+        return -1;
+    }
+    uint64_t len = e->size < BUFSIZE - 1 ? e->size : BUFSIZE - 1;
+    ssize_t n = pread(slabfd, out, len, e->off + e->key_len);
+    close(slabfd);
+    if(n <= 0) {
+        return -1;
     }
-    time_t time_modified = fstat.st_mtime;
-    // printf("%ld\n", time(NULL) - time_modified);
-    if(time(NULL) - time_modified > timeout) {
-        printf("In cache but expired.\n");
+    out[n] = '\0';
+    char *end = strstr(out, "\r\n\r\n");
+    if(end == NULL) {
         return -1;
     }
+    end[4] = '\0';
+    return 0;
+}
 
-    printf("Sending from cache...\n");
+int serve_cached(int connfd, struct cache_entry *e) {
+    int slabfd = open_slab(e->slab, O_RDONLY);
+    if(slabfd < 0) {
+        printf("Failed to open slab\n");
+        return -1;
+    }
 
-    // send from file:
+    // send object straight from the slab
+    off_t off = e->off + e->key_len;
+    uint64_t left = e->size;
+    while(left > 0) {
+        ssize_t n = sendfile(connfd, slabfd, &off, left);
+        if(n <= 0) {
+            printf("Sending from cache failed.\n");
+            close(slabfd);
+            return -1;
+        }
+        left -= n;
+    }
 
-    // Open file
-    FILE *fp;
-    fp = fopen(hash, "r");
-    if(fp == NULL) {
-        printf("Failed to open file\n");
+    close(slabfd);
+    return 0;
+}
+
+// find header name in a NUL-terminated header block, copy its value to out
+int get_header(const char *hdrs, const char *name, char *out, int outlen) {
+    const char *end = strstr(hdrs, "\r\n\r\n");
+    const char *line = strstr(hdrs, "\r\n");
+    size_t nlen = strlen(name);
+
+    while(line != NULL && line != end) {
+        line += 2;
+        const char *eol = strstr(line, "\r\n");
+        if(eol == NULL) {
+            break;
+        }
+        if(strncasecmp(line, name, nlen) == 0 && line[nlen] == ':') {
+            const char *v = line + nlen + 1;
+            while(*v == ' ' || *v == '\t') {
+                v++;
+            }
+            int len = eol - v;
+            if(len >= outlen) {
+                len = outlen - 1;
+            }
+            memcpy(out, v, len);
+            out[len] = '\0';
+            return len;
+        }
+        line = eol;
+    }
+    return -1;
+}
+
+static time_t parse_http_date(const char *s) {
+    struct tm tm;
+    bzero(&tm, sizeof(tm));
+    if(strptime(s, "%a, %d %b %Y %H:%M:%S", &tm) == NULL) {
         return -1;
     }
+    return timegm(&tm);
+}
 
-    // Determine content length
-    fseek(fp, 0L, SEEK_END);
-    int file_sz = ftell(fp);
-    rewind(fp);
+void http_meta_init(struct http_meta *m) {
+    bzero(m, sizeof(*m));
+    m->max_age = -1;
+    m->s_maxage = -1;
+    m->date = -1;
+    m->expires = -1;
+    m->last_modified = -1;
+    m->content_length = -1;
+}
 
-    // Send file data
-    int bytes_sent_from_file = 0;
-    int bytes_left_from_file = file_sz;
+void parse_response_meta(const char *hdrs, struct http_meta *m) {
+    char v[256];
 
-    // Read and send entire file
-    while(bytes_sent_from_file < file_sz) {
+    if(strncmp(hdrs, "HTTP/", 5) == 0) {
+        const char *sp = strchr(hdrs, ' ');
+        if(sp != NULL) {
+            m->status = atoi(sp + 1);
+        }
+    }
 
-        bzero(res, BUFSIZE);
-        int bytes_read;
-        int bytes_to_read = BUFSIZE;
+    if(get_header(hdrs, "Cache-Control", v, sizeof(v)) != -1) {
+        char *save;
+        for(char *d = strtok_r(v, ",", &save); d != NULL; d = strtok_r(NULL, ",", &save)) {
+            while(*d == ' ') {
+                d++;
+            }
+            if(strncasecmp(d, "no-store", 8) == 0) {
+                m->no_store = 1;
+            } else if(strncasecmp(d, "no-cache", 8) == 0) {
+                m->no_cache = 1;
+            } else if(strncasecmp(d, "private", 7) == 0) {
+                m->is_private = 1;
+            } else if(strncasecmp(d, "max-age=", 8) == 0) {
+                m->max_age = atol(d + 8);
+            } else if(strncasecmp(d, "s-maxage=", 9) == 0) {
+                m->s_maxage = atol(d + 9);
+            }
+        }
+    }
+    if(get_header(hdrs, "Pragma", v, sizeof(v)) != -1 && strcasestr(v, "no-cache") != NULL) {
+        m->no_cache = 1;
+    }
+    if(get_header(hdrs, "Age", v, sizeof(v)) != -1) {
+        m->age = atol(v);
+    }
+    if(get_header(hdrs, "Date", v, sizeof(v)) != -1) {
+        m->date = parse_http_date(v);
+    }
+    if(get_header(hdrs, "Expires", v, sizeof(v)) != -1) {
+        m->expires = parse_http_date(v);
+        if(m->expires == -1) {
+            m->expires = 0; // invalid dates such as "0" mean already expired
+        }
+    }
+    if(get_header(hdrs, "Last-Modified", m->last_mod, sizeof(m->last_mod)) != -1) {
+        m->last_modified = parse_http_date(m->last_mod);
+    }
+    if(get_header(hdrs, "Content-Length", v, sizeof(v)) != -1) {
+        m->content_length = atol(v);
+    }
+    if(get_header(hdrs, "Transfer-Encoding", v, sizeof(v)) != -1 && strcasestr(v, "chunked") != NULL) {
+        m->chunked = 1;
+    }
+    get_header(hdrs, "ETag", m->etag, sizeof(m->etag));
+    get_header(hdrs, "Vary", m->vary, sizeof(m->vary));
+}
+
+// absolute expiry for a response, or -1 if it must not be stored.
+// Heuristic freshness (10% of the Last-Modified age, capped at the
+// configured timeout) is never applied to URLs with a query string.
+int64_t freshness_expiry(struct http_meta *m, int has_query, int default_ttl) {
+    if(m->no_store || m->is_private || strcmp(m->vary, "*") == 0) {
+        return -1;
+    }
+    if(m->status != 200 && m->status != 203 && m->status != 300 && m->status != 301 && m->status != 410) {
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    time_t date = m->date != -1 ? m->date : now;
+    long lifetime;
+    if(m->s_maxage >= 0) {
+        lifetime = m->s_maxage;
+    } else if(m->max_age >= 0) {
+        lifetime = m->max_age;
+    } else if(m->expires != -1) {
+        lifetime = m->expires - date;
+    } else if(has_query) {
+        lifetime = 0;
+    } else if(m->last_modified != -1) {
+        lifetime = (date - m->last_modified) / 10;
+        if(lifetime > default_ttl) {
+            lifetime = default_ttl;
+        }
+    } else {
+        lifetime = default_ttl;
+    }
+    if(m->no_cache || lifetime < 0) {
+        lifetime = 0;
+    }
+
+    // an entry that is always stale is only worth keeping if it can be revalidated
+    if(lifetime == 0 && m->etag[0] == '\0' && m->last_mod[0] == '\0') {
+        return -1;
+    }
+    return now + lifetime - m->age;
+}
 
-        // if there is a partial packet, use the size of the partial packet
-        if(file_sz - bytes_sent_from_file < BUFSIZE) {
-            bytes_to_read = file_sz - bytes_sent_from_file;
+// cache key: url, then the Vary header and the request's value for each
+// header it names, so variants of one url never serve each other
+void build_cache_key(char *url, char *req, const char *vary, char *key, int keylen) {
+    int k = snprintf(key, keylen, "%s", url);
+    if(vary[0] == '\0' || k >= keylen) {
+        return;
+    }
+    k += snprintf(key + k, keylen - k, "\n%s", vary);
+
+    char names[256];
+    char v[256];
+    char *save;
+    strncpy(names, vary, sizeof(names) - 1);
+    names[sizeof(names) - 1] = '\0';
+    for(char *name = strtok_r(names, ", ", &save); name != NULL && k < keylen; name = strtok_r(NULL, ", ", &save)) {
+        if(get_header(req, name, v, sizeof(v)) == -1) {
+            v[0] = '\0';
         }
+        k += snprintf(key + k, keylen - k, "\n%s", v);
+    }
+}
+
+// add If-None-Match / If-Modified-Since from the stored response to req.
+// Returns -1 if there are no validators or the client sent its own conditional.
+int add_conditional(char *req, struct http_meta *m) {
+    char v[256];
+    if(m->etag[0] == '\0' && m->last_mod[0] == '\0') {
+        return -1;
+    }
+    if(get_header(req, "If-None-Match", v, sizeof(v)) != -1 || get_header(req, "If-Modified-Since", v, sizeof(v)) != -1) {
+        return -1;
+    }
+
+    char cond[512];
+    int k = 0;
+    if(m->etag[0] != '\0') {
+        k += sprintf(cond + k, "If-None-Match: %s\r\n", m->etag);
+    }
+    if(m->last_mod[0] != '\0') {
+        k += sprintf(cond + k, "If-Modified-Since: %s\r\n", m->last_mod);
+    }
+
+    // insert before the blank line ending the header
+    int len = strlen(req);
+    if(len + k >= BUFSIZE || len < 4) {
+        return -1;
+    }
+    memcpy(req + len - 2, cond, k);
+    strcpy(req + len - 2 + k, "\r\n");
+    return 0;
+}
+
+/*
+* Collapsed forwarding. The first child to miss on a url becomes its filler:
+* it write-locks its staging file and links it to cache/fill.<hash>. Later
+* children open that name and stream the staging file as it grows, until the
+* filler's lock goes away. A filler that declines to share (uncacheable,
+* Vary'd or 304 response) drops the name and its lock before writing a byte,
+* so waiters that read nothing fall back to fetching on their own.
+*
+* The lock also goes away when a filler dies part way, so a filler that got
+* the whole response says so by making the staging file read-only before it
+* lets go. An unlocked fill that is still writable was abandoned: its name is
+* dropped, and nobody else streams it.
+*/
+
+// 1 while the filler is writing, 0 once it finished the response, -1 if it
+// went away without finishing
+static int fill_state(int fillfd) {
+    struct flock fl;
+    struct stat st;
+    bzero(&fl, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if(fcntl(fillfd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK) {
+        return 1;
+    }
+    return fstat(fillfd, &st) == 0 && !(st.st_mode & S_IWUSR) ? 0 : -1;
+}
+
+// unlink fill_fn if it still names the abandoned fill open as fillfd
+static void drop_fill(char *fill_fn, int fillfd) {
+    struct stat fst, nst;
+    if(fstat(fillfd, &fst) == 0 && stat(fill_fn, &nst) == 0 && fst.st_ino == nst.st_ino) {
+        unlink(fill_fn);
+    }
+}
 
-        // Get contents of file
-        bytes_read = fread(res, 1, bytes_to_read, fp);
-        if (bytes_read == -1) {
-            printf("Reading from file failed.\n");
-            fclose(fp);
+// stream a fill in progress to the client, adding the bytes sent to *sent;
+// returns how it ended, as fill_state
+static int stream_fill(int connfd, int fillfd, long *sent) {
+    char b[BUFSIZE];
+    while(1) {
+        ssize_t n = read(fillfd, b, BUFSIZE);
+        if(n > 0) {
+            sendall(connfd, b, n);
+            *sent += n;
+            continue;
+        } else if(n < 0) {
             return -1;
         }
 
-        // Make sure entire packet is sent
-        bytes_sent_from_file += sendall(connfd, res, bytes_read);
+        // caught up, is the filler still writing?
+        int state = fill_state(fillfd);
+        if(state != 1) {
+            // done, drain whatever was written before the lock was released
+            while((n = read(fillfd, b, BUFSIZE)) > 0) {
+                sendall(connfd, b, n);
+                *sent += n;
+            }
+            return state;
+        }
+        usleep(FILL_POLL_US);
+    }
+}
+
+// Returns 1 if we are the filler for url, 0 if the response was streamed
+// from another child's fill, -1 if we should fetch without coalescing.
+// Unless 0 is returned, *stagefd is an open staging file (or -1).
+int join_fill(int connfd, char *url, char *fill_fn, char *stage_fn, int *stagefd) {
+    uint64_t h[2];
+    siphash128((uint8_t *) url, strlen(url), cache_idx->key, h);
+    sprintf(fill_fn, CACHE_DIR "/fill.%016lx%016lx", (unsigned long) h[0], (unsigned long) h[1]);
+
+    *stagefd = open(stage_fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(*stagefd < 0) {
+        return -1;
+    }
+    struct flock fl;
+    bzero(&fl, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if(fcntl(*stagefd, F_SETLK, &fl) == -1) {
+        return -1;
+    }
+
+    for(int tries = 0; tries < 3; tries++) {
+        // locked before it is linked, so waiters never see an idle fill
+        if(link(stage_fn, fill_fn) == 0) {
+            return 1;
+        } else if(errno != EEXIST) {
+            return -1;
+        }
+
+        int fillfd = open(fill_fn, O_RDONLY);
+        if(fillfd < 0) {
+            continue; // finished in between, try to take it over
+        }
+        long sent = 0;
+        int state = fill_state(fillfd);
+        if(state != -1 && connfd >= 0) {
+            printf("Fetch in progress, waiting on it...\n");
+            state = stream_fill(connfd, fillfd, &sent);
+        }
+        if(state == -1) {
+            drop_fill(fill_fn, fillfd);
+        }
+        close(fillfd);
+        if(state != -1 || sent > 0) {
+            // a prefetch leaves it to the filler; a client that got part of
+            // an abandoned fill can only be cut off
+            if(state == -1) {
+                printf("Fetch we waited on was abandoned, response truncated.\n");
+            }
+            close(*stagefd);
+            unlink(stage_fn);
+            *stagefd = -1;
+            return 0;
+        }
+        // nothing shared: the filler declined or died, take it over
     }
+    return -1;
+}
 
-    fclose(fp);
+// give up on sharing: drop the fill name and our lock with nothing written
+void leave_fill(char *fill_fn, char *stage_fn, int *stagefd) {
+    unlink(fill_fn);
+    fill_path = NULL;
+    unlink(stage_fn);
+    close(*stagefd);
+    *stagefd = -1;
+}
+
+// the staged response is whole: waiters may use it once our lock is gone
+void mark_fill_complete(int stagefd) {
+    fchmod(stagefd, 0400);
+}
+
+/*
+* Link prefetching. After an html page is cached, same-origin href/src
+* targets are fetched into the cache in the background so the browser's
+* follow-up requests are hits. Links with a query string are skipped, since
+* they are rarely cacheable and may not be safe to request speculatively.
+*/
+
+// drop "." segments and let each ".." remove the segment before it, as in
+// RFC 3986 section 5.2.4, so one resource is cached under one key
+static void remove_dot_segments(char *path) {
+    char out[MAX_URL];
+    int o = 0;
+    char *in = path;
+    while(*in != '\0') {
+        if(strncmp(in, "../", 3) == 0) {
+            in += 3;
+        } else if(strncmp(in, "./", 2) == 0 || strncmp(in, "/./", 3) == 0) {
+            in += 2;
+        } else if(strcmp(in, "/.") == 0) {
+            out[o++] = '/';
+            break;
+        } else if(strncmp(in, "/../", 4) == 0 || strcmp(in, "/..") == 0) {
+            while(o > 0 && out[--o] != '/');
+            if(in[3] == '\0') {
+                out[o++] = '/';
+                break;
+            }
+            in += 3;
+        } else if(strcmp(in, ".") == 0 || strcmp(in, "..") == 0) {
+            break;
+        } else {
+            // move the first segment, with its leading '/', to the output
+            do {
+                out[o++] = *in++;
+            } while(*in != '\0' && *in != '/');
+        }
+    }
+    out[o] = '\0';
+    strcpy(path, out);
+}
+
+// resolve link against the page path into a same-origin path, or return -1
+static int resolve_link(char *link, char *page_path, char *host_name, char *host_port, char *out) {
+    char *path = link;
+    if(strncasecmp(link, "http://", 7) == 0 || strncmp(link, "//", 2) == 0) {
+        char *h = link + (link[0] == '/' ? 2 : 7);
+        char *slash = strchr(h, '/');
+        int hlen = slash != NULL ? slash - h : (int) strlen(h);
+        char origin[256];
+        int olen = snprintf(origin, sizeof(origin), "%s:%s", host_name, host_port);
+        int same = (hlen == (int) strlen(host_name) && strncasecmp(h, host_name, hlen) == 0 && strcmp(host_port, "80") == 0) ||
+            (hlen == olen && strncasecmp(h, origin, hlen) == 0);
+        if(!same || slash == NULL) {
+            return -1;
+        }
+        path = slash;
+    } else if(strchr(link, ':') != NULL || link[0] == '#' || link[0] == '\0') {
+        return -1; // other schemes (https:, mailto:, data:, ...) or fragments
+    }
+
+    if(path[0] == '/') {
+        snprintf(out, MAX_URL, "%s", path);
+    } else {
+        // relative to the page's directory
+        int dir = strrchr(page_path, '/') - page_path + 1;
+        snprintf(out, MAX_URL, "%.*s%s", dir, page_path, path);
+    }
+    out[strcspn(out, "#")] = '\0';
+    if(strchr(out, '?') != NULL) {
+        return -1;
+    }
+    remove_dot_segments(out);
     return 0;
 }
 
-// hash function taken from http://www.cse.yorku.ca/~oz/hash.html
-unsigned long hash_func( char *str)
-{
-    unsigned long hash = 5381;
-    int c;
+// collect up to PREFETCH_MAX distinct same-origin links from a staged page
+int find_links(int objfd, off_t body_off, off_t obj_sz, char *page_path, char *host_name, char *host_port, char links[][MAX_URL]) {
+    off_t len = obj_sz - body_off < PREFETCH_SCAN ? obj_sz - body_off : PREFETCH_SCAN;
+    char *page = malloc(len + 1);
+    if(page == NULL || pread(objfd, page, len, body_off) != len) {
+        free(page);
+        return 0;
+    }
+    page[len] = '\0';
+
+    char page_dir[MAX_URL];
+    snprintf(page_dir, sizeof(page_dir), "%s", page_path != NULL ? page_path : "/");
+    page_dir[strcspn(page_dir, "?")] = '\0';
+
+    int nlinks = 0;
+    for(char *p = page; nlinks < PREFETCH_MAX && (p = strpbrk(p, "hHsS")) != NULL; p++) {
+        int attr = strncasecmp(p, "href=", 5) == 0 ? 5 : strncasecmp(p, "src=", 4) == 0 ? 4 : 0;
+        if(attr == 0 || (p > page && isalnum((unsigned char) p[-1]))) {
+            continue;
+        }
+        char quote = p[attr];
+        if(quote != '"' && quote != '\'') {
+            continue;
+        }
+        char *v = p + attr + 1;
+        char *end = strchr(v, quote);
+        if(end == NULL || end - v >= MAX_URL / 2) {
+            continue;
+        }
+        *end = '\0';
+
+        char path[MAX_URL];
+        if(resolve_link(v, page_dir, host_name, host_port, path) == 0 && strcmp(path, page_dir) != 0) {
+            int dup = 0;
+            for(int i = 0; i < nlinks && !dup; i++) {
+                dup = strcmp(links[i], path) == 0;
+            }
+            if(!dup) {
+                strcpy(links[nlinks++], path);
+            }
+        }
+        p = end;
+    }
+    free(page);
+    printf("Found %d links to prefetch.\n", nlinks);
+    return nlinks;
+}
+
+// fetch path from the origin into the cache, unless it is fresh or already being fetched
+static void prefetch_one(struct sockaddr_in *serveraddr, char *host_name, char *host_port, char *path, int timeout) {
+    char url[MAX_URL];
+    char req[BUFSIZE];
+    char buf[BUFSIZE];
+    if(snprintf(url, sizeof(url), "%s:%s%s", host_name, host_port, path) >= (int) sizeof(url)) {
+        return;
+    }
+    for(char *c = url; *c != ':'; c++) {
+        *c = tolower((unsigned char) *c);
+    }
+    snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s:%s\r\nConnection: close\r\n\r\n", path, host_name, host_port);
 
-    while (c = *str++)
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    struct cache_entry e;
+    if(cache_lookup(url, req, &e) == 0 && time(NULL) <= e.expires) {
+        return;
+    }
 
-    return hash;
-}
\ No newline at end of file
+    char stage_fn[128];
+    char fill_fn[128];
+    int stagefd;
+    sprintf(stage_fn, CACHE_DIR "/tmp.%d", getpid());
+    stage_path = stage_fn;
+    if(join_fill(-1, url, fill_fn, stage_fn, &stagefd) != 1) {
+        if(stagefd != -1) {
+            close(stagefd);
+            unlink(stage_fn);
+        }
+        return;
+    }
+    fill_path = fill_fn;
+
+    int serversockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int n = 0;
+    if(serversockfd >= 0 && connect(serversockfd, (struct sockaddr *) serveraddr, sizeof(*serveraddr)) == 0 &&
+        sendall(serversockfd, req, strlen(req)) != -1) {
+        n = recv_res_header(serversockfd, buf);
+    }
+
+    struct http_meta m;
+    http_meta_init(&m);
+    char *hdr_end = NULL;
+    int64_t expires = -1;
+    if(n > 0 && (hdr_end = strstr(buf, "\r\n\r\n")) != NULL) {
+        parse_response_meta(buf, &m);
+        expires = freshness_expiry(&m, 0, timeout);
+    }
+    if(expires == -1 || m.vary[0] != '\0') {
+        leave_fill(fill_fn, stage_fn, &stagefd);
+        close(serversockfd);
+        return;
+    }
+
+    // no client to relay to, the origin's response only goes to the staging file
+    int ok = writeall(stagefd, buf, n) != -1;
+    while(ok && (n = recv(serversockfd, buf, BUFSIZE, 0)) > 0) {
+        ok = writeall(stagefd, buf, n) != -1;
+    }
+    off_t obj_sz = lseek(stagefd, 0, SEEK_CUR);
+    if(ok && n == 0 && response_complete(&m, stagefd, hdr_end + 4 - buf, obj_sz) == 0) {
+        mark_fill_complete(stagefd);
+        cache_store(url, url, stagefd, obj_sz, expires);
+    }
+    unlink(fill_fn);
+    fill_path = NULL;
+    unlink(stage_fn);
+    close(stagefd);
+    close(serversockfd);
+}
+
+// prefetch links with at most budget fetches in flight, one child each
+void prefetch_links(struct sockaddr_in *serveraddr, char *host_name, char *host_port, char links[][MAX_URL], int nlinks, int budget, int timeout) {
+    alarm(PREFETCH_TIMEOUT);
+    // SIGCHLD is ignored for auto-reaping, restore it so we can wait on fetchers
+    signal(SIGCHLD, SIG_DFL);
+
+    int running = 0;
+    for(int i = 0; i < nlinks; i++) {
+        if(running == budget) {
+            if(wait(NULL) > 0) {
+                running--;
+            }
+        }
+        pid_t pid = fork();
+        if(pid == 0) {
+            // alarms don't survive fork, each fetcher needs its own
+            alarm(PREFETCH_TIMEOUT);
+            printf("Prefetching %s\n", links[i]);
+            prefetch_one(serveraddr, host_name, host_port, links[i], timeout);
+            exit(0);
+        } else if(pid > 0) {
+            running++;
+        }
+    }
+    while(wait(NULL) > 0);
+}
+
+// SipHash-2-4 with 128-bit output (Aumasson & Bernstein reference algorithm)
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                       \
+    do {                                                               \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);      \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                         \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                         \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);      \
+    } while (0)
+
+static uint64_t u8to64_le(const uint8_t *p) {
+    uint64_t v = 0;
+    for(int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+void siphash128(const uint8_t *in, size_t inlen, const uint8_t *k, uint64_t out[2]) {
+    uint64_t k0 = u8to64_le(k);
+    uint64_t k1 = u8to64_le(k + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1 ^ 0xee;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t) inlen) << 56;
+    const uint8_t *end = in + (inlen & ~7UL);
+
+    for(; in != end; in += 8) {
+        uint64_t m = u8to64_le(in);
+        v3 ^= m;
+        SIPROUND; SIPROUND;
+        v0 ^= m;
+    }
+    for(int i = 0; i < (int) (inlen & 7); i++) {
+        b |= ((uint64_t) in[i]) << (8 * i);
+    }
+
+    v3 ^= b;
+    SIPROUND; SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    out[0] = v0 ^ v1 ^ v2 ^ v3;
+
+    v1 ^= 0xdd;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    out[1] = v0 ^ v1 ^ v2 ^ v3;
+}
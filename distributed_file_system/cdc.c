@@ -0,0 +1,188 @@
+#include "cdc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+// the strict mask has two bits more than log2(CDC_AVG), the loose one two
+// fewer; the top bits of the hash depend on the most bytes
+#define MASK_S (~0ULL << (64 - 22))
+#define MASK_L (~0ULL << (64 - 18))
+
+static uint64_t gear[256];
+static void (*sha256_blocks)(uint32_t *h, const uint8_t *p, size_t n);
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+static void sha256_blocks_c(uint32_t *h, const uint8_t *p, size_t n);
+#if defined(__x86_64__) || defined(__i386__)
+static void sha256_blocks_ni(uint32_t *h, const uint8_t *p, size_t n);
+#endif
+
+// every client must cut at the same places, so the gear table comes from
+// a fixed seed; and the fastest SHA-256 the CPU runs
+static void cdc_init(void) {
+    uint64_t x = 0x646673636463ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+
+    sha256_blocks = sha256_blocks_c;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a, b, c, d;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA)) {
+        sha256_blocks = sha256_blocks_ni;
+    }
+#endif
+}
+
+size_t cdc_cut(const uint8_t *data, size_t n) {
+    pthread_once(&cdc_once, cdc_init);
+    if (n <= CDC_MIN) {
+        return n;
+    }
+    size_t end = n < CDC_MAX ? n : CDC_MAX;
+    size_t normal = end < CDC_AVG ? end : CDC_AVG;
+    uint64_t fp = 0;
+    size_t i = CDC_MIN;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & MASK_S) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if ((fp & MASK_L) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+static void sha256_blocks_c(uint32_t *h, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        sha256_block(h, p + 64 * i);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the SHA extensions keep the state as ABEF and CDGH and do two rounds
+// per instruction; msg1 and msg2 extend the message schedule four words
+// at a time
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t *h, const uint8_t *p, size_t n) {
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1);
+    __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b);
+    __m128i s0 = _mm_alignr_epi8(t, s1, 8);
+    s1 = _mm_blend_epi16(s1, t, 0xf0);
+
+    for (size_t b = 0; b < n; b++, p += 64) {
+        __m128i w[16];
+        __m128i save0 = s0, save1 = s1;
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * g)), bswap);
+            } else {
+                __m128i x = _mm_add_epi32(_mm_sha256msg1_epu32(w[g - 4], w[g - 3]), _mm_alignr_epi8(w[g - 1], w[g - 2], 4));
+                w[g] = _mm_sha256msg2_epu32(x, w[g - 1]);
+            }
+            __m128i msg = _mm_add_epi32(w[g], _mm_loadu_si128((const __m128i *) &sha_k[4 * g]));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        s0 = _mm_add_epi32(s0, save0);
+        s1 = _mm_add_epi32(s1, save1);
+    }
+
+    t = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(s1, t, 8));
+}
+#endif
+
+void cdc_sha256(const uint8_t *data, size_t n, uint8_t *out) {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t tail[128];
+    pthread_once(&cdc_once, cdc_init);
+    size_t i = n / 64 * 64;
+    sha256_blocks(h, data, n / 64);
+    // the rest, a 1 bit, zeros and the length in bits fill one or two blocks
+    size_t rest = n - i;
+    size_t tail_len = rest + 9 <= 64 ? 64 : 128;
+    memset(tail, 0, tail_len);
+    memcpy(tail, data + i, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t) n * 8;
+    for (int b = 0; b < 8; b++) {
+        tail[tail_len - 1 - b] = bits >> (8 * b);
+    }
+    sha256_blocks(h, tail, tail_len / 64);
+    for (int w = 0; w < 8; w++) {
+        out[4 * w] = h[w] >> 24;
+        out[4 * w + 1] = h[w] >> 16;
+        out[4 * w + 2] = h[w] >> 8;
+        out[4 * w + 3] = h[w];
+    }
+}
+
+void cdc_hex(const uint8_t *hash, char *out) {
+    for (int i = 0; i < CDC_HASH_LEN; i++) {
+        sprintf(out + 2 * i, "%02x", hash[i]);
+    }
+}
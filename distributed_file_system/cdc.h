@@ -0,0 +1,42 @@
+#ifndef CDC_H
+#define CDC_H
+
+/*
+ * Content-defined chunking, used by dfc to store files deduplicated.
+ *
+ * cdc_cut finds chunk boundaries with FastCDC: a gear hash rolls over the
+ * data and a chunk ends where the hash has enough zero bits, a stricter
+ * test below CDC_AVG bytes and a looser one above it, so chunk sizes
+ * cluster around CDC_AVG. Boundaries depend only on the bytes just before
+ * them, so an insert or delete changes the chunks around it and no others.
+ *
+ * Each chunk is named by its SHA-256. A stored file version is a manifest:
+ * a manifest_hdr and then a manifest_entry per chunk in file order, all
+ * fields in network byte order.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CDC_MIN (256 * 1024)
+#define CDC_AVG (1024 * 1024)
+#define CDC_MAX (4 * 1024 * 1024)
+#define CDC_HASH_LEN 32
+#define MANIFEST_MAGIC "DFCM"
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint32_t count; /* entries */
+    uint64_t size; /* bytes in the file */
+} manifest_hdr;
+
+typedef struct __attribute__((packed)) {
+    uint8_t hash[CDC_HASH_LEN]; /* SHA-256 of the chunk */
+    uint64_t len;
+} manifest_entry;
+
+size_t cdc_cut(const uint8_t *data, size_t n); // length of the chunk starting at data, of the n bytes left
+void cdc_sha256(const uint8_t *data, size_t n, uint8_t *out); // out gets CDC_HASH_LEN bytes
+void cdc_hex(const uint8_t *hash, char *out); // 2 * CDC_HASH_LEN hex digits and a '\0'
+
+#endif
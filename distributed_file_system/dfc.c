@@ -8,22 +8,166 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <netdb.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <dirent.h> 
 #include <signal.h>
 #include <sys/time.h>
 #include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "frame.h"
+#include "erasure.h"
+#include "cdc.h"
 
 #define BUFSIZE 8192
-#define NUM_SRVS 4
-#define MAX_NUM_FILES 256
+#define MAX_SRVS EC_MAX_SHARDS /* servers in dfc.conf */
+#define LS_BUCKETS 4096 /* buckets of the files ls has seen */
 #define MAX_FILENAME_LEN 128
+#define MAX_VERSIONS 256 /* versions of one file considered by get */
+#define DEFAULT_DATA_SHARDS 3
+#define DEFAULT_PARITY_SHARDS 1
+#define OBJ_INCOMPLETE 1 /* not enough shards on the servers */
+#define OBJ_FAILED 2 /* enough shards, but fetching or rebuilding them failed */
+#define LATENCY_SAMPLES 256 /* recent shard fetch times the hedging threshold comes from */
+#define HEDGE_MIN_SAMPLES 20 /* no hedging before this many */
+#define VERSIONS_WAIT 5 /* seconds a silent server holds up VERSIONS when too few others hold an object */
+#define VERSIONS_MIN_WAIT 0.1 /* seconds any server gets for a VERSIONS reply, however fast the rest are */
+
+/*
+* a request for one server: the shard it is about and where that shard's
+* data comes from or goes
+*/
+typedef struct {
+    int obj; /* index of the object the shard belongs to, -1 once failed */
+    int chunk_num; /* the shard */
+    int fd; /* file the shard's data is read from or written to */
+    off_t offset; /* where the shard's data starts in it */
+    off_t limit; /* get: nothing is written from here on, 0 for no limit */
+    off_t sz; /* put: bytes of data to send, then pad bytes of zeros */
+    off_t pad;
+    off_t obj_size; /* put: nonzero for a parity shard, encoded as it is sent from the object at offset */
+    shard_hdr hdr; /* put: sent ahead of the data */
+    int hdr_fd; /* get: where the header is kept */
+    off_t hdr_offset;
+    char name[MAX_FILENAME_LEN + 32]; /* timestamp_chunk#_filename, or just the filename */
+    char cursor[17]; /* LIST: where the page starts, "" for the first */
+    char *reply; /* LIST and VERSIONS: the text that came back */
+} request;
+
+/* requests for one server */
+typedef struct {
+    request *reqs;
+    int n, cap;
+} queue;
+
+/*
+* something stored coded across the servers: a version of a file, which is
+* its manifest, or a chunk, which is stored as version 0 of its hash
+*/
+typedef struct {
+    char name[MAX_FILENAME_LEN]; /* the file, or the chunk's SHA-256 in hex */
+    int fd; /* get: where its data lands, from base on */
+    off_t base;
+    off_t limit; /* get: nothing is written from here on, 0 for no limit */
+    off_t size;
+    off_t shard_len;
+    off_t scratch_off; /* get: its shard headers, then its parity shards, in the scratch file */
+    int have[EC_MAX_SHARDS]; /* get: shards fetched */
+    int failed; /* OBJ_INCOMPLETE or OBJ_FAILED */
+} object;
+
+/* a server connection as the get scheduler sees it */
+typedef struct {
+    queue todo; /* requests chosen for the server, not sent yet, from todo_head on */
+    int todo_head;
+    queue hedges; /* likewise, sent ahead of todo */
+    int hedges_head;
+    request sent[PIPELINE_DEPTH]; /* in flight, oldest at head; answered in order */
+    int hedged[PIPELINE_DEPTH]; /* another shard of its object was asked for elsewhere, if it needed one */
+    int head, n;
+    uint32_t next_id;
+    double started; /* when the server got to the oldest request in flight */
+    double ewma; /* smoothed seconds the server takes per request, 0 before the first */
+    frame_hdr h; /* the reply coming in */
+    size_t hdr_got;
+    off_t got; /* bytes of its payload so far */
+    shard_hdr sh;
+} get_conn;
+
+/* the get scheduler's state for one fetch_objects call */
+typedef struct {
+    int *socks;
+    object *objs;
+    int nsh; /* data_shards + parity_shards */
+    char (*ts)[32]; /* the version of each object being fetched */
+    uint64_t *holders; /* [obj * nsh + shard]: the servers holding it, a bit each */
+    uint64_t *asked; /* [obj * nsh + shard]: the servers it was asked of */
+    int *busy; /* [obj * nsh + shard]: requests for it queued or in flight */
+    int *got; /* shards of each object fetched */
+    int *outstanding; /* requests for each object queued or in flight */
+    int *failed;
+    int remaining; /* objects neither fetched nor failed */
+    int scratch;
+    get_conn *conns;
+    double samples[LATENCY_SAMPLES];
+    int num_samples;
+    double threshold; /* requests served slower than this are hedged, 0 for none */
+} get_sched;
+
+/* a server connection as list_versions sees it */
+typedef struct {
+    int sent; /* VERSIONS requests sent, answered in order */
+    int done; /* replies taken in */
+    double started; /* when the server got to the oldest request in flight */
+    frame_hdr h; /* the reply coming in */
+    size_t hdr_got;
+    off_t got; /* bytes of its payload so far */
+} versions_conn;
+
+/* where put found a chunk */
+typedef struct {
+    uint8_t hash[CDC_HASH_LEN];
+    int file;
+    off_t offset;
+    off_t len;
+} chunk_ref;
+
+/* a file seen by ls */
+typedef struct ls_file {
+    struct ls_file *next; /* same bucket */
+    uint64_t hash; /* list_hash(fn) */
+    uint64_t shards; /* shard numbers found of any of its versions, a bit each */
+    char fn[MAX_FILENAME_LEN];
+} ls_file;
+
+/* a "server <name> <host>:<port> [weight]" line of dfc.conf */
+typedef struct {
+    char name[32];
+    char host[30];
+    int port;
+    double weight; /* share of files relative to the other servers, 1 by default */
+} server;
+
+server servers[MAX_SRVS];
+int num_srvs = 0;
+
+// how files are coded, from "erasure <data> <parity>" in dfc.conf
+int data_shards = DEFAULT_DATA_SHARDS;
+int parity_shards = DEFAULT_PARITY_SHARDS;
 
 /*
 * error - wrapper for perror
@@ -34,24 +178,33 @@ void error(char *msg) {
 }
 
 int conn_to_servers(int *serversockfds);
-void send_all(int connfd, int *sz, char *data);
+int connect_server(int i);
+void send_all(int connfd, void *data, size_t sz);
+void recv_all(int connfd, void *data, size_t sz);
 unsigned long hash(char *str);
+void rank_servers(char *fn, int *order);
+int rebalance(int *serversockfds);
+int list_all(int *serversockfds, char *prefix);
+char *list_page(request *r, int *more);
+int pipeline(int sockfd, int op, request *reqs, int num_reqs);
+int run_workers(int *serversockfds, int op, queue *qs, int *failed);
+int newest_version(request **versions, int obj, char *ts, off_t *shard_sz);
+int has_chunk(char *reply, char *name);
+int scratch_file(void);
+int open_temp(char *fn, char **tmp);
+int check_shards(int hdr_fd, object *o);
+int put_files(int *serversockfds, char **fns, int num_files);
+int get_files(int *serversockfds, char **fns, int num_files);
+void list_versions(int *serversockfds, object *objs, int num_objs, request **versions);
+void free_versions(request **versions, int num_objs);
+request *queue_add(queue *q);
+void free_queues(queue *qs);
+int fetch_objects(int *serversockfds, object *objs, int num_objs, int stage_fd);
+int queue_object(int *serversockfds, queue *qs, int obj, char *ts, char *key, int fd, off_t base, off_t size);
 
 int main(int argc, char **argv) {
-    int sockfd; /* socket */
-    int connfd; /* connection*/
-    int portno; /* port to listen on */
-    int clientlen; /* byte size of client's address */
-    struct sockaddr_in serveraddr; /* server's addr */
-    struct sockaddr_in clientaddr; /* client addr */
-    struct hostent *hostp; /* client host info */
-    char *hostaddrp; /* dotted decimal host addr string */
-    int optval; /* flag value for setsockopt */
-    pid_t childpid;
-    char main_buf[BUFSIZE];
-
-    char cmd[4]; // command - list, get or put
-    int serversockfds[NUM_SRVS];
+    char cmd[16]; // command - list, get, put or rebalance
+    int serversockfds[MAX_SRVS];
 
     /* 
     * check command line arguments 
@@ -60,106 +213,32 @@ int main(int argc, char **argv) {
         fprintf(stderr, "usage: %s <command> [filename] ... [filename]\n", argv[0]);
         exit(1);
     }
-    sprintf(cmd, "%s", argv[1]);
+    snprintf(cmd, sizeof(cmd), "%s", argv[1]);
 
     // decide actions depending on command
     if(strcmp("ls", cmd) == 0) {
         // connect to servers
         conn_to_servers(serversockfds);
 
-        int n;
-        bzero(main_buf, BUFSIZE);
-        char *buf = malloc(1024);
-        char *msg = "LIST";
+        return list_all(serversockfds, argc > 2 ? argv[2] : "");
 
-        for(int i = 0; i < NUM_SRVS; i++) {
-            // send cmd to servers
-            if(serversockfds[i] == -1) {
-                continue;
-            }
-            int len = strlen(msg);
-            send_all(serversockfds[i], &len, msg);
-
-            // recv list of files
-            bzero(buf, 1024);
-            while( (recv(serversockfds[i], buf, 1024, 0)) > 0 ) {
-                strcat(main_buf, buf);
-            }
-        }
-        free(buf);
-        
-        // buffer to store file names
-        char filenames[MAX_NUM_FILES * NUM_SRVS][MAX_FILENAME_LEN];
-        int num_files = 0;
-        // buffer to record which chunks are present 
-        int chunks[MAX_NUM_FILES * NUM_SRVS][4];
-        //init to zero
-        for (int i = 0; i < MAX_NUM_FILES * NUM_SRVS; i++) {
-            for (int j = 0; j < 4; j++) {
-                chunks[i][j] = 0;
-            }
-        }
-
-        int line_start = 0;
-        char *line = strtok(main_buf, "\n");
-        while (line != NULL) {
-            char *linecpy = malloc(strlen(line));
-            // FORMAT: timestamp_chunk#_filename.ext
-            // parse filename
-            strcpy(linecpy, line);
-            char *ts = strtok(linecpy, "_");
-            char *chunk_num = strtok(NULL, "_");
-            char *fn = strtok(NULL, "\n");
-            int fn_len = strlen(fn);
-
-            // check if file is already in array
-            int new_file = 0;
-            int i_edit = num_files;
-            // search for file within array of filenames
-            for (int i = 0; i < num_files; i++) {
-                if(strncmp(fn, filenames[i], fn_len) == 0) {
-                    new_file = 1;
-                    i_edit = i;
-                    break;
-                }
-            }
-            // insert new filename into array of filenames
-            if (new_file == 0) {
-                strncpy(filenames[i_edit], fn, fn_len);
-                num_files++;
-            }
-
-            // record chunk number
-            int n = atoi(chunk_num);
-            chunks[i_edit][n]++;
-            
-            line_start += strlen(line) + 1;
-            line = strtok(main_buf + line_start, "\n");
-            free(linecpy);
-        }
-        // printf("%d\n", num_files);
-
-        // build the list of files to print to the user
-        bzero(main_buf, BUFSIZE);
-        for (int i = 0; i < num_files; i++) {
-            int incomplete = 0;
-            for (int j = 0; j < 4; j++) {
-                // missing chunk
-                if (chunks[i][j] == 0) {
-                    incomplete = 1;
-                }
-            }
-
-            strcat(main_buf, filenames[i]);
-            if (incomplete == 1) {
-                strcat(main_buf, "[incomplete]");
-            }
-            strcat(main_buf, "\n");
+    } else if(strcmp("get", cmd) == 0) {
+        if(argc == 2) {
+            printf("Specify filename(s)\n");
+            return -1;
         }
 
-        printf("%s", main_buf);
+        // connect to servers
+        conn_to_servers(serversockfds);
 
-    } else if(strcmp("get", cmd) == 0) {
+        return get_files(serversockfds, argv + 2, argc - 2) > 0;
+
+    } else if(strcmp("rebalance", cmd) == 0) {
+        // connect to servers
+        conn_to_servers(serversockfds);
+        return rebalance(serversockfds);
+
+    } else if(strcmp("put", cmd) == 0) {
         if(argc == 2) {
             printf("Specify filename(s)\n");
             return -1;
@@ -168,298 +247,1114 @@ int main(int argc, char **argv) {
         // connect to servers
         conn_to_servers(serversockfds);
 
-        // iterate through filenames
-        bzero(main_buf, BUFSIZE);
-        char tmp_buf[1024];
-        for (int i = 2; i < argc; i++) {
-            char fn[MAX_FILENAME_LEN];
-            strcpy(fn, argv[i]);
-            // create get msg with desired filename
-            char *msg = malloc(4 + strlen(fn));
-            sprintf(msg, "GET %s", fn);
-
-            for(int j = 0; j < NUM_SRVS; j++) {
-                if (serversockfds[j] == -1) {
-                    continue;
-                }
-                // send msg to all servers
-                int msg_sz = strlen(msg);
-                send_all(serversockfds[j], &msg_sz, msg);
-                // recv list of matching filenames
-                bzero(tmp_buf, 1024);
-                recv(serversockfds[j], tmp_buf, 1024, 0);
-                strcat(main_buf, tmp_buf);
-            }
-            free(msg);
-        
-            // printf("buf: %s\n", main_buf);
-
-            // store timestamps and chunks associated to them
-            char ts_arr[MAX_NUM_FILES * NUM_SRVS][MAX_FILENAME_LEN];
-            int chunks[MAX_NUM_FILES * NUM_SRVS][4];
-            for(int j = 0; j < MAX_NUM_FILES * NUM_SRVS; j++) {
-                for(int k = 0; k < NUM_SRVS; k++) {
-                    chunks[j][k] = 0;
+        return put_files(serversockfds, argv + 2, argc - 2) > 0;
+    }
+    else {
+        printf("Invalid command. Please retry.\n");    
+        return -1;    
+    }
+    return 0;
+}
+
+// qsort has no context argument: the refs cmp_refs compares by index
+static chunk_ref *sort_refs;
+
+static int cmp_refs(const void *a, const void *b) {
+    return memcmp(sort_refs[*(const int *) a].hash, sort_refs[*(const int *) b].hash, CDC_HASH_LEN);
+}
+
+// put files: cut each into content-defined chunks, store the chunks no
+// server has yet, then each file's manifest. Returns how many files failed
+int put_files(int *serversockfds, char **fns, int num_files) {
+    int *fds = calloc(num_files, sizeof(int));
+    int *failed = calloc(num_files, sizeof(int));
+    off_t *new_bytes = calloc(num_files, sizeof(off_t));
+    int *new_chunks = calloc(num_files, sizeof(int));
+    int *file_chunks = calloc(num_files, sizeof(int));
+    chunk_ref *refs = NULL;
+    int num_refs = 0, cap = 0;
+
+    // cut every file into chunks
+    for (int i = 0; i < num_files; i++) {
+        fds[i] = open(fns[i], O_RDONLY);
+        if (fds[i] < 0) {
+            printf("Failed to open %s\n", fns[i]);
+            failed[i] = 1;
+            continue;
+        }
+        off_t sz = lseek(fds[i], 0, SEEK_END);
+        uint8_t *data = sz > 0 ? mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fds[i], 0) : NULL;
+        if (sz > 0 && data == MAP_FAILED) {
+            error("mmap");
+        }
+        for (off_t off = 0; off < sz; ) {
+            if (num_refs == cap) {
+                cap = cap ? cap * 2 : 256;
+                refs = realloc(refs, cap * sizeof(chunk_ref));
+                if (refs == NULL) {
+                    error("malloc");
                 }
             }
-            int offsets[MAX_NUM_FILES * NUM_SRVS] = {-1};
-            int num_ts = 0;
-            
-            // iterate through timestamped filenames
-            int line_start = 0;
-            char *line = strtok(main_buf, "\n");
-            while (line != NULL) {
-                char *linecpy = malloc(strlen(line));
-                // FORMAT: timestamp_chunk#_filename.ext
-                // parse filename
-                strcpy(linecpy, line);
-                char *ts = strtok(linecpy, "_");
-                char *chunk_num = strtok(NULL, "_");
-                char *f = strtok(NULL, " ");
-                char *c_sz = strtok(NULL, "\n");
-                // printf("%s %s %s %s\n", ts, chunk_num, f, c_sz);
-                int ts_len = strlen(ts);
-
-                // check if already in array
-                int new_file = 0;
-                int i_edit = num_ts;
-                for (int j = 0; j < num_ts; j++) {
-                    if(strncmp(ts, ts_arr[j], ts_len) == 0) {
-                        new_file = 1;
-                        i_edit = j;
-                        break;
-                    }
-                }
-                // insert new filename into array of filenames
-                if (new_file == 0) {
-                    strncpy(ts_arr[i_edit], ts, ts_len);
-                    // printf("New: %s\n", ts_arr[i_edit]);
-                    num_ts++;
-                }
+            chunk_ref *ref = &refs[num_refs++];
+            ref->file = i;
+            ref->offset = off;
+            ref->len = cdc_cut(data + off, sz - off);
+            cdc_sha256(data + off, ref->len, ref->hash);
+            off += ref->len;
+            file_chunks[i]++;
+        }
+        if (data != NULL) {
+            munmap(data, sz);
+        }
+    }
 
-                // record chunk number
-                int n = atoi(chunk_num);
-                chunks[i_edit][n]++;
+    // one object per distinct chunk, the refs sorted by hash pointing at it
+    int *by_hash = malloc((num_refs + 1) * sizeof(int));
+    for (int r = 0; r < num_refs; r++) {
+        by_hash[r] = r;
+    }
+    sort_refs = refs;
+    qsort(by_hash, num_refs, sizeof(int), cmp_refs);
+    object *chunks = calloc(num_refs + 1, sizeof(object));
+    int *first_ref = malloc((num_refs + 1) * sizeof(int));
+    int num_chunks = 0;
+    for (int r = 0; r < num_refs; r++) {
+        if (r > 0 && memcmp(refs[by_hash[r]].hash, refs[by_hash[r - 1]].hash, CDC_HASH_LEN) == 0) {
+            continue;
+        }
+        first_ref[num_chunks] = r;
+        cdc_hex(refs[by_hash[r]].hash, chunks[num_chunks].name);
+        chunks[num_chunks].size = refs[by_hash[r]].len;
+        num_chunks++;
+    }
+    first_ref[num_chunks] = num_refs;
+
+    // skip the chunks some servers already hold enough shards of
+    request *versions[MAX_SRVS];
+    list_versions(serversockfds, chunks, num_chunks, versions);
+    queue qs[MAX_SRVS];
+    bzero(qs, sizeof(qs));
+    int *chunk_failed = calloc(num_chunks + 1, sizeof(int));
+    for (int c = 0; c < num_chunks; c++) {
+        char ts[32];
+        off_t shard_sz;
+        if (newest_version(versions, c, ts, &shard_sz) == 0 && strcmp(ts, "0") == 0 &&
+            shard_sz == (off_t) sizeof(shard_hdr) + ec_shard_len(chunks[c].size, data_shards)) {
+            continue;
+        }
+        chunk_ref *ref = &refs[by_hash[first_ref[c]]];
+        if (failed[ref->file] || queue_object(serversockfds, qs, c, "0", chunks[c].name, fds[ref->file],
+            ref->offset, ref->len) == -1) {
+            chunk_failed[c] = 1;
+            continue;
+        }
+        new_bytes[ref->file] += ref->len;
+        new_chunks[ref->file]++;
+    }
+    free_versions(versions, num_chunks);
+    run_workers(serversockfds, OP_PUT, qs, chunk_failed);
+    free_queues(qs);
+    for (int c = 0; c < num_chunks; c++) {
+        for (int r = first_ref[c]; chunk_failed[c] && r < first_ref[c + 1]; r++) {
+            failed[refs[by_hash[r]].file] = 1;
+        }
+    }
 
-                // record offset
-                if(atoi(chunk_num) == 0 && offsets[i_edit] < atoi(c_sz)) {
-                    offsets[i_edit] = atoi(c_sz);
+    // then the manifests, so a version is only ever listed once all of
+    // its chunks are stored
+    int manifests = scratch_file();
+    off_t manifests_end = 0;
+    for (int i = 0, r = 0; i < num_files; r += file_chunks[i], i++) {
+        if (failed[i]) {
+            continue;
+        }
+        manifest_hdr mh;
+        memcpy(mh.magic, MANIFEST_MAGIC, sizeof(mh.magic));
+        mh.count = htonl(file_chunks[i]);
+        mh.size = htobe64(lseek(fds[i], 0, SEEK_END));
+        off_t base = manifests_end;
+        if (pwrite(manifests, &mh, sizeof(mh), manifests_end) != sizeof(mh)) {
+            error("write");
+        }
+        manifests_end += sizeof(mh);
+        for (int k = 0; k < file_chunks[i]; k++) {
+            manifest_entry e;
+            memcpy(e.hash, refs[r + k].hash, CDC_HASH_LEN);
+            e.len = htobe64(refs[r + k].len);
+            if (pwrite(manifests, &e, sizeof(e), manifests_end) != sizeof(e)) {
+                error("write");
+            }
+            manifests_end += sizeof(e);
+        }
+
+        // get milliseconds since epoch
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        char ts[32];
+        snprintf(ts, sizeof(ts), "%lld", (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000);
+        if (queue_object(serversockfds, qs, i, ts, fns[i], manifests, base, manifests_end - base) == -1) {
+            failed[i] = 1;
+        }
+    }
+    run_workers(serversockfds, OP_PUT, qs, failed);
+    free_queues(qs);
+
+    int num_failed = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (failed[i]) {
+            printf("%s put failed\n", fns[i]);
+            num_failed++;
+        } else {
+            printf("PUT %s: %d chunks, %d new, %lld bytes sent\n", fns[i], file_chunks[i], new_chunks[i],
+                (long long) new_bytes[i]);
+        }
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    close(manifests);
+    free(refs);
+    free(by_hash);
+    free(chunks);
+    free(first_ref);
+    free(chunk_failed);
+    free(fds);
+    free(failed);
+    free(new_bytes);
+    free(new_chunks);
+    free(file_chunks);
+    return num_failed;
+}
+
+// qsort has no context argument: the chunks cmp_chunks compares by index
+static object *sort_chunks;
+
+static int cmp_chunks(const void *a, const void *b) {
+    return strcmp(sort_chunks[*(const int *) a].name, sort_chunks[*(const int *) b].name);
+}
+
+// a file next to fn for get to write fn's contents into, named *tmp, which
+// is renamed over fn once all of it has checked out
+int open_temp(char *fn, char **tmp) {
+    *tmp = malloc(strlen(fn) + 32);
+    if (*tmp == NULL) {
+        error("malloc");
+    }
+    sprintf(*tmp, "%s.dfc%d", fn, (int) getpid());
+    return open(*tmp, O_CREAT | O_TRUNC | O_RDWR, 0666);
+}
+
+// get files: fetch their manifests, then every distinct chunk once,
+// straight to its first place in a temporary file, and copy it to its
+// other places from there; the file replaces the old one once every chunk
+// matches its hash. Returns how many files failed
+int get_files(int *serversockfds, char **fns, int num_files) {
+    object *manifests = calloc(num_files, sizeof(object));
+    int *fds = calloc(num_files, sizeof(int));
+    char **tmps = calloc(num_files, sizeof(char *));
+    int *failed = calloc(num_files, sizeof(int));
+    for (int i = 0; i < num_files; i++) {
+        snprintf(manifests[i].name, sizeof(manifests[i].name), "%s", fns[i]);
+        manifests[i].fd = -1;
+    }
+    int stage = scratch_file();
+    fetch_objects(serversockfds, manifests, num_files, stage);
+
+    // every chunk of every file, at its offset in the file
+    object *chunks = NULL;
+    int *chunk_file = NULL;
+    int num_chunks = 0;
+    for (int i = 0; i < num_files; i++) {
+        object *m = &manifests[i];
+        manifest_hdr mh;
+        fds[i] = -1;
+        if (m->failed) {
+            // if nothing found, file is incomplete
+            printf(m->failed == OBJ_INCOMPLETE ? "%s is incomplete.\n" : "%s get failed\n", fns[i]);
+            failed[i] = 1;
+            continue;
+        }
+        if (m->size < (off_t) sizeof(mh) || pread(stage, &mh, sizeof(mh), m->base) != sizeof(mh) ||
+            memcmp(mh.magic, MANIFEST_MAGIC, sizeof(mh.magic)) != 0) {
+            // stored before files were chunked: the object is the file
+            off_t pos = m->base;
+            fds[i] = open_temp(fns[i], &tmps[i]);
+            if (fds[i] == -1) {
+                error("open");
+            }
+            while (pos < m->base + m->size) {
+                if (sendfile(fds[i], stage, &pos, m->base + m->size - pos) <= 0) {
+                    error("write");
                 }
-                
-                line_start += strlen(line) + 1;
-                line = strtok(main_buf + line_start, "\n");
-                free(linecpy);
-            }
-
-            int j;
-            // iterate through timestamps, mark if incomplete
-            for (j = 0; j < num_ts; j++) {
-                // if missing chunks, set timestamp to -1
-                for (int k = 0; k < NUM_SRVS; k++) {
-                    if(chunks[j][k] == 0) {
-                        strcpy(ts_arr[j], "-1");
-                        break;
+            }
+            continue;
+        }
+        if (m->size != (off_t) (sizeof(mh) + ntohl(mh.count) * sizeof(manifest_entry))) {
+            printf("%s: bad manifest\n", fns[i]);
+            failed[i] = 1;
+            continue;
+        }
+        int count = ntohl(mh.count);
+        off_t size = be64toh(mh.size);
+
+        // the file as it stands is left alone until the new one is whole
+        fds[i] = open_temp(fns[i], &tmps[i]);
+        if (fds[i] == -1 || ftruncate(fds[i], size) == -1) {
+            error("open");
+        }
+        chunks = realloc(chunks, (num_chunks + count + 1) * sizeof(object));
+        chunk_file = realloc(chunk_file, (num_chunks + count + 1) * sizeof(int));
+        if (chunks == NULL || chunk_file == NULL) {
+            error("malloc");
+        }
+        off_t off = 0;
+        for (int k = 0; k < count; k++) {
+            manifest_entry e;
+            if (pread(stage, &e, sizeof(e), m->base + sizeof(mh) + k * sizeof(e)) != sizeof(e)) {
+                error("read");
+            }
+            object *c = &chunks[num_chunks];
+            bzero(c, sizeof(*c));
+            cdc_hex(e.hash, c->name);
+            c->fd = fds[i];
+            c->base = off;
+            c->limit = off + be64toh(e.len);
+            chunk_file[num_chunks++] = i;
+            off = c->limit;
+        }
+        if (off != size) {
+            printf("%s: bad manifest\n", fns[i]);
+            failed[i] = 1;
+        }
+    }
+    close(stage);
+
+    // one object per distinct chunk, at the place it first occurs
+    int *by_hash = malloc((num_chunks + 1) * sizeof(int));
+    int *distinct_of = malloc((num_chunks + 1) * sizeof(int));
+    object *distinct = malloc((num_chunks + 1) * sizeof(object));
+    int num_distinct = 0;
+    if (by_hash == NULL || distinct_of == NULL || distinct == NULL) {
+        error("malloc");
+    }
+    for (int c = 0; c < num_chunks; c++) {
+        by_hash[c] = c;
+    }
+    sort_chunks = chunks;
+    qsort(by_hash, num_chunks, sizeof(int), cmp_chunks);
+    for (int k = 0; k < num_chunks; k++) {
+        if (k == 0 || strcmp(chunks[by_hash[k]].name, chunks[by_hash[k - 1]].name) != 0) {
+            distinct[num_distinct++] = chunks[by_hash[k]];
+        }
+        distinct_of[by_hash[k]] = num_distinct - 1;
+    }
+
+    // all servers send their shards at the same time, each written at its
+    // own offset so they can land in any order
+    fetch_objects(serversockfds, distinct, num_distinct, -1);
+
+    // then every other occurrence of a chunk is copied from the fetched one
+    uint8_t *data = malloc(CDC_MAX);
+    if (data == NULL) {
+        error("malloc");
+    }
+    for (int c = 0; c < num_chunks; c++) {
+        object *o = &chunks[c], *d = &distinct[distinct_of[c]];
+        o->failed = d->failed;
+        o->size = d->size;
+        if (o->failed || (o->fd == d->fd && o->base == d->base) || o->size != o->limit - o->base ||
+            o->size != d->limit - d->base || o->size > CDC_MAX) {
+            continue;
+        }
+        if (pread(d->fd, data, o->size, d->base) != o->size || pwrite(o->fd, data, o->size, o->base) != o->size) {
+            error("copy");
+        }
+    }
+
+    // a chunk is named by its SHA-256, so one rebuilt from a shard that
+    // went bad on a disk or on the way is caught here
+    for (int c = 0; c < num_chunks; c++) {
+        object *o = &chunks[c];
+        uint8_t hash[CDC_HASH_LEN];
+        char hex[2 * CDC_HASH_LEN + 1];
+        if (o->failed || o->size != o->limit - o->base || o->size > CDC_MAX) {
+            failed[chunk_file[c]] = 1;
+            continue;
+        }
+        if (pread(o->fd, data, o->size, o->base) != o->size) {
+            error("read");
+        }
+        cdc_sha256(data, o->size, hash);
+        cdc_hex(hash, hex);
+        if (strcmp(hex, o->name) != 0) {
+            printf("%s: chunk %s is corrupt\n", fns[chunk_file[c]], o->name);
+            failed[chunk_file[c]] = 1;
+        }
+    }
+    free(data);
+
+    int num_failed = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (fds[i] == -1) {
+            num_failed++;
+            continue;
+        }
+        close(fds[i]);
+        if (!failed[i] && rename(tmps[i], fns[i]) == -1) {
+            perror("rename");
+            failed[i] = 1;
+        }
+        if (failed[i]) {
+            unlink(tmps[i]);
+            printf("%s get failed\n", fns[i]);
+            num_failed++;
+        }
+        free(tmps[i]);
+    }
+    free(manifests);
+    free(chunks);
+    free(chunk_file);
+    free(by_hash);
+    free(distinct_of);
+    free(distinct);
+    free(fds);
+    free(tmps);
+    free(failed);
+    return num_failed;
+}
+
+void free_versions(request **versions, int num_objs) {
+    for (int j = 0; j < num_srvs; j++) {
+        for (int i = 0; i < num_objs; i++) {
+            free(versions[j][i].reply);
+        }
+        free(versions[j]);
+    }
+}
+
+// a request added to the end of q
+request *queue_add(queue *q) {
+    if (q->n == q->cap) {
+        q->cap = q->cap ? q->cap * 2 : 64;
+        q->reqs = realloc(q->reqs, q->cap * sizeof(request));
+        if (q->reqs == NULL) {
+            error("malloc");
+        }
+    }
+    request *r = &q->reqs[q->n++];
+    bzero(r, sizeof(*r));
+    return r;
+}
+
+void free_queues(queue *qs) {
+    for (int j = 0; j < num_srvs; j++) {
+        free(qs[j].reqs);
+        qs[j].reqs = NULL;
+        qs[j].n = qs[j].cap = 0;
+    }
+}
+
+static double now_sec(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int obj_done(get_sched *s, int i) {
+    return s->objs[i].failed || s->failed[i] || s->got[i] >= data_shards;
+}
+
+// a request is answered or dropped
+static void forget(get_sched *s, request *r) {
+    s->outstanding[r->obj]--;
+    s->busy[r->obj * s->nsh + r->chunk_num]--;
+}
+
+// requests a server has queued or in flight
+static int conn_load(get_conn *c) {
+    return c->todo.n - c->todo_head + c->hedges.n - c->hedges_head + c->n;
+}
+
+// how long until server j would answer one more request, going by how
+// long it has taken per request, or has been on its current one if that
+// is longer; servers not heard from yet are taken to be as fast as the
+// average one
+static double expected(get_sched *s, int j) {
+    get_conn *c = &s->conns[j];
+    double per = c->ewma;
+    if (per == 0) {
+        double sum = 0;
+        int known = 0;
+        for (int k = 0; k < num_srvs; k++) {
+            if (s->conns[k].ewma > 0) {
+                sum += s->conns[k].ewma;
+                known++;
+            }
+        }
+        per = known > 0 ? sum / known : 1;
+    }
+    if (c->n > 0 && now_sec() - c->started > per) {
+        per = now_sec() - c->started;
+    }
+    return (conn_load(c) + 1) * per;
+}
+
+// ask a server other than avoid for one more shard of object i: of the
+// shards neither fetched nor on their way and the servers holding them not
+// asked yet, the first shard, data shards first, whose best server is
+// expected to answer within twice the time of the best of all. A hedge may
+// also ask another server for a shard on its way, and goes ahead of the
+// server's other queued requests. -1 if there is nothing left to ask
+static int ask_shard(get_sched *s, int i, int avoid, int hedge) {
+    object *o = &s->objs[i];
+    double best = -1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < s->nsh; c++) {
+            uint64_t can = s->holders[i * s->nsh + c] & ~s->asked[i * s->nsh + c];
+            if (!hedge && s->busy[i * s->nsh + c] > 0) {
+                continue;
+            }
+            int best_j = -1;
+            double best_c = 0;
+            for (int j = 0; j < num_srvs && !o->have[c]; j++) {
+                if ((can >> j & 1) && j != avoid && s->socks[j] != -1) {
+                    double e = expected(s, j);
+                    if (best_j == -1 || e < best_c) {
+                        best_j = j;
+                        best_c = e;
                     }
                 }
-                // printf("ts_arr[%d]: %s\n", j, ts_arr[j]);
-            }
-            long max_ts = -1;
-            int max_i = -1;
-            // find greatest timestamp (most recent)
-            for (j = 0; j < num_ts; j++) {
-                if(atol(ts_arr[j]) > max_ts) {
-                    max_ts = atol(ts_arr[j]);
-                    max_i = j;
-                }
             }
-            // printf("%ld, %d\n", max_ts, max_i);
-            // if nothing found in arr, file is incomplete, return
-            if(max_i == -1) {
-                printf("%s is incomplete.\n", fn);
-                break;
+            if (best_j == -1) {
+                continue;
+            }
+            if (pass == 0) {
+                best = best == -1 || best_c < best ? best_c : best;
+                continue;
+            }
+            if (best_c > 2 * best) {
+                continue;
             }
 
-            // open file
-            int fd = open(fn, O_CREAT | O_WRONLY, 0666);
-            if (fd == -1) {
-                error("open");
+            get_conn *conn = &s->conns[best_j];
+            request *r = queue_add(hedge ? &conn->hedges : &conn->todo);
+            r->obj = i;
+            r->chunk_num = c;
+            if (c < data_shards) {
+                r->fd = o->fd;
+                r->offset = o->base + c * o->shard_len;
+                r->limit = o->limit;
+            } else {
+                r->fd = s->scratch;
+                r->offset = o->scratch_off + EC_MAX_SHARDS * sizeof(shard_hdr) + (c - data_shards) * o->shard_len;
             }
+            r->hdr_fd = s->scratch;
+            r->hdr_offset = o->scratch_off + c * sizeof(shard_hdr);
+            snprintf(r->name, sizeof(r->name), "%s_%d_%s", s->ts[i], c, o->name);
+            s->asked[i * s->nsh + c] |= 1ULL << best_j;
+            s->busy[i * s->nsh + c]++;
+            s->outstanding[i]++;
+            return 0;
+        }
+        if (best == -1) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// ask for shards of object i until enough are fetched or on their way;
+// it fails if that can't be done
+static void refill(get_sched *s, int i, int avoid, int hedge) {
+    while (!obj_done(s, i) && s->got[i] + s->outstanding[i] < data_shards) {
+        if (ask_shard(s, i, avoid, hedge) == -1) {
+            s->failed[i] = 1;
+            s->remaining--;
+        }
+    }
+}
+
+// a request of server j is over: the shard arrived, or it didn't and
+// another one is asked for if the object still needs it
+static void shard_done(get_sched *s, int j, request *r, int ok) {
+    int i = r->obj;
+    forget(s, r);
+    if (obj_done(s, i)) {
+        return;
+    }
+    if (ok && !s->objs[i].have[r->chunk_num]) {
+        s->objs[i].have[r->chunk_num] = 1;
+        if (++s->got[i] == data_shards) {
+            s->remaining--;
+            return;
+        }
+    }
+    refill(s, i, ok ? -1 : j, 1);
+}
 
-            char *ts = ts_arr[max_i]; // desired timestamp         
-            for (j = 0; j < NUM_SRVS; j++) {
-                // send desired timestamp
-                send(serversockfds[j], ts, 32, 0);
+// the 95th percentile of the recent samples out of num_samples taken
+static double p95(double *samples, int num_samples) {
+    int n = num_samples < LATENCY_SAMPLES ? num_samples : LATENCY_SAMPLES;
+    double sorted[LATENCY_SAMPLES];
+    memcpy(sorted, samples, n * sizeof(double));
+    for (int a = 1; a < n; a++) {
+        double v = sorted[a];
+        int b = a;
+        for (; b > 0 && sorted[b - 1] > v; b--) {
+            sorted[b] = sorted[b - 1];
+        }
+        sorted[b] = v;
+    }
+    return sorted[n * 95 / 100];
+}
 
-                for (int k = 0; k < 2; k++) {
-                    // recv chunk number
-                    int chunk_num;
-                    recv(serversockfds[j], &chunk_num, sizeof(int), 0);
+// take the oldest request in flight off server j; a shard fetched adds a
+// sample of how long the server took over it
+static void reply_done(get_sched *s, int j, int ok) {
+    get_conn *c = &s->conns[j];
+    request r = c->sent[c->head];
+    double t = now_sec();
+    c->head = (c->head + 1) % PIPELINE_DEPTH;
+    c->n--;
+    if (ok) {
+        double took = t - c->started;
+        c->ewma = c->ewma == 0 ? took : 0.8 * c->ewma + 0.2 * took;
+        s->samples[s->num_samples++ % LATENCY_SAMPLES] = took;
+        // redone now and then
+        if (s->num_samples >= HEDGE_MIN_SAMPLES && s->num_samples % 16 == 0) {
+            s->threshold = p95(s->samples, s->num_samples);
+        }
+    }
+    c->started = t;
+    shard_done(s, j, &r, ok);
+}
 
-                    // set correct offset to begin writing at
-                    int offset = chunk_num * offsets[max_i];
-                    if (lseek(fd, offset, SEEK_SET) == -1) {
-                        close(fd);
-                        error("lseek");
-                    }
+// server j can't be used any more: everything asked of it is asked of
+// the other servers instead
+static void server_down(get_sched *s, int j) {
+    get_conn *c = &s->conns[j];
+    printf("Server %s failed during get\n", servers[j].name);
+    close(s->socks[j]);
+    s->socks[j] = -1;
+    while (c->n > 0) {
+        reply_done(s, j, 0);
+    }
+    for (; c->hedges_head < c->hedges.n; c->hedges_head++) {
+        shard_done(s, j, &c->hedges.reqs[c->hedges_head], 0);
+    }
+    for (; c->todo_head < c->todo.n; c->todo_head++) {
+        shard_done(s, j, &c->todo.reqs[c->todo_head], 0);
+    }
+    c->hdr_got = 0;
+}
 
-                    // recv file sz
-                    int f_sz;
-                    recv(serversockfds[j], &f_sz, sizeof(int), 0);
-                    // recv file data
-                    int n;
-                    int recv_sz;
-                    int bytes_recv = 0;
-                    while (bytes_recv < f_sz) {
-                        // receive part of the chunk
-                        bzero(main_buf, BUFSIZE);
-                        recv_sz = f_sz - bytes_recv < BUFSIZE ? f_sz - bytes_recv : BUFSIZE;
-                        n = recv(serversockfds[j], main_buf, recv_sz, 0);
-                        if (n < 0) {
-                            error("Recv file failed");
-                        }
-                        if(n == 0) {
-                            break;
-                        }
-                        bytes_recv += n;
-                        // write chunk
-                        if (write(fd, main_buf, n) == -1) {
-                            close(fd);
-                            error("write");
-                        }
-                        // printf("data: %s\n", main_buf);
-                    }
+// send server j what it has queued, up to PIPELINE_DEPTH in flight;
+// requests for objects fetched or failed meanwhile are dropped
+static void send_queued(get_sched *s, int j) {
+    get_conn *c = &s->conns[j];
+    while (s->socks[j] != -1 && c->n < PIPELINE_DEPTH) {
+        request *r;
+        if (c->hedges_head < c->hedges.n) {
+            r = &c->hedges.reqs[c->hedges_head++];
+        } else if (c->todo_head < c->todo.n) {
+            r = &c->todo.reqs[c->todo_head++];
+        } else {
+            break;
+        }
+        if (obj_done(s, r->obj)) {
+            forget(s, r);
+            continue;
+        }
+
+        frame_hdr h;
+        char buf[sizeof(h) + sizeof(r->name)];
+        int namelen = strlen(r->name);
+        h.version = FRAME_VERSION;
+        h.op = OP_GET;
+        h.status = 0;
+        h.namelen = namelen;
+        h.id = htonl(++c->next_id);
+        h.len = htobe64(namelen);
+        memcpy(buf, &h, sizeof(h));
+        memcpy(buf + sizeof(h), r->name, namelen);
+        int slot = (c->head + c->n) % PIPELINE_DEPTH;
+        c->sent[slot] = *r;
+        c->hedged[slot] = 0;
+        if (c->n++ == 0) {
+            c->started = now_sec();
+        }
+        if (send(s->socks[j], buf, sizeof(h) + namelen, MSG_NOSIGNAL) != (ssize_t) (sizeof(h) + namelen)) {
+            server_down(s, j);
+        }
+    }
+}
+
+// read whatever server j has sent, writing shards where they belong as
+// they come in. -1 if the connection broke or went out of step
+static int recv_some(get_sched *s, int j) {
+    get_conn *c = &s->conns[j];
+    char buf[BUFSIZE];
+    while (c->n > 0) {
+        ssize_t n;
+        if (c->hdr_got < sizeof(c->h)) {
+            n = recv(s->socks[j], (char *) &c->h + c->hdr_got, sizeof(c->h) - c->hdr_got, MSG_DONTWAIT);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            c->hdr_got += n;
+            if (c->hdr_got < sizeof(c->h)) {
+                continue;
+            }
+            if (c->h.version != FRAME_VERSION || ntohl(c->h.id) != c->next_id - c->n + 1 || c->h.op != OP_GET) {
+                return -1;
+            }
+            c->got = 0;
+        }
+
+        request *r = &c->sent[c->head];
+        off_t len = be64toh(c->h.len);
+        int keep = c->h.status == ST_OK && len >= (off_t) sizeof(shard_hdr);
+        while (c->got < len) {
+            int in_hdr = keep && c->got < (off_t) sizeof(shard_hdr);
+            char *dst = in_hdr ? (char *) &c->sh + c->got : buf;
+            size_t want = in_hdr ? sizeof(shard_hdr) - c->got : len - c->got < BUFSIZE ? len - c->got : BUFSIZE;
+            n = recv(s->socks[j], dst, want, MSG_DONTWAIT);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            // write shard, up to the limit
+            if (keep && !in_hdr) {
+                off_t pos = r->offset + c->got - sizeof(shard_hdr);
+                int w = r->limit == 0 || pos + n <= r->limit ? n : pos < r->limit ? r->limit - pos : 0;
+                if (w > 0 && pwrite(r->fd, buf, w, pos) != w) {
+                    error("write");
                 }
             }
-            close(fd);
+            c->got += n;
         }
+        if (keep && pwrite(r->hdr_fd, &c->sh, sizeof(c->sh), r->hdr_offset) != sizeof(c->sh)) {
+            error("write");
+        }
+        c->hdr_got = 0;
+        reply_done(s, j, keep);
+    }
+    return 0;
+}
 
-    } else if(strcmp("put", cmd) == 0) {
-        if(argc == 2) {
-            printf("Specify filename(s)\n");
-            return -1;
+// the requests from head on in q, queued for server j, go to other
+// servers where they can
+static void move_queued(get_sched *s, int j, queue *q, int head, int hedge) {
+    int kept = head;
+    for (int k = head; k < q->n; k++) {
+        request r = q->reqs[k];
+        uint64_t *asked = &s->asked[r.obj * s->nsh + r.chunk_num];
+        forget(s, &r);
+        *asked &= ~(1ULL << j);
+        if (obj_done(s, r.obj) || ask_shard(s, r.obj, j, hedge) == 0) {
+            continue;
         }
+        *asked |= 1ULL << j;
+        s->busy[r.obj * s->nsh + r.chunk_num]++;
+        s->outstanding[r.obj]++;
+        q->reqs[kept++] = r;
+    }
+    q->n = kept;
+}
 
-        // connect to servers
-        conn_to_servers(serversockfds);
+// server j has been on its oldest request for longer than most requests
+// take: everything in flight there is hedged with another shard from
+// another server, and what is still queued for it goes elsewhere
+static void hedge_server(get_sched *s, int j) {
+    get_conn *c = &s->conns[j];
+    for (int k = 0; k < c->n; k++) {
+        int slot = (c->head + k) % PIPELINE_DEPTH;
+        int i = c->sent[slot].obj;
+        if (!c->hedged[slot] && !obj_done(s, i) && s->got[i] + s->outstanding[i] < data_shards + 1) {
+            ask_shard(s, i, j, 1);
+        }
+        c->hedged[slot] = 1;
+    }
+    move_queued(s, j, &c->hedges, c->hedges_head, 1);
+    move_queued(s, j, &c->todo, c->todo_head, 0);
+}
 
-        // iterate through filenames
-        for (int i = 2; i < argc; i++) {
-            char fn[50];
-            strcpy(fn, argv[i]);
+// send a VERSIONS request for name; -1 if the connection is gone
+static int send_versions(int sockfd, uint32_t id, char *name) {
+    frame_hdr h;
+    char buf[sizeof(h) + MAX_FILENAME_LEN];
+    int namelen = strlen(name);
+    h.version = FRAME_VERSION;
+    h.op = OP_VERSIONS;
+    h.status = 0;
+    h.namelen = namelen;
+    h.id = htonl(id);
+    h.len = htobe64(namelen);
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), name, namelen);
+    return send(sockfd, buf, sizeof(h) + namelen, MSG_NOSIGNAL) == (ssize_t) (sizeof(h) + namelen) ? 0 : -1;
+}
 
-            // check if enough servers are available to store file
-            int put_possible = 1;
-            for(int j = 0; j < NUM_SRVS; j++) {
-                if(serversockfds[j] == -1 && serversockfds[(j + 1) % NUM_SRVS] == -1) {
-                    put_possible = 0;
-                }
+// read whatever a server has sent of its VERSIONS replies, each kept as
+// the reply of its request, and add a sample of how long each took. -1 if
+// the connection broke or went out of step
+static int recv_versions(int sockfd, versions_conn *c, request *reqs, double *samples, int *num_samples) {
+    while (c->done < c->sent) {
+        request *r = &reqs[c->done];
+        ssize_t n;
+        if (c->hdr_got < sizeof(c->h)) {
+            n = recv(sockfd, (char *) &c->h + c->hdr_got, sizeof(c->h) - c->hdr_got, MSG_DONTWAIT);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
             }
-            if(!put_possible) {
-                printf("%s put failed\n", fn);
+            c->hdr_got += n;
+            if (c->hdr_got < sizeof(c->h)) {
                 continue;
             }
+            if (c->h.version != FRAME_VERSION || ntohl(c->h.id) != (uint32_t) c->done + 1 ||
+                c->h.op != OP_VERSIONS) {
+                return -1;
+            }
+            c->got = 0;
+            r->reply = malloc(be64toh(c->h.len) + 1);
+            if (r->reply == NULL) {
+                error("malloc");
+            }
+        }
+
+        off_t len = be64toh(c->h.len);
+        while (c->got < len) {
+            n = recv(sockfd, r->reply + c->got, len - c->got, MSG_DONTWAIT);
+            if (n <= 0) {
+                return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+            }
+            c->got += n;
+        }
+        r->reply[len] = '\0';
+        if (c->h.status != ST_OK) {
+            free(r->reply);
+            r->reply = NULL;
+        }
+        double t = now_sec();
+        samples[(*num_samples)++ % LATENCY_SAMPLES] = t - c->started;
+        c->started = t;
+        c->hdr_got = 0;
+        c->done++;
+    }
+    return 0;
+}
 
-            int bucket_num = ((unsigned int) hash(fn)) % NUM_SRVS;
+// how long list_versions waits on a server's request before giving up on it
+static double versions_limit(double *samples, int num_samples, int short_of) {
+    if (short_of > 0 || num_samples == 0) {
+        return VERSIONS_WAIT;
+    }
+    double limit = p95(samples, num_samples);
+    return limit > VERSIONS_MIN_WAIT ? limit : VERSIONS_MIN_WAIT;
+}
 
-            // open file
-            int fd = open(fn, O_RDONLY);
-            if(fd < 0) {
-                printf("Failed to open file\n");
-                return -1;
+// ask every server which versions of each object it holds, all servers at
+// once and the names pipelined over each one's connection; versions[j][i]
+// is server j's answer for object i, NULL if there is none. A server still
+// on a request after longer than 95% of the replies so far took, and at
+// least VERSIONS_MIN_WAIT, is given up on once data_shards servers holding
+// shards of every object have answered for it, and after VERSIONS_WAIT
+// regardless: it is cut off mid-reply and connected to afresh, and its
+// answers are left out
+void list_versions(int *serversockfds, object *objs, int num_objs, request **versions) {
+    versions_conn conns[MAX_SRVS];
+    double samples[LATENCY_SAMPLES];
+    int num_samples = 0;
+    int *holders = calloc(num_objs + 1, sizeof(int)); /* servers that answered with shards of each object */
+    int short_of = num_objs; /* objects fewer than data_shards of them have answered for */
+    if (holders == NULL) {
+        error("malloc");
+    }
+    bzero(conns, sizeof(conns));
+    for (int j = 0; j < num_srvs; j++) {
+        versions[j] = calloc(num_objs + 1, sizeof(request));
+        if (versions[j] == NULL) {
+            error("malloc");
+        }
+        for (int i = 0; i < num_objs; i++) {
+            versions[j][i].obj = i;
+            snprintf(versions[j][i].name, sizeof(versions[j][i].name), "%s", objs[i].name);
+        }
+    }
+
+    for (;;) {
+        struct pollfd pfds[MAX_SRVS];
+        int which[MAX_SRVS];
+        int num_pfds = 0;
+        double now = now_sec(), wait = VERSIONS_WAIT;
+        double limit = versions_limit(samples, num_samples, short_of);
+        for (int j = 0; j < num_srvs; j++) {
+            versions_conn *c = &conns[j];
+            while (serversockfds[j] != -1 && c->sent < num_objs && c->sent - c->done < PIPELINE_DEPTH) {
+                if (c->sent == c->done) {
+                    c->started = now;
+                }
+                if (send_versions(serversockfds[j], c->sent + 1, versions[j][c->sent].name) == -1) {
+                    printf("Listing from server %s failed\n", servers[j].name);
+                    close(serversockfds[j]);
+                    serversockfds[j] = -1;
+                }
+                c->sent++;
+            }
+            if (serversockfds[j] == -1 || c->done == c->sent) {
+                continue;
             }
+            pfds[num_pfds].fd = serversockfds[j];
+            pfds[num_pfds].events = POLLIN;
+            which[num_pfds++] = j;
+            double left = c->started + limit - now;
+            wait = left < wait ? left : wait;
+        }
+        if (num_pfds == 0) {
+            break;
+        }
+        poll(pfds, num_pfds, wait > 0 ? (int) (wait * 1000) + 1 : 0);
+        for (int p = 0; p < num_pfds; p++) {
+            int j = which[p];
+            int before = conns[j].done;
+            if (pfds[p].revents != 0 &&
+                recv_versions(serversockfds[j], &conns[j], versions[j], samples, &num_samples) == -1) {
+                printf("Listing from server %s failed\n", servers[j].name);
+                close(serversockfds[j]);
+                serversockfds[j] = -1;
+            }
+            for (int i = before; i < conns[j].done; i++) {
+                if (versions[j][i].reply != NULL && versions[j][i].reply[0] != '\0' &&
+                    ++holders[i] == data_shards) {
+                    short_of--;
+                }
+            }
+        }
 
-            // get length of file
-            int sz = lseek(fd, 0, SEEK_END);
-            // determine the size of each chunk
-            int chunk_sz = sz / NUM_SRVS;
-            int rem = sz % NUM_SRVS;
-
-            // calculate chunk offsets
-            int offsets[NUM_SRVS];
-            int chunk_szs[NUM_SRVS];
-            int offset = 0;
-            for (int j = 0; j < NUM_SRVS; j++) {
-                offsets[j] = offset;
-                offset += chunk_sz;
-                chunk_szs[j] = chunk_sz;
-            }
-            chunk_szs[NUM_SRVS - 1] += rem;
-
-            // send data to appropriate servers
-            int j = bucket_num;
-            int chunk_i = 0;
-            // get milliseconds since epoch
-            struct timeval tv;
-            gettimeofday(&tv, NULL);
-            long long curr_time = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
-            
-            while(1) {
-                if(serversockfds[j] != -1) {
-                    // build command msg FORMAT: timestamp_chunk#_filename.ext
-                    char *msg = calloc(1, 200);
-                    sprintf(msg, "PUT %lld_%d_%s %lld_%d_%s", curr_time, chunk_i, fn, curr_time, (chunk_i + 1) % NUM_SRVS, fn);
-                    printf("%s\n", msg);
-                    // send cmd msg
-                    int len = strlen(msg);
-                    send_all(serversockfds[j], &len, msg);
-                    free(msg);
-
-                    int next_chunk_i = (chunk_i + 1) % NUM_SRVS;
-
-                    // send chunk 1
-                    off_t chunk1_offset = offsets[chunk_i];
-                    int chunk1_sz = chunk_szs[chunk_i];
-                    // send chunk sz
-                    send(serversockfds[j], &chunk1_sz, sizeof(int), 0);
-                    // send chunk
-                    int sent_bytes = 0;
-                    int n;
-                    while (sent_bytes < chunk1_sz) {
-                        n = sendfile(serversockfds[j], fd, &chunk1_offset, chunk1_sz - sent_bytes);
-                        if (n < 0) {
-                            error("Sendfile failed");
-                        }
-                        sent_bytes += n;
-                    }
+        // the servers that are holding things up and can be done without
+        now = now_sec();
+        limit = versions_limit(samples, num_samples, short_of);
+        for (int j = 0; j < num_srvs; j++) {
+            versions_conn *c = &conns[j];
+            if (serversockfds[j] != -1 && c->done < c->sent && now - c->started > limit) {
+                printf("Server %s is slow to list versions, going on without it\n", servers[j].name);
+                for (int i = c->done; i < c->sent; i++) {
+                    free(versions[j][i].reply);
+                    versions[j][i].reply = NULL;
+                }
+                close(serversockfds[j]);
+                serversockfds[j] = connect_server(j);
+                c->sent = c->done = num_objs;
+            }
+        }
+    }
+    free(holders);
+}
 
-                    // send chunk 2
-                    off_t chunk2_offset = offsets[next_chunk_i];
-                    int chunk2_sz = chunk_szs[next_chunk_i];
-                    // send chunk_sz
-                    send(serversockfds[j], &chunk2_sz, sizeof(int), 0);
-                    // send chunk
-                    sent_bytes = 0;
-                    while (sent_bytes < chunk2_sz) {
-                        n = sendfile(serversockfds[j], fd, &chunk2_offset, chunk2_sz - sent_bytes);
-                        if (n < 0) {
-                            error("Sendfile failed");
-                        }
-                        sent_bytes += n;
+// fetch objects: pick each one's newest version with enough shards and
+// fetch data_shards of its shards, each from the server expected to send
+// it soonest given how fast each has been and what it has queued. One
+// process talks to all servers at once; a request outstanding for longer
+// than 95% of recent ones is hedged by asking another server for another
+// shard of the object, and whichever shards arrive first are used. Data
+// shards go straight to the object's place, parity shards and all the
+// headers into a scratch file, and whatever data shards were not fetched
+// are rebuilt from them. Objects with fd -1 are laid out one after the
+// other in stage_fd. Returns how many failed
+int fetch_objects(int *serversockfds, object *objs, int num_objs, int stage_fd) {
+    request *versions[MAX_SRVS];
+    list_versions(serversockfds, objs, num_objs, versions);
+
+    get_sched s;
+    bzero(&s, sizeof(s));
+    s.socks = serversockfds;
+    s.objs = objs;
+    s.nsh = data_shards + parity_shards;
+    s.ts = calloc(num_objs + 1, sizeof(*s.ts));
+    s.holders = calloc((size_t) (num_objs + 1) * s.nsh, sizeof(uint64_t));
+    s.asked = calloc((size_t) (num_objs + 1) * s.nsh, sizeof(uint64_t));
+    s.got = calloc(num_objs + 1, sizeof(int));
+    s.outstanding = calloc(num_objs + 1, sizeof(int));
+    s.busy = calloc((size_t) (num_objs + 1) * s.nsh, sizeof(int));
+    s.failed = calloc(num_objs + 1, sizeof(int));
+    s.conns = calloc(num_srvs, sizeof(get_conn));
+    s.remaining = num_objs;
+    s.scratch = scratch_file();
+    if (s.ts == NULL || s.holders == NULL || s.asked == NULL || s.got == NULL || s.outstanding == NULL ||
+        s.busy == NULL || s.failed == NULL || s.conns == NULL) {
+        error("malloc");
+    }
+
+    off_t scratch_end = 0, stage_end = 0;
+    int planned = 0;
+    while (s.remaining > 0) {
+        // lay out and ask for objects while the servers have little queued,
+        // so the later ones are placed knowing how fast each server is
+        int load = 0, num_up = 0;
+        for (int j = 0; j < num_srvs; j++) {
+            load += conn_load(&s.conns[j]);
+            num_up += serversockfds[j] != -1;
+        }
+        for (; planned < num_objs && (load < 2 * PIPELINE_DEPTH * num_up || num_up == 0); planned++) {
+            int i = planned;
+            object *o = &objs[i];
+            off_t shard_sz;
+            if (newest_version(versions, i, s.ts[i], &shard_sz) == -1 || shard_sz < (off_t) sizeof(shard_hdr)) {
+                o->failed = OBJ_INCOMPLETE;
+                s.remaining--;
+                continue;
+            }
+            o->shard_len = shard_sz - sizeof(shard_hdr);
+            if (o->fd == -1) {
+                o->fd = stage_fd;
+                o->base = stage_end;
+                stage_end += data_shards * o->shard_len;
+            }
+            o->scratch_off = scratch_end;
+            scratch_end += EC_MAX_SHARDS * sizeof(shard_hdr) + parity_shards * o->shard_len;
+            for (int c = 0; c < s.nsh; c++) {
+                char name[MAX_FILENAME_LEN + 32];
+                snprintf(name, sizeof(name), "%s_%d_%s", s.ts[i], c, o->name);
+                for (int j = 0; j < num_srvs; j++) {
+                    if (has_chunk(versions[j][i].reply, name)) {
+                        s.holders[i * s.nsh + c] |= 1ULL << j;
                     }
                 }
-                // iterate chunk index and conn index
-                chunk_i = (chunk_i + 1) % NUM_SRVS;
-                if (chunk_i == 0) {
-                    break;
-                }
-                j = (j + 1) % NUM_SRVS;
             }
-            // close file
-            close(fd);
+            int before = s.outstanding[i];
+            refill(&s, i, -1, 0);
+            load += s.outstanding[i] - before;
+        }
+
+        struct pollfd pfds[MAX_SRVS];
+        int which[MAX_SRVS];
+        int num_pfds = 0;
+        double now = now_sec(), wait = 1;
+        for (int j = 0; j < num_srvs; j++) {
+            send_queued(&s, j);
+            get_conn *c = &s.conns[j];
+            if (serversockfds[j] == -1 || c->n == 0) {
+                continue;
+            }
+            pfds[num_pfds].fd = serversockfds[j];
+            pfds[num_pfds].events = POLLIN;
+            which[num_pfds++] = j;
+            if (s.threshold > 0 && !c->hedged[(c->head + c->n - 1) % PIPELINE_DEPTH]) {
+                double left = c->started + s.threshold - now;
+                wait = left < wait ? left : wait;
+            }
+        }
+        if (num_pfds == 0) {
+            if (planned == num_objs) {
+                break;
+            }
+            continue;
+        }
+        poll(pfds, num_pfds, wait > 0 ? (int) (wait * 1000) + 1 : 0);
+        for (int p = 0; p < num_pfds; p++) {
+            int j = which[p];
+            if (pfds[p].revents != 0 && serversockfds[j] != -1 && recv_some(&s, j) == -1) {
+                server_down(&s, j);
+            }
+        }
+
+        // hedge the servers that have been on one request too long
+        now = now_sec();
+        for (int j = 0; j < num_srvs && s.threshold > 0; j++) {
+            get_conn *c = &s.conns[j];
+            if (serversockfds[j] != -1 && c->n > 0 && now - c->started > s.threshold &&
+                (!c->hedged[(c->head + c->n - 1) % PIPELINE_DEPTH] || conn_load(c) > c->n)) {
+                hedge_server(&s, j);
+            }
         }
     }
-    else {
-        printf("Invalid command. Please retry.\n");    
-        return -1;    
+
+    // requests still in flight lost the race: the server is cut off
+    // mid-reply and connected to afresh
+    for (int j = 0; j < num_srvs; j++) {
+        get_conn *c = &s.conns[j];
+        if (serversockfds[j] != -1 && (c->n > 0 || c->hdr_got > 0)) {
+            close(serversockfds[j]);
+            serversockfds[j] = connect_server(j);
+        }
+        free(c->todo.reqs);
+        free(c->hedges.reqs);
+    }
+    free_versions(versions, num_objs);
+
+    int num_failed = 0;
+    for (int i = 0; i < num_objs; i++) {
+        object *o = &objs[i];
+        if (!o->failed && (s.failed[i] || check_shards(s.scratch, o) == -1 ||
+            ec_decode(o->fd, o->base, o->size, s.scratch, o->scratch_off + EC_MAX_SHARDS * sizeof(shard_hdr),
+                data_shards, parity_shards, o->have) == -1)) {
+            o->failed = OBJ_FAILED;
+        }
+        num_failed += o->failed != 0;
+    }
+    close(s.scratch);
+    free(s.ts);
+    free(s.holders);
+    free(s.asked);
+    free(s.got);
+    free(s.outstanding);
+    free(s.busy);
+    free(s.failed);
+    free(s.conns);
+    return num_failed;
+}
+
+// queue the shards of the size bytes at base in fd as version ts of key:
+// shard c goes to the c-th ranked server for key; a server that is down
+// passes its shard on to the next one in the ranking, and rebalance puts
+// it back later. Parity shards are encoded by the worker sending them, as
+// they go out. -1 if fewer than data_shards servers can take one
+int queue_object(int *serversockfds, queue *qs, int obj, char *ts, char *key, int fd, off_t base, off_t size) {
+    int order[MAX_SRVS];
+    int num_up = 0;
+    for (int j = 0; j < num_srvs; j++) {
+        num_up += serversockfds[j] != -1;
+    }
+    if (num_up < data_shards) {
+        return -1;
+    }
+    off_t shard_len = ec_shard_len(size, data_shards);
+
+    rank_servers(key, order);
+    for (int c = 0, rank = 0; c < data_shards + parity_shards && rank < num_srvs; c++, rank++) {
+        while (rank < num_srvs && serversockfds[order[rank]] == -1) {
+            rank++;
+        }
+        if (rank == num_srvs) {
+            break;
+        }
+        // chunk name FORMAT: timestamp_chunk#_filename.ext
+        request *r = queue_add(&qs[order[rank]]);
+        r->obj = obj;
+        r->chunk_num = c;
+        if (c < data_shards) {
+            // the last data shards run past the end of the object
+            r->fd = fd;
+            r->offset = base + c * shard_len;
+            r->sz = size - c * shard_len < 0 ? 0 : size - c * shard_len < shard_len ? size - c * shard_len : shard_len;
+            r->pad = shard_len - r->sz;
+        } else {
+            r->fd = fd;
+            r->offset = base;
+            r->sz = shard_len;
+            r->obj_size = size;
+        }
+        memcpy(r->hdr.magic, SHARD_MAGIC, sizeof(r->hdr.magic));
+        r->hdr.k = data_shards;
+        r->hdr.m = parity_shards;
+        r->hdr.index = c;
+        r->hdr.size = htobe64(size);
+        snprintf(r->name, sizeof(r->name), "%s_%d_%s", ts, c, key);
     }
     return 0;
 }
 
 int conn_to_servers(int *serversockfds) {
 
-    char hosts[NUM_SRVS][30];
-    int ports[NUM_SRVS];
-
     // Open file
     FILE *fp;
     char *fn = (char*)malloc(50);
@@ -468,65 +1363,681 @@ int conn_to_servers(int *serversockfds) {
     free(fn);
     if(fp == NULL) {
         printf("Failed to open file\n");
-        return -1;
+        exit(1);
     }
 
-    // read config file and extract hosts and ports
-    for(int i = 0; i < NUM_SRVS; i++) {
-        char str[50];
-        if (fscanf(fp, "%*s %*s %s", str) == 0) {
-            printf("Reading from file failed.\n");
-            fclose(fp);
-            return -1;
+    // read config file: the servers, and optionally how files are coded
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char key[16], name[32], addr[50];
+        if (sscanf(line, "%15s", key) != 1) {
+            continue;
+        }
+        if (strcmp(key, "server") == 0 && num_srvs < MAX_SRVS) {
+            server *s = &servers[num_srvs];
+            s->weight = 1;
+            if (sscanf(line, "%*s %31s %49s %lf", name, addr, &s->weight) < 2 || strchr(addr, ':') == NULL ||
+                s->weight <= 0) {
+                printf("Bad server line: %s", line);
+                exit(1);
+            }
+            char *host = strtok(addr, ":");
+            char *port = strtok(NULL, "\n");
+            snprintf(s->name, sizeof(s->name), "%s", name);
+            snprintf(s->host, sizeof(s->host), "%s", host);
+            sscanf(port, "%d", &s->port);
+            num_srvs++;
+        } else if (strcmp(key, "erasure") == 0) {
+            if (sscanf(line, "%*s %d %d", &data_shards, &parity_shards) != 2 || data_shards < 1 ||
+                parity_shards < 0) {
+                printf("Bad erasure line: %s", line);
+                exit(1);
+            }
         }
-        char *host = strtok(str, ":");
-        char *port = strtok(NULL, "\n");
-        strcpy(hosts[i], host);
-        sscanf(port, "%d", &ports[i]);
     }
     fclose(fp);
+    if (data_shards + parity_shards > num_srvs) {
+        printf("erasure %d %d needs at least %d servers\n", data_shards, parity_shards,
+            data_shards + parity_shards);
+        exit(1);
+    }
+
+    for (int i = 0; i < num_srvs; i++) {
+        serversockfds[i] = connect_server(i);
+    }
+    return 0;
+}
+
+// a connection to server i, -1 if it can't be reached
+int connect_server(int i) {
+    // create socket
+    struct sockaddr_in serveraddr;
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        printf("ERROR opening socket\n");
+        return -1;
+    }
+
+    /*
+    * build the server's Internet address
+    */
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = inet_addr(servers[i].host);
+    serveraddr.sin_port = htons(servers[i].port);
+
+    //Connection to the socket
+    if (connect(sockfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+        printf("Problem in connecting to the server, retrying...\n");
+        close(sockfd);
+        return -1;
+    }
+    // requests are small and pipelined, don't let them wait for acks
+    int optval = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    return sockfd;
+}
+
+void send_all(int connfd, void *data, size_t sz) {
+    ssize_t n;
+    size_t bytes_sent = 0;
+    while (bytes_sent < sz) {
+        n = send(connfd, (char *) data + bytes_sent, sz - bytes_sent, 0);
+        if (n <= 0) {
+            error("Send failed");
+        }
+        bytes_sent += n;
+    }
+}
+
+void recv_all(int connfd, void *data, size_t sz) {
+    ssize_t n;
+    size_t bytes_recv = 0;
+    while (bytes_recv < sz) {
+        n = recv(connfd, (char *) data + bytes_recv, sz - bytes_recv, 0);
+        if (n <= 0) {
+            error("Recv failed");
+        }
+        bytes_recv += n;
+    }
+}
+
+// encode parity shard r->hdr.index of its object a block at a time and
+// send each block as it is done, so the encoding of one block overlaps the
+// sending of the last
+static void send_parity(int sockfd, request *r) {
+    static uint8_t *data, *out;
+    if (data == NULL && ((data = malloc((size_t) r->hdr.k * EC_BLOCK)) == NULL ||
+        (out = malloc(EC_BLOCK)) == NULL)) {
+        error("malloc");
+    }
+    for (off_t off = 0; off < r->sz; off += EC_BLOCK) {
+        size_t n = r->sz - off < EC_BLOCK ? r->sz - off : EC_BLOCK;
+        if (ec_encode_block(r->fd, r->offset, r->obj_size, r->hdr.k, r->hdr.index - r->hdr.k, off, n,
+            data, out) == -1) {
+            error("read");
+        }
+        send_all(sockfd, out, n);
+    }
+}
+
+// send request id: header, name, and for a put the shard header and data,
+// the data straight from its file; sendfile takes the offset explicitly so
+// workers can share the file
+void send_request(int sockfd, int op, uint32_t id, request *r) {
+    static char zeros[BUFSIZE];
+    frame_hdr h;
+    int namelen = strlen(r->name);
+    off_t data_len = op == OP_PUT ? sizeof(shard_hdr) + r->sz + r->pad : op == OP_LIST || op == OP_LIST_CHUNKS ? strlen(r->cursor) : 0;
+    h.version = FRAME_VERSION;
+    h.op = op;
+    h.status = 0;
+    h.namelen = namelen;
+    h.id = htonl(id);
+    h.len = htobe64(namelen + data_len);
+    char buf[sizeof(h) + sizeof(r->name) + sizeof(shard_hdr) + sizeof(r->cursor)];
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), r->name, namelen);
+    int extra = 0;
+    if (op == OP_PUT) {
+        memcpy(buf + sizeof(h) + namelen, &r->hdr, sizeof(shard_hdr));
+        extra = sizeof(shard_hdr);
+    } else if (op == OP_LIST || op == OP_LIST_CHUNKS) {
+        extra = data_len;
+        memcpy(buf + sizeof(h) + namelen, r->cursor, extra);
+    }
+    send_all(sockfd, buf, sizeof(h) + namelen + extra);
+    if (op != OP_PUT) {
+        return;
+    }
+    if (r->obj_size > 0) {
+        send_parity(sockfd, r);
+        return;
+    }
+
+    off_t offset = r->offset;
+    off_t sent_bytes = 0;
+    while (sent_bytes < r->sz) {
+        ssize_t n = sendfile(sockfd, r->fd, &offset, r->sz - sent_bytes);
+        if (n <= 0) {
+            error("Sendfile failed");
+        }
+        sent_bytes += n;
+    }
+    for (off_t left = r->pad; left > 0; left -= BUFSIZE) {
+        send_all(sockfd, zeros, left < BUFSIZE ? left : BUFSIZE);
+    }
+}
+
+// take in the payload of a reply to r: text is kept, a shard's header
+// written to its hdr_fd and its data at the shard's place in r->fd. -1 if
+// the server refused the request
+int recv_reply(int sockfd, int op, frame_hdr *h, request *r) {
+    char buf[BUFSIZE];
+    off_t len = be64toh(h->len);
+
+    if (h->status == ST_OK && (op == OP_LIST || op == OP_LIST_CHUNKS || op == OP_VERSIONS)) {
+        r->reply = malloc(len + 1);
+        if (r->reply == NULL) {
+            error("malloc");
+        }
+        recv_all(sockfd, r->reply, len);
+        r->reply[len] = '\0';
+        return 0;
+    }
+
+    int keep = h->status == ST_OK && op == OP_GET && len >= (off_t) sizeof(shard_hdr);
+    off_t bytes_recv = 0;
+    if (keep) {
+        shard_hdr sh;
+        recv_all(sockfd, &sh, sizeof(sh));
+        if (pwrite(r->hdr_fd, &sh, sizeof(sh), r->hdr_offset) != sizeof(sh)) {
+            error("write");
+        }
+        bytes_recv = sizeof(sh);
+    }
+
+    // recv file data
+    while (bytes_recv < len) {
+        int recv_sz = len - bytes_recv < BUFSIZE ? len - bytes_recv : BUFSIZE;
+        int n = recv(sockfd, buf, recv_sz, 0);
+        if (n <= 0) {
+            error("Recv file failed");
+        }
+        // write shard, up to the limit
+        off_t pos = r->offset + bytes_recv - sizeof(shard_hdr);
+        int want = r->limit == 0 || pos + n <= r->limit ? n : pos < r->limit ? r->limit - pos : 0;
+        if (keep && want > 0 && pwrite(r->fd, buf, want, pos) != want) {
+            error("write");
+        }
+        bytes_recv += n;
+    }
+    return h->status == ST_OK && (op != OP_GET || keep) ? 0 : -1;
+}
+
+// run requests over one server connection, keeping up to PIPELINE_DEPTH of
+// them in flight; marks each one that failed with file = -1 and returns
+// how many did
+int pipeline(int sockfd, int op, request *reqs, int num_reqs) {
+    int sent = 0;
+    int done = 0;
+    int failed = 0;
+    while (done < num_reqs) {
+        while (sent < num_reqs && sent - done < PIPELINE_DEPTH) {
+            send_request(sockfd, op, sent + 1, &reqs[sent]);
+            sent++;
+        }
+        frame_hdr h;
+        recv_all(sockfd, &h, sizeof(h));
+        uint32_t id = ntohl(h.id);
+        if (h.version != FRAME_VERSION || id < 1 || id > (uint32_t) sent || h.op != op) {
+            printf("Unexpected reply\n");
+            return num_reqs;
+        }
+        if (recv_reply(sockfd, op, &h, &reqs[id - 1]) == -1) {
+            reqs[id - 1].obj = -1;
+            failed++;
+        }
+        done++;
+    }
+    return failed;
+}
 
-    for (int i = 0; i < NUM_SRVS; i++) {
-        // create socket
-        struct sockaddr_in serveraddr;
-        if ((serversockfds[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            printf("ERROR opening socket\n");
+// one worker process per server with requests, each pipelining its
+// server's share; an object is marked failed if any of its requests
+// failed or its worker died
+int run_workers(int *serversockfds, int op, queue *qs, int *failed) {
+    pid_t pids[MAX_SRVS];
+    int pipes[MAX_SRVS][2];
+    fflush(stdout);
+    for (int j = 0; j < num_srvs; j++) {
+        pids[j] = -1;
+        if (qs[j].n == 0) {
             continue;
         }
+        // the worker writes back the object of every request that failed
+        if (pipe(pipes[j]) == -1 || (pids[j] = fork()) == -1) {
+            error("fork");
+        }
+        if (pids[j] == 0) {
+            close(pipes[j][0]);
+            int *objs = malloc(qs[j].n * sizeof(int));
+            for (int i = 0; i < qs[j].n; i++) {
+                objs[i] = qs[j].reqs[i].obj;
+            }
+            pipeline(serversockfds[j], op, qs[j].reqs, qs[j].n);
+            for (int i = 0; i < qs[j].n; i++) {
+                if (qs[j].reqs[i].obj == -1) {
+                    write(pipes[j][1], &objs[i], sizeof(int));
+                }
+            }
+            exit(0);
+        }
+        close(pipes[j][1]);
+    }
 
-        /*
-        * build the server's Internet address
-        */
-        bzero((char *) &serveraddr, sizeof(serveraddr));
-        serveraddr.sin_family = AF_INET;
-        serveraddr.sin_addr.s_addr = inet_addr(hosts[i]);
-        serveraddr.sin_port = htons(ports[i]);
+    int num_failed = 0;
+    for (int j = 0; j < num_srvs; j++) {
+        if (pids[j] == -1) {
+            continue;
+        }
+        int obj;
+        while (read(pipes[j][0], &obj, sizeof(int)) == sizeof(int)) {
+            failed[obj] = 1;
+        }
+        close(pipes[j][0]);
+        int status;
+        if (waitpid(pids[j], &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            for (int i = 0; i < qs[j].n; i++) {
+                failed[qs[j].reqs[i].obj] = 1;
+            }
+            num_failed++;
+        }
+    }
+    return num_failed;
+}
+
+// the newest version of an object with at least data_shards of its
+// shards, all the same size, on the servers, from their VERSIONS replies
+// ("timestamp_chunk#_filename size" lines): its timestamp and the size of
+// its shards. -1 if there is none
+int newest_version(request **versions, int obj, char *ts, off_t *shard_sz) {
+    long long stamps[MAX_VERSIONS];
+    uint64_t have[MAX_VERSIONS];
+    off_t szs[MAX_VERSIONS];
+    int num_ts = 0;
 
-        //Connection to the socket
-        if (connect(serversockfds[i], (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
-            printf("Problem in connecting to the server, retrying...\n");
-            serversockfds[i] = -1;
+    for (int j = 0; j < num_srvs; j++) {
+        for (char *line = versions[j][obj].reply; line != NULL && *line != '\0'; ) {
+            long long stamp;
+            int chunk_num;
+            long long sz;
+            char *end = strchr(line, '\n');
+            if (sscanf(line, "%lld_%d_%*s %lld", &stamp, &chunk_num, &sz) == 3 &&
+                chunk_num >= 0 && chunk_num < EC_MAX_SHARDS) {
+                int k = 0;
+                while (k < num_ts && stamps[k] != stamp) {
+                    k++;
+                }
+                if (k == num_ts && num_ts < MAX_VERSIONS) {
+                    stamps[k] = stamp;
+                    have[k] = 0;
+                    szs[k] = sz;
+                    num_ts++;
+                }
+                if (k < num_ts && szs[k] == sz) {
+                    have[k] |= 1ULL << chunk_num;
+                }
+            }
+            line = end != NULL ? end + 1 : NULL;
+        }
+    }
+
+    int max_i = -1;
+    for (int k = 0; k < num_ts; k++) {
+        if (__builtin_popcountll(have[k]) >= data_shards && (max_i == -1 || stamps[k] > stamps[max_i])) {
+            max_i = k;
+        }
+    }
+    if (max_i == -1) {
+        return -1;
+    }
+    sprintf(ts, "%lld", stamps[max_i]);
+    *shard_sz = szs[max_i];
+    return 0;
+}
+
+// an unlinked scratch file
+int scratch_file(void) {
+    char path[] = "/tmp/dfc.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        error("mkstemp");
+    }
+    unlink(path);
+    return fd;
+}
+
+// check the headers of the shards fetched for an object, kept in hdr_fd,
+// agree with each other and with how the client codes objects; its size
+// goes in o->size
+int check_shards(int hdr_fd, object *o) {
+    for (int c = 0, first = 1; c < data_shards + parity_shards; c++) {
+        shard_hdr sh;
+        if (!o->have[c]) {
             continue;
         }
+        if (pread(hdr_fd, &sh, sizeof(sh), o->scratch_off + c * sizeof(sh)) != sizeof(sh) ||
+            memcmp(sh.magic, SHARD_MAGIC, sizeof(sh.magic)) != 0 || sh.index != c) {
+            printf("Bad shard %d of %s\n", c, o->name);
+            return -1;
+        }
+        if (sh.k != data_shards || sh.m != parity_shards) {
+            printf("%s stored with erasure %d %d, not %d %d\n", o->name, sh.k, sh.m, data_shards, parity_shards);
+            return -1;
+        }
+        off_t sz = be64toh(sh.size);
+        if ((!first && sz != o->size) || ec_shard_len(sz, data_shards) != o->shard_len) {
+            printf("Shards of different versions of %s\n", o->name);
+            return -1;
+        }
+        o->size = sz;
+        first = 0;
     }
     return 0;
 }
 
-void send_all(int connfd, int *sz, char *data) {
-    if (send(connfd, sz, sizeof(int), 0) == -1) {
-        error("Length send failed");
-    } 
-    int n;
-    int bytes_sent = 0;
-    int bytes_to_send = *sz;
-    while (bytes_sent < bytes_to_send) {
-        n = send(connfd, data + bytes_sent, bytes_to_send - bytes_sent, 0);
-        if (n == -1) {
-            error("Chunk send failed");
+// true if a VERSIONS reply lists the chunk name
+int has_chunk(char *reply, char *name) {
+    int len = strlen(name);
+    for (char *line = reply; line != NULL && *line != '\0'; ) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            return 1;
         }
-        bytes_sent += n;
+        line = strchr(line, '\n');
+        line = line != NULL ? line + 1 : NULL;
+    }
+    return 0;
+}
+
+// the names in a LIST reply to r, after its cursor line; r->cursor is
+// moved on and *more says whether there are further pages. NULL if the
+// reply is malformed
+char *list_page(request *r, int *more) {
+    char state[8], cursor[sizeof(r->cursor)];
+    char *names = r->reply != NULL ? strchr(r->reply, '\n') : NULL;
+    if (names == NULL || sscanf(r->reply, "%7s %16s", state, cursor) != 2) {
+        return NULL;
+    }
+    *more = strcmp(state, "more") == 0;
+    snprintf(r->cursor, sizeof(r->cursor), "%s", cursor);
+    return names + 1;
+}
+
+// print every file whose name starts with prefix, marked [incomplete] if
+// fewer than data_shards of its shards are on the servers. All servers
+// page through their listings at once; since they go in the same hash
+// order, a file is printed and forgotten as soon as every server's cursor
+// has passed it, so only a few pages' worth of files is held at a time
+int list_all(int *serversockfds, char *prefix) {
+    request reqs[MAX_SRVS];
+    int more[MAX_SRVS];
+    ls_file *files[LS_BUCKETS] = {NULL};
+
+    for (int j = 0; j < num_srvs; j++) {
+        bzero(&reqs[j], sizeof(reqs[j]));
+        snprintf(reqs[j].name, sizeof(reqs[j].name), "%s", prefix);
+        more[j] = serversockfds[j] != -1;
+    }
+    for (int pending = 1; pending; ) {
+        // the next page from every server still listing, all in flight
+        // together
+        for (int j = 0; j < num_srvs; j++) {
+            if (more[j]) {
+                send_request(serversockfds[j], OP_LIST, 1, &reqs[j]);
+            }
+        }
+        pending = 0;
+        uint64_t bound = UINT64_MAX;
+        for (int j = 0; j < num_srvs; j++) {
+            if (!more[j]) {
+                continue;
+            }
+            frame_hdr h;
+            recv_all(serversockfds[j], &h, sizeof(h));
+            char *names = NULL;
+            if (h.version != FRAME_VERSION || h.op != OP_LIST || recv_reply(serversockfds[j], OP_LIST, &h, &reqs[j]) == -1 ||
+                (names = list_page(&reqs[j], &more[j])) == NULL) {
+                printf("Listing %s failed\n", servers[j].name);
+                more[j] = 0;
+            }
+            for (char *line = names != NULL ? strtok(names, "\n") : NULL; line != NULL; line = strtok(NULL, "\n")) {
+                // FORMAT: timestamp_chunk#_filename.ext; chunks, version 0
+                // of their hash, are only listed by servers that predate
+                // LIST_CHUNKS
+                long long ts;
+                int n;
+                char *fn = strchr(line, '_');
+                fn = fn != NULL ? strchr(fn + 1, '_') : NULL;
+                if (fn == NULL || sscanf(line, "%lld_%d_", &ts, &n) != 2 || ts == 0 || n < 0 || n >= EC_MAX_SHARDS) {
+                    continue;
+                }
+                fn++;
+                uint64_t hash = list_hash(fn);
+                ls_file **bucket = &files[hash % LS_BUCKETS];
+                ls_file *f = *bucket;
+                while (f != NULL && strcmp(f->fn, fn) != 0) {
+                    f = f->next;
+                }
+                if (f == NULL) {
+                    if ((f = malloc(sizeof(ls_file))) == NULL) {
+                        error("malloc");
+                    }
+                    snprintf(f->fn, sizeof(f->fn), "%s", fn);
+                    f->hash = hash;
+                    f->shards = 0;
+                    f->next = *bucket;
+                    *bucket = f;
+                }
+                f->shards |= 1ULL << n;
+            }
+            free(reqs[j].reply);
+            reqs[j].reply = NULL;
+            if (more[j]) {
+                uint64_t cursor = strtoull(reqs[j].cursor, NULL, 16);
+                bound = cursor < bound ? cursor : bound;
+                pending = 1;
+            }
+        }
+
+        // every server has listed all files hashing below the lowest
+        // cursor; once none has more, all of them
+        for (int b = 0; b < LS_BUCKETS; b++) {
+            for (ls_file **p = &files[b], *f; (f = *p) != NULL; ) {
+                if (pending && f->hash >= bound) {
+                    p = &f->next;
+                    continue;
+                }
+                // any data_shards of the shards are enough
+                printf("%s%s\n", f->fn, __builtin_popcountll(f->shards) < data_shards ? "[incomplete]" : "");
+                *p = f->next;
+                free(f);
+            }
+        }
+    }
+    return 0;
+}
+
+// splitmix64's finalizer, to spread djb2 hashes over all 64 bits
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// weighted rendezvous hashing: every server scores the file by hashing its
+// name with the file's, scaled by its weight, and order gets the servers
+// best first. A file's shards go to the first data_shards + parity_shards,
+// so adding or removing a server only moves shards of files it ranks (or
+// ranked) among those
+void rank_servers(char *fn, int *order) {
+    double score[MAX_SRVS];
+    uint64_t h = mix64(hash(fn));
+    for (int j = 0; j < num_srvs; j++) {
+        uint64_t x = mix64(h ^ hash(servers[j].name));
+        double u = ((x >> 11) + 0.5) / (double) (1ULL << 53); // in (0, 1)
+        score[j] = -servers[j].weight / log(u);
+        order[j] = j;
+    }
+    for (int i = 1; i < num_srvs; i++) {
+        for (int k = i; k > 0 && score[order[k]] > score[order[k - 1]]; k--) {
+            int t = order[k];
+            order[k] = order[k - 1];
+            order[k - 1] = t;
+        }
+    }
+}
+
+/* a shard found on a server by rebalance */
+typedef struct {
+    long long ts;
+    int shard;
+    int srv;
+    char fn[MAX_FILENAME_LEN];
+} stored_shard;
+
+static int cmp_stored(const void *a, const void *b) {
+    const stored_shard *x = a, *y = b;
+    int c = strcmp(x->fn, y->fn);
+    return c != 0 ? c : x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+// copy a shard from one server to another through a scratch file, then
+// delete the original
+int move_shard(int *serversockfds, stored_shard *s, int to) {
+    request r;
+    struct stat st;
+    bzero(&r, sizeof(r));
+    snprintf(r.name, sizeof(r.name), "%lld_%d_%s", s->ts, s->shard, s->fn);
+    r.fd = r.hdr_fd = scratch_file();
+    r.offset = sizeof(shard_hdr);
+    r.hdr_offset = 0;
+    int ret = -1;
+    if (pipeline(serversockfds[s->srv], OP_GET, &r, 1) == 0 && fstat(r.fd, &st) == 0 &&
+        pread(r.fd, &r.hdr, sizeof(r.hdr), 0) == sizeof(r.hdr)) {
+        r.obj = 0;
+        r.sz = st.st_size - sizeof(shard_hdr);
+        if (pipeline(serversockfds[to], OP_PUT, &r, 1) == 0 &&
+            pipeline(serversockfds[s->srv], OP_DELETE, &r, 1) == 0) {
+            printf("MOVE %s %s -> %s\n", r.name, servers[s->srv].name, servers[to].name);
+            ret = 0;
+        }
+    }
+    close(r.fd);
+    return ret;
+}
+
+// put every shard back on one of its file's best ranked servers: a shard
+// elsewhere moves to one of them holding none of its version, or is
+// deleted if one already has a copy. Each shard is copied before the
+// original goes, so files stay readable throughout. Returns the number of
+// shards that could not be moved
+int rebalance(int *serversockfds) {
+    stored_shard *stored = NULL;
+    int num_stored = 0, cap = 0;
+    static const int list_ops[] = {OP_LIST, OP_LIST_CHUNKS};
+    for (int j = 0; j < num_srvs; j++) {
+        // the server's files, then its chunks, which LIST leaves out
+        for (int l = 0; l < 2; l++) {
+            request req;
+            bzero(&req, sizeof(req));
+            // every page of the listing
+            for (int more = serversockfds[j] != -1; more; ) {
+                char *names;
+                if (pipeline(serversockfds[j], list_ops[l], &req, 1) != 0 || (names = list_page(&req, &more)) == NULL) {
+                    free(req.reply);
+                    break;
+                }
+                for (char *line = strtok(names, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+                    if (num_stored == cap) {
+                        cap = cap ? cap * 2 : 256;
+                        stored = realloc(stored, cap * sizeof(stored_shard));
+                        if (stored == NULL) {
+                            error("malloc");
+                        }
+                    }
+                    stored_shard *s = &stored[num_stored];
+                    char fn[MAX_FILENAME_LEN];
+                    // FORMAT: timestamp_chunk#_filename.ext
+                    if (sscanf(line, "%lld_%d_%127[^\n]", &s->ts, &s->shard, fn) == 3) {
+                        snprintf(s->fn, sizeof(s->fn), "%s", fn);
+                        s->srv = j;
+                        num_stored++;
+                    }
+                }
+                free(req.reply);
+                req.reply = NULL;
+            }
+        }
+    }
+    qsort(stored, num_stored, sizeof(stored_shard), cmp_stored);
+
+    int num_failed = 0;
+    for (int first = 0, last; first < num_stored; first = last) {
+        // the shards of one version of a file
+        last = first + 1;
+        while (last < num_stored && cmp_stored(&stored[first], &stored[last]) == 0) {
+            last++;
+        }
+        int order[MAX_SRVS];
+        int wanted[MAX_SRVS] = {0};
+        int holds[MAX_SRVS] = {0};
+        rank_servers(stored[first].fn, order);
+        for (int rank = 0; rank < data_shards + parity_shards; rank++) {
+            wanted[order[rank]] = 1;
+        }
+        for (int i = first; i < last; i++) {
+            holds[stored[i].srv] = 1;
+        }
+
+        for (int i = first; i < last; i++) {
+            stored_shard *s = &stored[i];
+            if (wanted[s->srv]) {
+                continue;
+            }
+            int placed = 0;
+            for (int k = first; k < last; k++) {
+                placed |= stored[k].shard == s->shard && wanted[stored[k].srv];
+            }
+            if (placed) {
+                request r;
+                bzero(&r, sizeof(r));
+                snprintf(r.name, sizeof(r.name), "%lld_%d_%s", s->ts, s->shard, s->fn);
+                if (pipeline(serversockfds[s->srv], OP_DELETE, &r, 1) == 0) {
+                    printf("DELETE %s %s\n", r.name, servers[s->srv].name);
+                }
+                continue;
+            }
+            int to = -1;
+            for (int rank = 0; rank < data_shards + parity_shards && to == -1; rank++) {
+                if (!holds[order[rank]] && serversockfds[order[rank]] != -1) {
+                    to = order[rank];
+                }
+            }
+            if (to == -1 || move_shard(serversockfds, s, to) == -1) {
+                num_failed++;
+                continue;
+            }
+            holds[to] = 1;
+        }
+    }
+    free(stored);
+    if (num_failed > 0) {
+        printf("%d shards could not be moved\n", num_failed);
     }
-    // printf("bytes_sent: %d\n", bytes_sent);
+    return num_failed;
 }
 
 // hash function taken from http://www.cse.yorku.ca/~oz/hash.html
@@ -1,26 +1,83 @@
-/* 
+/*
 * Distributed file server
-* usage: server <port>
+* usage: server <server_directory> <port>
 * Parts of code taken from https://www.cs.dartmouth.edu/~campbell/cs50/socketprogramming.html
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <netdb.h>
-#include <sys/types.h> 
+#include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <dirent.h> 
+#include <dirent.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/sendfile.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <linux/falloc.h>
+
+#include "frame.h"
 
 #define BUFSIZE 8192
 #define LISTENQ 64 /*maximum number of client connections */
+#define IDLE_TIMEOUT 10 /* seconds a session may wait on its client */
+#define PIPE_SIZE (1024 * 1024) /* bytes a PUT moves through its pipe at a time */
+
+/* a reply payload being built up */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} strbuf;
+
+/* a stored chunk */
+typedef struct {
+    char *name;
+    off_t size;
+} index_chunk;
+
+/* every stored chunk of one file, all versions */
+typedef struct index_file {
+    struct index_file *next; /* same bucket, in order of hash */
+    uint64_t hash; /* list_hash(fn) */
+    char *fn;
+    index_chunk *chunks;
+    int n, cap;
+} index_file;
+
+/* files by name hash; buckets go by the top bits of the hash, so walking
+ * them in order lists files in hash order, the order LIST pages through */
+typedef struct {
+    index_file **buckets;
+    int bits;
+    size_t nbuckets, nfiles;
+} index_table;
+
+char server_dir[256];
+
+// the chunks in server_dir by file name, read at startup and kept up to
+// date by PUT and DELETE, so listings never scan the directory. Content
+// chunks, stored as version 0 of their hash, are kept apart from the
+// versions of named files, so ls never walks them and LIST_CHUNKS walks
+// nothing else
+index_table file_index = {NULL, 0, 0, 0}, chunk_index = {NULL, 0, 0, 0};
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// sessions still running, waited for on shutdown
+int active_sessions = 0;
+pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessions_done = PTHREAD_COND_INITIALIZER;
+volatile sig_atomic_t shutting_down = 0;
 
 /*
 * error - wrapper for perror
@@ -30,60 +87,60 @@ void error(char *msg) {
     exit(1);
 }
 
-// Timeout handler
-void timeout_handler(int signum) {
-    printf("Child process timed out. Exiting...\n");
-    exit(1);
-}
-
 // SIGINT handler
 void sigint_handler(int sigsum) {
-    printf("Received interrupt signal, waiting for child processes before shutting down...\n");
-    while(wait(NULL) > 0);
-    exit(0);
+    shutting_down = 1;
 }
 
-void list_files(char *buf, char* server_dir);
+void *session_thread(void *arg);
+int recv_all(int connfd, void *data, size_t sz);
+int send_all(int connfd, void *data, size_t sz);
+int skip_bytes(int connfd, size_t sz);
+int recv_to_file(int connfd, int fd, int *pipefd, size_t sz, int *status);
+int send_reply(int connfd, uint32_t id, int op, int status, void *data, uint64_t len);
+int valid_name(char *name);
+int strbuf_printf(strbuf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int list_files(strbuf *out, char *fn);
+int list_page(strbuf *out, index_table *t, char *prefix, uint64_t from);
+int index_build(void);
+int index_add(char *name, off_t size);
+void index_remove(char *name);
 
 int main(int argc, char **argv) {
     int sockfd; /* socket */
     int connfd; /* connection*/
     int portno; /* port to listen on */
-    int clientlen; /* byte size of client's address */
+    socklen_t clientlen; /* byte size of client's address */
     struct sockaddr_in serveraddr; /* server's addr */
     struct sockaddr_in clientaddr; /* client addr */
-    struct hostent *hostp; /* client host info */
-    char *hostaddrp; /* dotted decimal host addr string */
     int optval; /* flag value for setsockopt */
-    pid_t childpid;
 
-    char main_buf[BUFSIZE];
-    char server_dir[10];
-
-    /* 
-    * check command line arguments 
+    /*
+    * check command line arguments
     */
     if (argc != 3) {
         fprintf(stderr, "usage: %s <server_directory> <port>\n", argv[0]);
         exit(1);
     }
-    sprintf(server_dir, "%s", argv[1]);
+    snprintf(server_dir, sizeof(server_dir), "%s", argv[1]);
     portno = atoi(argv[2]);
+    if (index_build() == -1)
+        error("ERROR reading server directory");
 
-    /* 
-    * socket: create the parent socket 
+    /*
+    * socket: create the parent socket
     */
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) 
+    if (sockfd < 0)
         error("ERROR opening socket");
 
-    /* setsockopt: Handy debugging trick that lets 
-    * us rerun the server immediately after we kill it; 
-    * otherwise we have to wait about 20 secs. 
-    * Eliminates "ERROR on binding: Address already in use" error. 
+    /* setsockopt: Handy debugging trick that lets
+    * us rerun the server immediately after we kill it;
+    * otherwise we have to wait about 20 secs.
+    * Eliminates "ERROR on binding: Address already in use" error.
     */
     optval = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, 
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
             (const void *)&optval , sizeof(int));
 
     /*
@@ -94,210 +151,564 @@ int main(int argc, char **argv) {
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
     serveraddr.sin_port = htons((unsigned short)portno);
 
-    /* 
-    * bind: associate the parent socket with a port 
+    /*
+    * bind: associate the parent socket with a port
     */
-    if (bind(sockfd, (struct sockaddr *) &serveraddr, 
-        sizeof(serveraddr)) < 0) 
+    if (bind(sockfd, (struct sockaddr *) &serveraddr,
+        sizeof(serveraddr)) < 0)
         error("ERROR on binding");
 
     // Listen on socket for incoming connection requests
     listen(sockfd, LISTENQ);
 
-    // Set sigint handler
-    signal(SIGINT, sigint_handler);
-    // Ignore SIGCHLD to avoid zombie processes
-    signal(SIGCHLD,SIG_IGN);
+    // Set sigint handler; no SA_RESTART, so it interrupts accept
+    struct sigaction sa;
+    bzero(&sa, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigaction(SIGINT, &sa, NULL);
+    // A client hanging up mid-reply fails the send rather than killing us
+    signal(SIGPIPE, SIG_IGN);
 
     printf("%s\n","Server running...waiting for connections.");
 
-    for ( ; ; ) {
+    // SIGINT is only taken by this thread, sessions start with it blocked
+    sigset_t sigint, old;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
 
+    while (!shutting_down) {
         clientlen = sizeof(clientaddr);
         connfd = accept(sockfd, (struct sockaddr *) &clientaddr, &clientlen);
         if(connfd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             error("Accept error");
         }
         printf("%s\n","Received request...");
-            
-        if((childpid = fork()) == 0) {
-            printf ("%s\n","Child created for dealing with client requests");
-
-            // Set alarm for timeout of 10 s
-            signal(SIGALRM, timeout_handler);
-            alarm(10);
-            // Ignore SIGINT for children (sent via process group), timeout will handle any that take too long
-            signal(SIGINT, SIG_IGN);
-
-            close(sockfd); 
-
-            // sleep(5); // For testing
-            while(1) {
-                // recv command length
-                int cmd_len;
-                if (recv(connfd, &cmd_len, sizeof(int), 0) <= 0) {
-                    error("Recv failed");
-                }
-                // recv command from client
-                char *cmdbuf = malloc(cmd_len + 1);
-                if (recv(connfd, cmdbuf, cmd_len, 0) <= 0) {
-                    error("Recv failed");
-                }
-                cmdbuf[cmd_len] = '\0';
-
-                // FORMAT: cmd chunk_name_1 chunk_name_2
-                char *cmd = strtok(cmdbuf, " ");
-                char *fn1_tok = strtok(NULL, " ");
-                char *fn2_tok = strtok(NULL, " ");
-                printf("%s %s %s\n", cmd, fn1_tok, fn2_tok);
-
-                // build the correct filenames for writing
-                char fns[2][64];
-                if (fn1_tok != NULL) {
-                    sprintf(fns[0], "%s/%s", server_dir, fn1_tok);
-                }
-                if (fn2_tok != NULL) {
-                    sprintf(fns[1], "%s/%s", server_dir, fn2_tok);
-                }
 
-                if (strncmp(cmd, "LIST", 4) == 0) {
-                    printf("list recvd\n");
-
-                    char *buf = calloc(1024, 1);
-                    list_files(buf, server_dir);
-
-                    send(connfd, buf, 1024, 0);
-                    free(buf);
-
-                } else if (strncmp(cmd, "GET", 3) == 0) {
-
-                    char buf[1024];
-                    // get list of all filenames
-                    list_files(buf, server_dir);
-
-                    char send_buf[1024];
-                    bzero(send_buf, 1024);
-                    char *line = strtok(buf, "\n");
-                    while (line != NULL) {
-                        // check if filename matches filename from GET
-                        if(strcmp(line + (strlen(line) - strlen(fn1_tok)), fn1_tok) == 0 && line[strlen(line) - strlen(fn1_tok) - 1] == '_') {
-                            // append file sizes
-                            char fn[128];
-                            sprintf(fn, "%s/%s", server_dir, line);
-                            int fd = open(fn, O_RDONLY);
-                            if(fd < 0) {
-                                error("Failed to open file");
-                            }
-                            int sz = lseek(fd, 0, SEEK_END);
-                            close(fd);
-                            sprintf(send_buf + strlen(send_buf), "%s %d\n", line, sz);
-                        }
-                        line = strtok(NULL, "\n");
-                    }
-                    // send list with matching filenames
-                    send(connfd, send_buf, 1024, 0);
-
-                    // recv desired timestamp
-                    char ts[32];
-                    recv(connfd, ts, 32, 0);
-                    // search for desired timestamp
-                    line = strtok(send_buf, "\n");
-                    while (line != NULL) {
-                        char *i = strstr(line, "_");
-                        int chunk_num = atoi(i + 1);
-                        // search for matching timestamp
-                        if (strncmp(line, ts, strlen(line) - strlen(i)) == 0) {
-                            char *ind = strstr(line, " ");
-                            strcpy(ind, "\0");
-
-                            char fn[128];
-                            sprintf(fn, "%s/%s", server_dir, line);
-
-                            int fd = open(fn, O_RDONLY);
-                            if(fd < 0) {
-                                error("Failed to open file");
-                            }
-                            int sz = lseek(fd, 0, SEEK_END);
-                            //send chunk number
-                            send(connfd, &chunk_num, sizeof(int), 0);
-                            // send size of file
-                            send(connfd, &sz, sizeof(int), 0);
-                            // send file
-                            int n;
-                            off_t offset = 0;
-                            while (offset < sz) {
-                                n = sendfile(connfd, fd, &offset, sz);
-                                if (n < 0) {
-                                    error("Sendfile failed");
-                                }
-                            }
-                            close(fd);
-                        }
-                        line = strtok(NULL, "\n");
-                    }
+        // a stalled or silent client ends its session
+        struct timeval tv = { IDLE_TIMEOUT, 0 };
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        // replies are small and pipelined, don't let them wait for acks
+        optval = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        // one thread per connection, serving its requests until it closes
+        pthread_t tid;
+        pthread_mutex_lock(&sessions_lock);
+        active_sessions++;
+        pthread_mutex_unlock(&sessions_lock);
+        pthread_sigmask(SIG_BLOCK, &sigint, &old);
+        if (pthread_create(&tid, NULL, session_thread, (void *) (intptr_t) connfd) != 0) {
+            printf("Failed to start session\n");
+            close(connfd);
+            pthread_mutex_lock(&sessions_lock);
+            active_sessions--;
+            pthread_mutex_unlock(&sessions_lock);
+        } else {
+            pthread_detach(tid);
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+
+    printf("Received interrupt signal, waiting for sessions before shutting down...\n");
+    close(sockfd);
+    pthread_mutex_lock(&sessions_lock);
+    while (active_sessions > 0) {
+        pthread_cond_wait(&sessions_done, &sessions_lock);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return 0;
+}
 
-                } else if (strncmp(cmd, "PUT", 3) == 0) {
-                    for(int i = 0; i < 2; i++) {
-                        // open file 
-                        int fd = open(fns[i], O_CREAT | O_WRONLY, 0666);
-                        if(fd == -1) {
-                            error("Failed to open file");
-                        }
-                        // recv file len
-                        int f_sz;
-                        if (recv(connfd, &f_sz, sizeof(int), 0) <= 0) {
-                            error("Recv file 1 len failed");
-                        }
-
-                        // recv file data
-                        int n;
-                        int recv_sz;
-                        int bytes_recv = 0;
-                        while (bytes_recv < f_sz) {
-                            // receive part of the chunk
-                            bzero(main_buf, BUFSIZE);
-                            recv_sz = f_sz - bytes_recv < BUFSIZE ? f_sz - bytes_recv : BUFSIZE;
-                            n = recv(connfd, main_buf, recv_sz, 0);
-                            if (n < 0) {
-                                error("Recv file failed");
-                            }
-                            if(n == 0) {
-                                break;
-                            }
-                            bytes_recv += n;
-                            // write chunk
-                            if (write(fd, main_buf, n) == -1) {
-                                close(fd);
-                                error("write");
-                            }
-                            // printf("data: %s\n", main_buf);
-                        }
-                        close(fd);
+// read and answer one connection's requests in order until it closes;
+// -1 from a handler means the connection can't be trusted any more
+void *session_thread(void *arg) {
+    int connfd = (int) (intptr_t) arg;
+    char name[MAX_NAME_LEN + 1];
+    // PUT data goes socket -> pipe -> file without passing through here;
+    // a bigger pipe means fewer splices
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        pipefd[0] = pipefd[1] = -1;
+    } else {
+        fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    static const char *op_names[] = {"?", "LIST", "VERSIONS", "GET", "PUT", "DELETE", "LIST_CHUNKS"};
+
+    frame_hdr h;
+    while (recv_all(connfd, &h, sizeof(h)) == 0) {
+        // nothing past the version byte means anything in another version
+        if (h.version != FRAME_VERSION) {
+            printf("Frame version %d, expected %d\n", h.version, FRAME_VERSION);
+            break;
+        }
+        uint32_t id = ntohl(h.id);
+        int namelen = h.namelen;
+        uint64_t len = be64toh(h.len);
+        if (namelen > len || recv_all(connfd, name, namelen) == -1) {
+            break;
+        }
+        name[namelen] = '\0';
+        uint64_t data_len = len - namelen;
+        printf("%s %s\n", h.op <= OP_LIST_CHUNKS ? op_names[h.op] : "?", name);
+
+        int ret = 0;
+        if (h.op == OP_LIST || h.op == OP_LIST_CHUNKS) {
+            // the cursor to start from, if any
+            char cursor[17] = "";
+            strbuf out = {NULL, 0, 0};
+            if (data_len >= sizeof(cursor)) {
+                ret = skip_bytes(connfd, data_len) == -1 ? -1 :
+                    send_reply(connfd, id, h.op, ST_BAD_REQUEST, NULL, 0);
+            } else if (recv_all(connfd, cursor, data_len) == -1) {
+                ret = -1;
+            } else {
+                cursor[data_len] = '\0';
+                index_table *t = h.op == OP_LIST ? &file_index : &chunk_index;
+                ret = list_page(&out, t, name, strtoull(cursor, NULL, 16)) == -1 ?
+                    send_reply(connfd, id, h.op, ST_IO_ERROR, NULL, 0) :
+                    send_reply(connfd, id, h.op, ST_OK, out.data, out.len);
+            }
+            free(out.data);
+
+        } else if (h.op == OP_VERSIONS) {
+            // every chunk of the file, with its size
+            strbuf out = {NULL, 0, 0};
+            if (!valid_name(name)) {
+                ret = send_reply(connfd, id, h.op, ST_BAD_REQUEST, NULL, 0);
+            } else if (list_files(&out, name) == -1) {
+                ret = send_reply(connfd, id, h.op, ST_IO_ERROR, NULL, 0);
+            } else {
+                ret = send_reply(connfd, id, h.op, ST_OK, out.data, out.len);
+            }
+            free(out.data);
+
+        } else if (h.op == OP_GET) {
+            char fn[600];
+            struct stat st;
+            snprintf(fn, sizeof(fn), "%s/%s", server_dir, name);
+            int fd = valid_name(name) ? open(fn, O_RDONLY) : -1;
+            if (fd < 0 || fstat(fd, &st) == -1) {
+                ret = send_reply(connfd, id, h.op, ST_NOT_FOUND, NULL, 0);
+            } else if ((ret = send_reply(connfd, id, h.op, ST_OK, NULL, st.st_size)) == 0) {
+                // send file
+                off_t offset = 0;
+                while (offset < st.st_size) {
+                    if (sendfile(connfd, fd, &offset, st.st_size - offset) <= 0) {
+                        ret = -1;
+                        break;
                     }
                 }
-                free(cmdbuf);
-                exit(0);
             }
+            if (fd >= 0) {
+                close(fd);
+            }
+
+        } else if (h.op == OP_PUT) {
+            // written under a hidden name and renamed once complete, so a
+            // half-received chunk is never listed
+            char fn[600], part[600];
+            snprintf(fn, sizeof(fn), "%s/%s", server_dir, name);
+            snprintf(part, sizeof(part), "%s/.%s.part", server_dir, name);
+            int fd = valid_name(name) ? open(part, O_CREAT | O_WRONLY | O_TRUNC, 0666) : -1;
+            int status = fd < 0 ? (valid_name(name) ? ST_IO_ERROR : ST_BAD_REQUEST) : ST_OK;
+
+            // the size is known up front: reserve the space in one go, so
+            // the file isn't grown a block at a time and a full disk shows
+            // before any data is taken in
+            if (fd >= 0 && data_len > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, data_len) == -1 &&
+                errno == ENOSPC) {
+                status = ST_IO_ERROR;
+            }
+            // recv file data, all of it even if it can't be stored
+            ret = recv_to_file(connfd, status == ST_OK ? fd : -1, pipefd, data_len, &status);
+            off_t size = data_len;
+            if (fd >= 0) {
+                close(fd);
+                // renamed under the index lock so the index and the
+                // directory agree on which of two racing PUTs won
+                pthread_rwlock_wrlock(&index_lock);
+                if (ret == -1 || status != ST_OK || rename(part, fn) == -1) {
+                    unlink(part);
+                    status = ST_IO_ERROR;
+                } else if (index_add(name, size) == -1) {
+                    unlink(fn);
+                    status = ST_IO_ERROR;
+                }
+                pthread_rwlock_unlock(&index_lock);
+            }
+            if (ret == 0) {
+                ret = send_reply(connfd, id, h.op, status, NULL, 0);
+            }
+
+        } else if (h.op == OP_DELETE) {
+            char fn[600];
+            snprintf(fn, sizeof(fn), "%s/%s", server_dir, name);
+            int status = ST_BAD_REQUEST;
+            if (valid_name(name)) {
+                pthread_rwlock_wrlock(&index_lock);
+                status = unlink(fn) == -1 ? ST_NOT_FOUND : ST_OK;
+                index_remove(name);
+                pthread_rwlock_unlock(&index_lock);
+            }
+            ret = skip_bytes(connfd, data_len) == -1 ? -1 : send_reply(connfd, id, h.op, status, NULL, 0);
+
+        } else {
+            ret = skip_bytes(connfd, data_len) == -1 ? -1 :
+                send_reply(connfd, id, h.op, ST_BAD_REQUEST, NULL, 0);
+        }
+        if (ret == -1) {
+            break;
         }
-        close(connfd);
     }
-    close(sockfd);
+    close(connfd);
+    if (pipefd[0] != -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+
+    pthread_mutex_lock(&sessions_lock);
+    if (--active_sessions == 0) {
+        pthread_cond_signal(&sessions_done);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return NULL;
+}
+
+int recv_all(int connfd, void *data, size_t sz) {
+    size_t bytes_recv = 0;
+    while (bytes_recv < sz) {
+        int n = recv(connfd, (char *) data + bytes_recv, sz - bytes_recv, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        bytes_recv += n;
+    }
     return 0;
 }
 
-void list_files(char *buf, char* server_dir) {
-    // get and store file names of local files
-    DIR *dir;
-    dir = opendir(server_dir);
-    if (dir == NULL) {
-        error("opendir failed");
+int send_all(int connfd, void *data, size_t sz) {
+    size_t bytes_sent = 0;
+    while (bytes_sent < sz) {
+        int n = send(connfd, (char *) data + bytes_sent, sz - bytes_sent, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        bytes_sent += n;
     }
+    return 0;
+}
 
+// read past a request's data
+int skip_bytes(int connfd, size_t sz) {
+    char buf[BUFSIZE];
+    while (sz > 0) {
+        int n = recv(connfd, buf, sz < BUFSIZE ? sz : BUFSIZE, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        sz -= n;
+    }
+    return 0;
+}
+
+// move sz bytes of a request's data from the socket into fd, or past them
+// if fd is -1. They are spliced through pipefd so they never enter user
+// space; where the file system can't take a splice they are read and
+// written instead. A write that fails sets *status and the rest is read
+// past. -1 if the connection failed
+int recv_to_file(int connfd, int fd, int *pipefd, size_t sz, int *status) {
+    char buf[BUFSIZE];
+    int spliced = 0;
+    while (fd >= 0 && pipefd[0] != -1 && sz > 0) {
+        ssize_t n = splice(connfd, NULL, pipefd[1], NULL, sz < PIPE_SIZE ? sz : PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n <= 0) {
+            return -1;
+        }
+        sz -= n;
+        while (n > 0) {
+            ssize_t m = splice(pipefd[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                break;
+            }
+            n -= m;
+            spliced = 1;
+        }
+        if (n == 0) {
+            continue;
+        }
+        // the file can't be spliced to, or the write failed: empty the
+        // pipe by hand and go on without splicing
+        int unsupported = !spliced && errno == EINVAL;
+        while (n > 0) {
+            ssize_t m = read(pipefd[0], buf, n < BUFSIZE ? n : BUFSIZE);
+            if (m <= 0) {
+                return -1;
+            }
+            if (unsupported && write(fd, buf, m) != m) {
+                unsupported = 0;
+            }
+            n -= m;
+        }
+        if (!unsupported) {
+            *status = ST_IO_ERROR;
+            fd = -1;
+        }
+        break;
+    }
+
+    // recv file data
+    while (sz > 0) {
+        int n = recv(connfd, buf, sz < BUFSIZE ? sz : BUFSIZE, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        sz -= n;
+        // write chunk
+        if (fd >= 0 && write(fd, buf, n) != n) {
+            *status = ST_IO_ERROR;
+            fd = -1;
+        }
+    }
+    return 0;
+}
+
+// reply header, then len bytes of data if there are any; a GET sends its
+// data itself
+int send_reply(int connfd, uint32_t id, int op, int status, void *data, uint64_t len) {
+    frame_hdr h;
+    h.version = FRAME_VERSION;
+    h.op = op;
+    h.status = status;
+    h.namelen = 0;
+    h.id = htonl(id);
+    h.len = htobe64(len);
+    if (send_all(connfd, &h, sizeof(h)) == -1) {
+        return -1;
+    }
+    return data == NULL ? 0 : send_all(connfd, data, len);
+}
+
+// a chunk name from a client must stay inside the server directory
+int valid_name(char *name) {
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL;
+}
+
+// append to a reply payload, growing it as needed
+int strbuf_printf(strbuf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap == 0 ? 4096 : b->cap;
+        while (b->len + n + 1 > cap) {
+            cap *= 2;
+        }
+        char *data = realloc(b->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+    return 0;
+}
+
+// the file a chunk belongs to: what follows timestamp_chunk#_, or "" for
+// names that aren't chunks, which no valid file name matches
+static char *file_of(char *name) {
+    char *rest = strchr(name, '_');
+    rest = rest != NULL ? strchr(rest + 1, '_') : NULL;
+    return rest != NULL ? rest + 1 : "";
+}
+
+// the table a chunk goes in: version 0 is only ever a content chunk
+static index_table *index_of(char *name) {
+    return strncmp(name, "0_", 2) == 0 ? &chunk_index : &file_index;
+}
+
+static size_t index_bucket(index_table *t, uint64_t hash) {
+    return hash >> (64 - t->bits);
+}
+
+static index_file *index_find(index_table *t, char *fn) {
+    if (t->nbuckets == 0) {
+        return NULL;
+    }
+    uint64_t hash = list_hash(fn);
+    index_file *f = t->buckets[index_bucket(t, hash)];
+    while (f != NULL && (f->hash != hash || strcmp(f->fn, fn) != 0)) {
+        f = f->next;
+    }
+    return f;
+}
+
+// double the buckets once there are more files than buckets; each bucket
+// splits in two, the files keeping their order
+static int index_grow(index_table *t) {
+    int bits = t->bits == 0 ? 10 : t->bits + 1;
+    size_t nbuckets = (size_t) 1 << bits;
+    index_file **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL) {
+        return -1;
+    }
+    t->bits = bits;
+    for (size_t b = 0; b < t->nbuckets; b++) {
+        index_file **tails[2] = { &buckets[2 * b], &buckets[2 * b + 1] };
+        for (index_file *f = t->buckets[b], *next; f != NULL; f = next) {
+            next = f->next;
+            index_file ***tail = &tails[index_bucket(t, f->hash) & 1];
+            f->next = NULL;
+            **tail = f;
+            *tail = &f->next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+    return 0;
+}
+
+// record a stored chunk, replacing any earlier one of the same name; the
+// caller holds index_lock for writing
+int index_add(char *name, off_t size) {
+    index_table *t = index_of(name);
+    char *fn = file_of(name);
+    index_file *f = index_find(t, fn);
+    if (f == NULL) {
+        if (t->nfiles >= t->nbuckets && index_grow(t) == -1) {
+            return -1;
+        }
+        if ((f = calloc(1, sizeof(*f))) == NULL || (f->fn = strdup(fn)) == NULL) {
+            free(f);
+            return -1;
+        }
+        f->hash = list_hash(fn);
+        index_file **pos = &t->buckets[index_bucket(t, f->hash)];
+        while (*pos != NULL && (*pos)->hash < f->hash) {
+            pos = &(*pos)->next;
+        }
+        f->next = *pos;
+        *pos = f;
+        t->nfiles++;
+    }
+    for (int i = 0; i < f->n; i++) {
+        if (strcmp(f->chunks[i].name, name) == 0) {
+            f->chunks[i].size = size;
+            return 0;
+        }
+    }
+    if (f->n == f->cap) {
+        int cap = f->cap == 0 ? 4 : f->cap * 2;
+        index_chunk *chunks = realloc(f->chunks, cap * sizeof(*chunks));
+        if (chunks == NULL) {
+            return -1;
+        }
+        f->chunks = chunks;
+        f->cap = cap;
+    }
+    if ((f->chunks[f->n].name = strdup(name)) == NULL) {
+        return -1;
+    }
+    f->chunks[f->n++].size = size;
+    return 0;
+}
+
+// forget a chunk; a file left without chunks stays, it costs little and
+// is likely to be put again. The caller holds index_lock for writing
+void index_remove(char *name) {
+    index_file *f = index_find(index_of(name), file_of(name));
+    for (int i = 0; f != NULL && i < f->n; i++) {
+        if (strcmp(f->chunks[i].name, name) == 0) {
+            free(f->chunks[i].name);
+            f->chunks[i] = f->chunks[--f->n];
+            return;
+        }
+    }
+}
+
+// index every chunk in the server directory
+int index_build(void) {
+    DIR *dir = opendir(server_dir);
+    if (dir == NULL) {
+        return -1;
+    }
     struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            sprintf(buf + strlen(buf),"%s\n", entry->d_name);
+    int ret = 0;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (entry->d_name[0] == '.') {
+            continue; // ., .. and chunks a previous run didn't finish
+        }
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+            ret = index_add(entry->d_name, st.st_size);
         }
     }
     closedir(dir);
-}
\ No newline at end of file
+    return ret;
+}
+
+// list a file's chunks (timestamp_chunk#_fn), one per line, each followed
+// by its size
+int list_files(strbuf *out, char *fn) {
+    int ret = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    index_file *files[2] = { index_find(&file_index, fn), index_find(&chunk_index, fn) };
+    for (int k = 0; k < 2; k++) {
+        index_file *f = files[k];
+        for (int i = 0; f != NULL && ret == 0 && i < f->n; i++) {
+            ret = strbuf_printf(out, "%s %lld\n", f->chunks[i].name, (long long) f->chunks[i].size);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return ret;
+}
+
+// a page of LIST or LIST_CHUNKS out of table t: the chunks of the files
+// whose names start with prefix, in hash order from the hash from on. A
+// page ends once LIST_PAGE names are in it, or four times as many files
+// were looked at for a prefix few match, but never between two files of
+// the same hash, so the cursor it ends with doesn't skip any
+int list_page(strbuf *out, index_table *t, char *prefix, uint64_t from) {
+    size_t plen = strlen(prefix);
+    int lines = 0, scanned = 0, more = 0;
+    uint64_t last = 0;
+    // the cursor line, filled in at the end
+    int ret = strbuf_printf(out, "done %016llx\n", 0ULL);
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t b = t->nbuckets > 0 ? index_bucket(t, from) : 0; ret == 0 && !more && b < t->nbuckets; b++) {
+        for (index_file *f = t->buckets[b]; ret == 0 && f != NULL; f = f->next) {
+            if (f->hash < from) {
+                continue;
+            }
+            if ((lines >= LIST_PAGE || scanned >= 4 * LIST_PAGE) && f->hash != last) {
+                more = 1;
+                last = f->hash;
+                break;
+            }
+            scanned++;
+            last = f->hash;
+            if (strncmp(f->fn, prefix, plen) != 0) {
+                continue;
+            }
+            for (int i = 0; ret == 0 && i < f->n; i++, lines++) {
+                ret = strbuf_printf(out, "%s\n", f->chunks[i].name);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    if (ret == 0) {
+        char cursor[32];
+        snprintf(cursor, sizeof(cursor), "%s %016llx\n", more ? "more" : "done", (unsigned long long) last);
+        memcpy(out->data, cursor, strlen(cursor));
+    }
+    return ret;
+}
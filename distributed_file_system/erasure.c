@@ -0,0 +1,259 @@
+#include "erasure.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+static void (*mul_add)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+static pthread_once_t ec_once = PTHREAD_ONCE_INIT;
+
+static uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+static void mul_add_table(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    const uint8_t *row = gf_mul[c];
+    for (size_t i = 0; i < n; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// c * x is c * (x & 15) ^ c * (x & 240): two 16-entry lookups per byte
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul[c][x];
+        hi[x] = gf_mul[c][x << 4];
+    }
+    __m128i tlo = _mm_loadu_si128((__m128i *) lo);
+    __m128i thi = _mm_loadu_si128((__m128i *) hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *) (src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(v, mask)),
+            _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+        __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+    }
+    mul_add_table(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul[c][x];
+        hi[x] = gf_mul[c][x << 4];
+    }
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask)),
+            _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+        __m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, p));
+    }
+    mul_add_table(dst + i, src + i, c, n - i);
+}
+#endif
+
+// log/exp tables for the field with polynomial x^8 + x^4 + x^3 + x^2 + 1,
+// the full product table, and the fastest mul_add the CPU runs
+static void ec_init(void) {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int a = 1; a < 256; a++) {
+        for (int b = 1; b < 256; b++) {
+            gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+        }
+    }
+
+    mul_add = mul_add_table;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mul_add = mul_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        mul_add = mul_add_ssse3;
+    }
+#endif
+}
+
+// Cauchy matrix 1 / (x_row + y_col), with x_row = EC_MAX_SHARDS + row and
+// y_col = col so the two sets never meet
+uint8_t ec_coef(int row, int col) {
+    pthread_once(&ec_once, ec_init);
+    return gf_inv((EC_MAX_SHARDS + row) ^ col);
+}
+
+void ec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+    pthread_once(&ec_once, ec_init);
+    if (c == 1) {
+        for (size_t i = 0; i < n; i++) {
+            dst[i] ^= src[i];
+        }
+    } else if (c != 0) {
+        mul_add(dst, src, c, n);
+    }
+}
+
+// Gauss-Jordan elimination alongside an identity that becomes the inverse
+int ec_invert(uint8_t *a, int n) {
+    uint8_t inv[EC_MAX_SHARDS * EC_MAX_SHARDS];
+    pthread_once(&ec_once, ec_init);
+    memset(inv, 0, n * n);
+    for (int i = 0; i < n; i++) {
+        inv[i * n + i] = 1;
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return -1;
+        }
+        for (int k = 0; k < n; k++) {
+            uint8_t t = a[col * n + k];
+            a[col * n + k] = a[pivot * n + k];
+            a[pivot * n + k] = t;
+            t = inv[col * n + k];
+            inv[col * n + k] = inv[pivot * n + k];
+            inv[pivot * n + k] = t;
+        }
+        uint8_t scale = gf_inv(a[col * n + col]);
+        for (int k = 0; k < n; k++) {
+            a[col * n + k] = gf_mul[scale][a[col * n + k]];
+            inv[col * n + k] = gf_mul[scale][inv[col * n + k]];
+        }
+        for (int row = 0; row < n; row++) {
+            uint8_t f = a[row * n + col];
+            if (row == col || f == 0) {
+                continue;
+            }
+            for (int k = 0; k < n; k++) {
+                a[row * n + k] ^= gf_mul[f][a[col * n + k]];
+                inv[row * n + k] ^= gf_mul[f][inv[col * n + k]];
+            }
+        }
+    }
+    memcpy(a, inv, n * n);
+    return 0;
+}
+
+off_t ec_shard_len(off_t size, int k) {
+    return (size + k - 1) / k;
+}
+
+// n bytes at pos of data that ends at end, zeros past it
+static int read_data(int fd, uint8_t *buf, size_t n, off_t pos, off_t end) {
+    size_t want = pos >= end ? 0 : end - pos < (off_t) n ? (size_t) (end - pos) : n;
+    if (want > 0 && pread(fd, buf, want, pos) != (ssize_t) want) {
+        return -1;
+    }
+    memset(buf + want, 0, n - want);
+    return 0;
+}
+
+// the part of n bytes at pos that comes before end
+static int write_data(int fd, const uint8_t *buf, size_t n, off_t pos, off_t end) {
+    size_t want = pos >= end ? 0 : end - pos < (off_t) n ? (size_t) (end - pos) : n;
+    return want > 0 && pwrite(fd, buf, want, pos) != (ssize_t) want ? -1 : 0;
+}
+
+// the same n bytes of every data shard, then their sum
+int ec_encode_block(int fd, off_t base, off_t size, int k, int j, off_t off, size_t n, uint8_t *data,
+    uint8_t *out) {
+    off_t len = ec_shard_len(size, k);
+    for (int i = 0; i < k; i++) {
+        if (read_data(fd, data + (size_t) i * EC_BLOCK, n, base + i * len + off, base + size) == -1) {
+            return -1;
+        }
+    }
+    memset(out, 0, n);
+    for (int i = 0; i < k; i++) {
+        ec_mul_add(out, data + (size_t) i * EC_BLOCK, ec_coef(j, i), n);
+    }
+    return 0;
+}
+
+// the first k shards present, data shards first, as rows of the generator
+// matrix; its inverse turns them back into the data shards
+int ec_decode(int fd, off_t base, off_t size, int parity_fd, off_t parity_off, int k, int m, const int *have) {
+    off_t len = ec_shard_len(size, k);
+    int src[EC_MAX_SHARDS];
+    uint8_t a[EC_MAX_SHARDS * EC_MAX_SHARDS];
+    int count = 0;
+    for (int d = 0; d < k && have[d]; d++) {
+        count++;
+    }
+    if (count == k) {
+        return 0;
+    }
+    count = 0;
+    for (int s = 0; s < k + m && count < k; s++) {
+        if (have[s]) {
+            src[count++] = s;
+        }
+    }
+    if (count < k) {
+        return -1;
+    }
+    memset(a, 0, k * k);
+    for (int r = 0; r < k; r++) {
+        for (int c = 0; c < k; c++) {
+            a[r * k + c] = src[r] < k ? src[r] == c : ec_coef(src[r] - k, c);
+        }
+    }
+    if (ec_invert(a, k) == -1) {
+        return -1;
+    }
+
+    uint8_t *in = malloc((size_t) k * EC_BLOCK);
+    uint8_t *out = malloc(EC_BLOCK);
+    int ret = in != NULL && out != NULL ? 0 : -1;
+    for (off_t off = 0; ret == 0 && off < len; off += EC_BLOCK) {
+        size_t n = len - off < EC_BLOCK ? len - off : EC_BLOCK;
+        for (int r = 0; ret == 0 && r < k; r++) {
+            uint8_t *buf = in + (size_t) r * EC_BLOCK;
+            ret = src[r] < k ? read_data(fd, buf, n, base + src[r] * len + off, base + size) :
+                read_data(parity_fd, buf, n, parity_off + (src[r] - k) * len + off, parity_off + (src[r] - k + 1) * len);
+        }
+        for (int d = 0; ret == 0 && d < k; d++) {
+            if (have[d]) {
+                continue;
+            }
+            memset(out, 0, n);
+            for (int r = 0; r < k; r++) {
+                ec_mul_add(out, in + (size_t) r * EC_BLOCK, a[d * k + r], n);
+            }
+            ret = write_data(fd, out, n, base + d * len + off, base + size);
+        }
+    }
+    free(in);
+    free(out);
+    return ret;
+}
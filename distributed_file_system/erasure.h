@@ -0,0 +1,54 @@
+#ifndef ERASURE_H
+#define ERASURE_H
+
+/*
+ * Reed-Solomon erasure coding over GF(2^8), used by dfc for everything it
+ * stores.
+ *
+ * An object of size bytes is cut into k data shards of ec_shard_len(size,
+ * k) bytes each, the last one padded with zeros, and m parity shards of the
+ * same length are computed from them. Parity shard j is the sum over the
+ * data shards of ec_coef(j, i) times data shard i; the coefficients form a
+ * Cauchy matrix, so any k of the k + m shards are enough to rebuild the
+ * object.
+ *
+ * Parity is computed a block at a time, so a shard can be sent as it is
+ * encoded rather than staged whole first.
+ *
+ * Every stored shard starts with a shard_hdr saying which shard it is and
+ * how the object was coded. ec_mul_add is where the time goes; it uses AVX2
+ * or SSSE3 table lookups when the CPU has them.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define EC_MAX_SHARDS 64 /* data plus parity shards of an object */
+#define EC_BLOCK (1024 * 1024) /* bytes of each shard coded at a time */
+#define SHARD_MAGIC "DFEC"
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint8_t k; /* data shards of the object */
+    uint8_t m; /* parity shards of the object */
+    uint8_t index; /* this shard, data shards first */
+    uint8_t unused;
+    uint64_t size; /* bytes in the object, network byte order */
+} shard_hdr;
+
+uint8_t ec_coef(int row, int col); // coefficient of data shard col in parity shard row
+void ec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n); // dst ^= c * src over n bytes
+int ec_invert(uint8_t *a, int n); // invert the n x n row-major matrix a in place, -1 if singular
+
+off_t ec_shard_len(off_t size, int k); // bytes in each shard of an object of size bytes
+// n bytes, at most EC_BLOCK, from off on of parity shard j of the size bytes at base in fd, into
+// out; data is room for k * EC_BLOCK bytes of the data shards
+int ec_encode_block(int fd, off_t base, off_t size, int k, int j, off_t off, size_t n, uint8_t *data,
+    uint8_t *out);
+// rebuild the data shards that have[] lacks of the object of size bytes at base in fd from any k
+// shards it has, parity shard j at parity_off + j * shard length of parity_fd; nothing past
+// base + size is touched
+int ec_decode(int fd, off_t base, off_t size, int parity_fd, off_t parity_off, int k, int m, const int *have);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+/*
+ * Wire format shared by dfc and dfs.
+ *
+ * A client opens one connection per server and keeps it for the whole
+ * command, pipelining its requests: each one is a frame_hdr followed by
+ * namelen bytes of name and then len - namelen bytes of data, and carries
+ * an ID the server echoes in its reply. A reply is a frame_hdr with the
+ * request's op, a status and len bytes of payload. A server answers the
+ * requests of a connection in order; a client keeps up to PIPELINE_DEPTH
+ * of them outstanding. Header fields are in network byte order.
+ *
+ * Every frame starts with FRAME_VERSION, so a peer speaking another layout
+ * is told apart before anything else is read; the server hangs up on one.
+ * Lengths are 64-bit, so a payload is bounded by the disk, not the header.
+ * Large files never travel as one payload though: they are cut into chunks
+ * of about a megabyte, each named by its SHA-256, so a file streams as many
+ * small requests, PIPELINE_DEPTH of them in flight per server, and the
+ * client checks every chunk it rebuilds against its name.
+ *
+ * Chunks are named timestamp_chunk#_filename.
+ *
+ * LIST is paginated: a server lists files in order of list_hash of their
+ * names, so a cursor is just a hash and stays valid while files come and
+ * go. Since every server uses the same order, a client merging listings
+ * knows a file is complete once all servers' cursors are past its hash.
+ * Content chunks, version 0 of their hash, are left out of LIST and paged
+ * through by LIST_CHUNKS instead, so ls costs files, not chunks.
+ */
+
+#include <stdint.h>
+
+#define FRAME_VERSION 2 /* never 0, what the unversioned header started with */
+#define PIPELINE_DEPTH 16 /* requests in flight per connection */
+#define MAX_NAME_LEN 255
+#define LIST_PAGE 4096 /* chunk names a LIST reply stops after */
+
+enum {
+    /* name: a prefix of file names; data: "" or a cursor, 16 hex digits;
+     * reply: "more <cursor>\n" or "done <cursor>\n", then "chunk_name\n"
+     * for the chunks of every matching file from the cursor on, a page at a
+     * time */
+    OP_LIST = 1,
+    OP_VERSIONS, /* name: a file; reply: "chunk_name size\n" for each of its chunks */
+    OP_GET, /* name: a chunk; reply: its data */
+    OP_PUT, /* name: a chunk; data: its contents; reply: empty */
+    OP_DELETE, /* name: a chunk; reply: empty */
+    OP_LIST_CHUNKS /* as LIST, for the content chunks LIST leaves out */
+};
+
+enum {
+    ST_OK = 0,
+    ST_NOT_FOUND,
+    ST_BAD_REQUEST,
+    ST_IO_ERROR
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t version; /* FRAME_VERSION */
+    uint8_t op; /* OP_* */
+    uint8_t status; /* replies: ST_* */
+    uint8_t namelen; /* requests: bytes of name at the start of the payload */
+    uint32_t id; /* request ID, echoed in the reply */
+    uint64_t len; /* payload bytes following the header */
+} frame_hdr;
+
+// FNV-1a of a file name, the order LIST goes in
+static inline uint64_t list_hash(const char *fn) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*fn != '\0') {
+        h = (h ^ (unsigned char) *fn++) * 1099511628211ULL;
+    }
+    return h;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#include "fec.h"
+
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+static void (*mul_add)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n);
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+
+static uint8_t gf_inv(uint8_t a) {
+  return gf_exp[255 - gf_log[a]];
+}
+
+static void mul_add_table(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+  const uint8_t *row = gf_mul[c];
+  for (size_t i = 0; i < n; i++) {
+    dst[i] ^= row[src[i]];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// c * x is c * (x & 15) ^ c * (x & 240): two 16-entry lookups per byte
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+  uint8_t lo[16], hi[16];
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gf_mul[c][x];
+    hi[x] = gf_mul[c][x << 4];
+  }
+  __m128i tlo = _mm_loadu_si128((__m128i *) lo);
+  __m128i thi = _mm_loadu_si128((__m128i *) hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i *) (src + i));
+    __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(v, mask)),
+        _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+    __m128i d = _mm_loadu_si128((__m128i *) (dst + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+  }
+  mul_add_table(dst + i, src + i, c, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+  uint8_t lo[16], hi[16];
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gf_mul[c][x];
+    hi[x] = gf_mul[c][x << 4];
+  }
+  __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) lo));
+  __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) hi));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i *) (src + i));
+    __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask)),
+        _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask)));
+    __m256i d = _mm256_loadu_si256((__m256i *) (dst + i));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, p));
+  }
+  mul_add_table(dst + i, src + i, c, n - i);
+}
+#endif
+
+// log/exp tables for the field with polynomial x^8 + x^4 + x^3 + x^2 + 1,
+// the full product table, and the fastest mul_add the CPU runs
+static void fec_init(void) {
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = x;
+    gf_log[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= 0x11d;
+    }
+  }
+  for (int i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+  for (int a = 1; a < 256; a++) {
+    for (int b = 1; b < 256; b++) {
+      gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+    }
+  }
+
+  mul_add = mul_add_table;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    mul_add = mul_add_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    mul_add = mul_add_ssse3;
+  }
+#endif
+}
+
+// Cauchy matrix 1 / (x_row + y_col), with x_row = 128 + row and y_col = col
+// so the two sets never meet
+uint8_t fec_coef(int row, int col) {
+  pthread_once(&fec_once, fec_init);
+  return gf_inv((FEC_MAX_COLS + row) ^ col);
+}
+
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n) {
+  pthread_once(&fec_once, fec_init);
+  if (c == 1) {
+    for (size_t i = 0; i < n; i++) {
+      dst[i] ^= src[i];
+    }
+  } else if (c != 0) {
+    mul_add(dst, src, c, n);
+  }
+}
+
+// Gauss-Jordan elimination alongside an identity that becomes the inverse
+int fec_invert(uint8_t *a, int n) {
+  uint8_t inv[FEC_MAX_ROWS * FEC_MAX_ROWS];
+  pthread_once(&fec_once, fec_init);
+  memset(inv, 0, n * n);
+  for (int i = 0; i < n; i++) {
+    inv[i * n + i] = 1;
+  }
+  for (int col = 0; col < n; col++) {
+    int pivot = col;
+    while (pivot < n && a[pivot * n + col] == 0) {
+      pivot++;
+    }
+    if (pivot == n) {
+      return -1;
+    }
+    for (int k = 0; k < n; k++) {
+      uint8_t t = a[col * n + k];
+      a[col * n + k] = a[pivot * n + k];
+      a[pivot * n + k] = t;
+      t = inv[col * n + k];
+      inv[col * n + k] = inv[pivot * n + k];
+      inv[pivot * n + k] = t;
+    }
+    uint8_t scale = gf_inv(a[col * n + col]);
+    for (int k = 0; k < n; k++) {
+      a[col * n + k] = gf_mul[scale][a[col * n + k]];
+      inv[col * n + k] = gf_mul[scale][inv[col * n + k]];
+    }
+    for (int row = 0; row < n; row++) {
+      uint8_t f = a[row * n + col];
+      if (row == col || f == 0) {
+        continue;
+      }
+      for (int k = 0; k < n; k++) {
+        a[row * n + k] ^= gf_mul[f][a[col * n + k]];
+        inv[row * n + k] ^= gf_mul[f][inv[col * n + k]];
+      }
+    }
+  }
+  memcpy(a, inv, n * n);
+  return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef FEC_H
+#define FEC_H
+
+/*
+ * fec - Reed-Solomon erasure coding over GF(2^8) for blocks of datagrams.
+ *
+ * The code is systematic: a block's data packets go out as they are, and
+ * parity packet j is the sum over the block of fec_coef(j, i) times data
+ * packet i. The coefficients form a Cauchy matrix, so any square part of it
+ * is invertible and any k of a block's k data plus m parity packets are
+ * enough to rebuild the rest.
+ *
+ * fec_mul_add is where the time goes; it uses AVX2 or SSSE3 table lookups
+ * (16 bytes per shuffle for each nibble) when the CPU has them.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FEC_MAX_ROWS 128 /* parity packets per block */
+#define FEC_MAX_COLS 128 /* data packets per block */
+
+uint8_t fec_coef(int row, int col); // generator coefficient of data packet col in parity packet row
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t n); // dst ^= c * src over n bytes
+int  fec_invert(uint8_t *a, int n); // invert the n x n row-major matrix a in place, -1 if singular
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LS_H
+#define LS_H
+
+/*
+ * Binary directory listing, shared by the client and the server.
+ *
+ * The client asks for "ls <version> <from>": the listing it has cached (0
+ * for none) and the index of the first entry it still lacks. The server
+ * answers with a burst of up to LS_BURST pages, each one datagram holding
+ * an ls_hdr and as many whole entries as fit, the last page of the burst
+ * flagged LS_LAST; the client asks again from where the burst left off
+ * until it has all total entries. A page of a newer version means the
+ * directory changed underneath, and the client starts over. If the
+ * client's version is still current the answer is a single LS_UNCHANGED
+ * page with no entries.
+ *
+ * Each entry is an ls_entry followed by namelen bytes of name. All fields
+ * are in network byte order.
+ */
+
+#include <stdint.h>
+
+#define LS_MAGIC "LIST"
+#define LS_PAGE 1400 /* bytes per page, fits an ethernet MTU */
+#define LS_BURST 32 /* pages per request */
+
+#define LS_LAST 1 /* last page of this burst */
+#define LS_UNCHANGED 2 /* the client's cached listing is current */
+
+typedef struct __attribute__((packed)) {
+  char magic[4];
+  uint64_t version; /* listing this page belongs to */
+  uint32_t total; /* entries in the listing */
+  uint32_t from; /* index of this page's first entry */
+  uint16_t count; /* entries in this page */
+  uint16_t flags;
+} ls_hdr;
+
+typedef struct __attribute__((packed)) {
+  uint64_t size;
+  int64_t mtime; /* seconds since the epoch */
+  char type; /* 'f' file, 'd' directory, 'l' symlink, '?' other */
+  uint8_t namelen;
+} ls_entry;
+
+#endif
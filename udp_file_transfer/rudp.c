@@ -0,0 +1,1760 @@
+#define _GNU_SOURCE
+#include "rudp.h"
+#include "fec.h"
+
+#include <time.h>
+#include <stddef.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+uint64_t rudp_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t rudp_new_session(void) {
+  uint32_t id = 0;
+  while (id == 0) {
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+      id = (uint32_t) rudp_now_us() ^ ((uint32_t) getpid() << 16);
+    }
+  }
+  return id;
+}
+
+int rudp_is_pkt(char *pkt, int n) {
+  return n >= (int) sizeof(rudp_hdr) && pkt[0] >= RUDP_DATA && pkt[0] <= RUDP_PARITY;
+}
+
+uint32_t rudp_pkt_session(char *pkt) {
+  return ntohl(((rudp_hdr *) pkt)->session);
+}
+
+void rudp_socket_setup(int sockfd) {
+  int on = 1;
+  int rcvbuf = RUDP_RCVBUF;
+  setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)); // best effort, older kernels lack it
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+int rudp_path_seg(struct sockaddr_in *peer) {
+  // the kernel tracks the path MTU per destination; a connected socket
+  // with DF set reads it back
+  int mtu = 0;
+  socklen_t optlen = sizeof(mtu);
+  int pmtu = IP_PMTUDISC_DO;
+  int probe = socket(AF_INET, SOCK_DGRAM, 0);
+  if (probe < 0) {
+    return RUDP_DEF_SEG;
+  }
+  if (setsockopt(probe, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) < 0 ||
+      connect(probe, (struct sockaddr *) peer, sizeof(*peer)) < 0 ||
+      getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &optlen) < 0) {
+    mtu = 0;
+  }
+  close(probe);
+
+  int seg = mtu - 20 - 8 - (int) sizeof(rudp_hdr); // IP and UDP headers
+  if (mtu == 0 || seg < RUDP_DEF_SEG) {
+    return RUDP_DEF_SEG;
+  }
+  return seg > RUDP_MAX_SEG ? RUDP_MAX_SEG : seg;
+}
+
+int rudp_recv_batch(int sockfd, rudp_batch *b, int flags) {
+  for (int i = 0; i < RUDP_BATCH; i++) {
+    b->iov[i].iov_base = b->bufs[i];
+    b->iov[i].iov_len = RUDP_MAX_DGRAM;
+    bzero(&b->msgs[i].msg_hdr, sizeof(struct msghdr));
+    b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    b->msgs[i].msg_hdr.msg_control = b->ctrl[i];
+    b->msgs[i].msg_hdr.msg_controllen = sizeof(b->ctrl[i]);
+  }
+  int m = recvmmsg(sockfd, b->msgs, RUDP_BATCH, flags, NULL);
+  if (m <= 0) {
+    return -1;
+  }
+
+  // GRO hands back runs of same-sized datagrams glued together, with the
+  // datagram size in a control message
+  b->n = 0;
+  for (int i = 0; i < m; i++) {
+    int len = b->msgs[i].msg_len;
+    int gso = len;
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(&b->msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&b->msgs[i].msg_hdr, cm)) {
+      if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+        memcpy(&gso, CMSG_DATA(cm), sizeof(gso));
+      }
+    }
+    int off = 0;
+    do {
+      b->pkt[b->n] = b->bufs[i] + off;
+      b->len[b->n] = len - off < gso ? len - off : gso;
+      b->from[b->n] = &b->addrs[i];
+      b->n++;
+      off += gso;
+    } while (off < len);
+  }
+  return b->n;
+}
+
+int rudp_size_file(int fd, off_t len) {
+  if (ftruncate(fd, len) == -1) {
+    return -1;
+  }
+  // reserve the blocks up front so out-of-order writes don't fragment the
+  // file; not every filesystem can
+  if (len > 0 && fallocate(fd, 0, 0, len) == -1 && errno != EOPNOTSUPP) {
+    return -1;
+  }
+  return 0;
+}
+
+int rudp_streams(off_t len) {
+  off_t k = len / RUDP_STREAM_MIN;
+  return k < 1 ? 1 : k > RUDP_MAX_STREAMS ? RUDP_MAX_STREAMS : k;
+}
+
+int rudp_stream_socket(int *port) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    return -1;
+  }
+  bzero(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      getsockname(sockfd, (struct sockaddr *) &addr, &addrlen) < 0) {
+    close(sockfd);
+    return -1;
+  }
+  rudp_socket_setup(sockfd);
+  *port = ntohs(addr.sin_port);
+  return sockfd;
+}
+
+static uint32_t num_pkts(off_t len, int seg) {
+  return (len + seg - 1) / seg;
+}
+
+/*
+ * checksums and chunks
+ */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// slicing-by-8, CRC32C (Castagnoli) polynomial
+static void crc_init(void) {
+  for (int i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    }
+    crc_table[0][i] = c;
+  }
+  for (int i = 0; i < 256; i++) {
+    for (int k = 1; k < 8; k++) {
+      crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+    }
+  }
+}
+
+uint32_t rudp_crc32c(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  pthread_once(&crc_once, crc_init);
+  crc = ~crc;
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo = le32toh(lo) ^ crc;
+    hi = le32toh(hi);
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+      crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+      crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+      crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static int bit(uint8_t *map, uint32_t i) {
+  return (map[i / 8] >> (i % 8)) & 1;
+}
+
+static void set_bit(uint8_t *map, uint32_t i) {
+  map[i / 8] |= 1 << (i % 8);
+}
+
+// chunk size grows with the file so the need list still fits one segment
+static void manifest_shape(rudp_manifest *m, uint32_t npkts) {
+  m->chunk_pkts = RUDP_CHUNK_PKTS;
+  while ((npkts + m->chunk_pkts - 1) / m->chunk_pkts > RUDP_MAX_CHUNKS) {
+    m->chunk_pkts *= 2;
+  }
+  m->nchunks = (npkts + m->chunk_pkts - 1) / m->chunk_pkts;
+}
+
+// checksums per manifest page: a page, five header words included, is no
+// bigger than a data packet's payload
+static uint32_t manifest_per_page(int seg) {
+  return seg / sizeof(uint32_t) - 5;
+}
+
+static uint32_t manifest_pages(rudp_manifest *m, int seg) {
+  uint32_t per = manifest_per_page(seg);
+  return m->nchunks == 0 ? 1 : (m->nchunks + per - 1) / per;
+}
+
+// the root hash covers the chunk checksums in wire order
+static uint32_t manifest_root(rudp_manifest *m) {
+  uint32_t root = 0;
+  for (uint32_t c = 0; c < m->nchunks; c++) {
+    uint32_t be = htonl(m->crc[c]);
+    root = rudp_crc32c(root, &be, sizeof(be));
+  }
+  return root;
+}
+
+// checksum chunk c of a range of a file as it is on disk, buf holds a whole chunk
+static int chunk_crc(rudp_manifest *m, int fd, off_t base, off_t len, int seg, uint32_t c, char *buf, uint32_t *crc) {
+  off_t off = (off_t) c * m->chunk_pkts * seg;
+  size_t n = len - off < (off_t) m->chunk_pkts * seg ? len - off : (off_t) m->chunk_pkts * seg;
+  if (pread(fd, buf, n, base + off) != (ssize_t) n) {
+    return -1;
+  }
+  *crc = rudp_crc32c(0, buf, n);
+  return 0;
+}
+
+// true if pkt came from peer
+static int from_peer(struct sockaddr_in *from, struct sockaddr_in *peer) {
+  return from->sin_addr.s_addr == peer->sin_addr.s_addr && from->sin_port == peer->sin_port;
+}
+
+/*
+ * statistics and tracing
+ */
+
+static int trace_fd = -1;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void trace_open(void) {
+  char *path = getenv(RUDP_TRACE_ENV);
+  if (path != NULL && *path != '\0' && (trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+    perror("ERROR opening trace file");
+  }
+}
+
+// a record buffer for one end of a transfer, NULL when not tracing
+static rudp_trace_rec *trace_alloc(void) {
+  pthread_once(&trace_once, trace_open);
+  return trace_fd < 0 ? NULL : malloc(RUDP_TRACE_BUF * sizeof(rudp_trace_rec));
+}
+
+// appends of whole buffers don't interleave, so every transfer of every
+// thread can share the one file
+static void trace_flush(rudp_trace_rec *buf, int *n) {
+  if (buf != NULL && *n > 0 && write(trace_fd, buf, *n * sizeof(rudp_trace_rec)) < 0) {
+    perror("ERROR writing trace file");
+  }
+  *n = 0;
+}
+
+static rudp_trace_rec *trace_rec(rudp_trace_rec *buf, int *n, uint32_t session, int event, uint32_t round, uint32_t seq) {
+  if (*n == RUDP_TRACE_BUF) {
+    trace_flush(buf, n);
+  }
+  rudp_trace_rec *t = &buf[(*n)++];
+  bzero(t, sizeof(*t));
+  t->t_us = rudp_now_us();
+  t->session = session;
+  t->event = event;
+  t->round = round;
+  t->seq = seq;
+  return t;
+}
+
+static void trace_snd(rudp_sender *s, int event, uint32_t seq, uint32_t rtt) {
+  if (s->trace != NULL) {
+    rudp_trace_rec *t = trace_rec(s->trace, &s->ntrace, s->session, event, s->round, seq);
+    t->inflight = s->inflight;
+    t->rtt_us = rtt;
+    t->cwnd = s->cwnd;
+  }
+}
+
+static void trace_rcv(rudp_receiver *r, int event, uint32_t seq) {
+  if (r->trace != NULL) {
+    trace_rec(r->trace, &r->ntrace, r->session, event, r->round, seq)->inflight = r->cum;
+  }
+}
+
+void rudp_stats_add(rudp_stats *sum, rudp_stats *st) {
+  if (st->start_us != 0 && (sum->start_us == 0 || st->start_us < sum->start_us)) {
+    sum->start_us = st->start_us;
+  }
+  if (st->end_us > sum->end_us) {
+    sum->end_us = st->end_us;
+  }
+  if (st->rtt_n > 0 && (sum->rtt_n == 0 || st->rtt_min < sum->rtt_min)) {
+    sum->rtt_min = st->rtt_min;
+  }
+  if (st->rtt_max > sum->rtt_max) {
+    sum->rtt_max = st->rtt_max;
+  }
+  if (st->cwnd_max > sum->cwnd_max) {
+    sum->cwnd_max = st->cwnd_max;
+  }
+  if (st->rounds > sum->rounds) {
+    sum->rounds = st->rounds;
+  }
+  sum->bytes += st->bytes;
+  sum->pkts += st->pkts;
+  sum->resent += st->resent;
+  sum->lost += st->lost;
+  sum->timeouts += st->timeouts;
+  sum->parity += st->parity;
+  sum->rebuilt += st->rebuilt;
+  sum->bad_chunks += st->bad_chunks;
+  sum->streams += st->streams;
+  sum->rtt_n += st->rtt_n;
+  sum->rtt_sum += st->rtt_sum;
+  sum->cwnd_sum += st->cwnd_sum;
+}
+
+void rudp_stats_print(rudp_stats *st, int sending) {
+  double secs = st->end_us > st->start_us ? (st->end_us - st->start_us) / 1e6 : 0;
+  printf("Bytes %s: %llu in %.3f s (%.1f MB/s)", sending ? "sent" : "received",
+    (unsigned long long) st->bytes, secs, secs > 0 ? st->bytes / secs / 1e6 : 0);
+  if (st->streams > 1) {
+    printf(" over %u streams", st->streams);
+  }
+  printf("\n");
+  if (sending) {
+    printf("  %llu packets, %llu resent, %.2f%% lost, %llu timeouts, %llu parity, %u rounds; "
+      "rtt min/avg/max %u/%llu/%u us, cwnd avg/max %.1f/%.1f\n",
+      (unsigned long long) st->pkts, (unsigned long long) st->resent,
+      st->pkts > 0 ? 100.0 * st->lost / st->pkts : 0.0, (unsigned long long) st->timeouts,
+      (unsigned long long) st->parity, st->rounds, st->rtt_min,
+      (unsigned long long) (st->rtt_n > 0 ? st->rtt_sum / st->rtt_n : 0), st->rtt_max,
+      st->rtt_n > 0 ? st->cwnd_sum / st->rtt_n : 0.0, st->cwnd_max);
+  } else {
+    printf("  %llu packets, %llu duplicates, %llu parity, %llu rebuilt, %llu bad chunks, %u rounds\n",
+      (unsigned long long) st->pkts, (unsigned long long) st->resent, (unsigned long long) st->parity,
+      (unsigned long long) st->rebuilt, (unsigned long long) st->bad_chunks, st->rounds);
+  }
+}
+
+/*
+ * sender
+ */
+
+// map the range being sent, from a page-aligned offset; the checksum pass,
+// packets and parity all read through the mapping, where a missing page is
+// SIGBUS rather than a short read, so a file already shorter than the range
+// is left to pread, which fails cleanly
+static void map_range(rudp_sender *s) {
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t start = s->off / page * page;
+  struct stat st;
+  if (s->len == 0 || fstat(s->fd, &st) == -1 || st.st_size < s->off + s->len) {
+    return;
+  }
+  s->maplen = s->off - start + s->len;
+  s->map = mmap(NULL, s->maplen, PROT_READ, MAP_SHARED, s->fd, start);
+  if (s->map == MAP_FAILED) {
+    s->map = NULL; // not a regular file, or out of address space; use pread
+    return;
+  }
+  madvise(s->map, s->maplen, MADV_SEQUENTIAL);
+  s->data = s->map + (s->off - start);
+}
+
+int rudp_sender_init(rudp_sender *s, uint32_t session, int fd, off_t off, off_t len, int seg, int parity) {
+  bzero(s, offsetof(rudp_sender, hdrs)); // the outbox needs no clearing
+  s->session = session;
+  s->fd = fd;
+  s->off = off;
+  s->len = len;
+  s->seg = seg;
+  s->npkts = num_pkts(len, seg);
+  s->gso = 1;
+  s->rwnd = RUDP_INIT_CWND; // until the receiver tells us
+  s->cwnd = RUDP_INIT_CWND;
+  s->ssthresh = RUDP_MAX_WINDOW;
+  s->rto_us = RUDP_RTO_INIT_US;
+  s->st.streams = 1;
+  s->trace = trace_alloc();
+  map_range(s);
+
+  // checksum every chunk up front for the manifest, straight from the
+  // mapping when there is one
+  manifest_shape(&s->m, s->npkts);
+  s->m.parity = parity;
+  s->m.crc = malloc(s->m.nchunks * sizeof(uint32_t) + 1);
+  s->skip = calloc(s->m.nchunks / 8 + 1, 1);
+  if (parity > 0 && (s->parity = malloc((size_t) parity * seg)) == NULL) {
+    return -1;
+  }
+  char *buf = s->map ? NULL : malloc((size_t) s->m.chunk_pkts * seg);
+  if (s->m.crc == NULL || s->skip == NULL || (s->map == NULL && buf == NULL)) {
+    free(buf);
+    return -1;
+  }
+  for (uint32_t c = 0; c < s->m.nchunks; c++) {
+    if (s->map) {
+      off_t at = (off_t) c * s->m.chunk_pkts * seg;
+      off_t n = len - at < (off_t) s->m.chunk_pkts * seg ? len - at : (off_t) s->m.chunk_pkts * seg;
+      s->m.crc[c] = rudp_crc32c(0, s->data + at, n);
+    } else if (chunk_crc(&s->m, fd, off, len, seg, c, buf, &s->m.crc[c]) == -1) {
+      printf("Reading from file failed\n");
+      free(buf);
+      return -1;
+    }
+  }
+  s->m.root = manifest_root(&s->m);
+  free(buf);
+  s->phase = RUDP_PHASE_MANIFEST;
+  return 0;
+}
+
+void rudp_sender_free(rudp_sender *s) {
+  if (s->map) {
+    munmap(s->map, s->maplen);
+  }
+  free(s->m.crc);
+  free(s->skip);
+  free(s->parity);
+  trace_flush(s->trace, &s->ntrace);
+  free(s->trace);
+  s->map = NULL;
+  s->trace = NULL;
+  s->m.crc = NULL;
+  s->skip = NULL;
+  s->parity = NULL;
+}
+
+// the first round sends every page of the manifest; later rounds only
+// need its round number, so they send the first page alone
+static int send_manifest(rudp_sender *s, int sockfd, struct sockaddr_in *peer, uint64_t now) {
+  char pkt[sizeof(rudp_hdr) + RUDP_MAX_SEG];
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  uint32_t *body = (uint32_t *) (pkt + sizeof(rudp_hdr));
+  uint32_t per = manifest_per_page(s->seg);
+  uint32_t pages = s->round == 0 ? manifest_pages(&s->m, s->seg) : 1;
+
+  bzero(h, sizeof(*h));
+  h->type = RUDP_MANIFEST;
+  h->session = htonl(s->session);
+  h->seq = htonl(s->round);
+  h->ts = htonl((uint32_t) now);
+  body[0] = htonl(s->m.chunk_pkts);
+  body[1] = htonl(s->m.nchunks);
+  body[2] = htonl(s->m.root);
+  body[3] = htonl(s->m.parity);
+  for (uint32_t p = 0; p < pages; p++) {
+    uint32_t first = p * per;
+    uint32_t count = s->m.nchunks - first < per ? s->m.nchunks - first : per;
+    body[4] = htonl(first);
+    for (uint32_t c = 0; c < count; c++) {
+      body[5 + c] = htonl(s->m.crc[first + c]);
+    }
+    int n = sizeof(rudp_hdr) + (5 + count) * sizeof(uint32_t);
+    if (sendto(sockfd, pkt, n, 0, (struct sockaddr *) peer, sizeof(*peer)) < 0) {
+      perror("ERROR in sendto");
+      return -1;
+    }
+  }
+  s->manifest_at = now;
+  s->manifest_tries++;
+  if (s->st.start_us == 0) {
+    s->st.start_us = now;
+  }
+  return 0;
+}
+
+// the receiver's need list opens a round: send only the chunks it lacks
+static int on_need(rudp_sender *s, char *pkt, int n) {
+  uint8_t *need = (uint8_t *) pkt + sizeof(rudp_hdr);
+  int empty = 1;
+  if (n - (int) sizeof(rudp_hdr) < (int) (s->m.nchunks + 7) / 8) {
+    return 0;
+  }
+  for (uint32_t c = 0; c < s->m.nchunks; c++) {
+    if (bit(need, c)) {
+      empty = 0;
+      s->skip[c / 8] &= ~(1 << (c % 8));
+    } else {
+      set_bit(s->skip, c);
+    }
+  }
+  if (empty) {
+    s->phase = RUDP_PHASE_DONE;
+    s->st.end_us = rudp_now_us();
+    trace_snd(s, RUDP_EV_DONE, s->round, s->srtt_us);
+    trace_flush(s->trace, &s->ntrace);
+    return 1;
+  }
+  s->st.rounds++;
+  trace_snd(s, RUDP_EV_ROUND, s->round, s->srtt_us);
+
+  // a fresh window; cwnd and the rtt estimate carry over
+  s->base = s->next = s->cum = 0;
+  s->inflight = 0;
+  s->in_recovery = 0;
+  s->phase = RUDP_PHASE_DATA;
+  return 0;
+}
+
+// the next packet's chunk is one the receiver already has: count it acked
+// without sending it
+static void skip_have(rudp_sender *s) {
+  while (s->next < s->npkts && s->next - s->base < RUDP_MAX_WINDOW &&
+      bit(s->skip, s->next / s->m.chunk_pkts)) {
+    if (s->next == s->base) {
+      s->base++;
+    } else {
+      int slot = s->next % RUDP_MAX_WINDOW;
+      s->acked[slot] = 1;
+      s->lost[slot] = 0;
+    }
+    s->next++;
+  }
+  if (s->cum < s->base) {
+    s->cum = s->base;
+  }
+}
+
+// bytes of queued packet i on the wire
+static int out_len(rudp_sender *s, int i) {
+  return sizeof(rudp_hdr) + s->out[2 * i + 1].iov_len;
+}
+
+// send the queued packets: one sendmmsg, each run of full-sized packets
+// going out as a single GSO send the kernel splits back into datagrams
+static int flush_out(rudp_sender *s, int sockfd, struct sockaddr_in *peer) {
+  struct mmsghdr msgs[RUDP_BATCH];
+  int npkts[RUDP_BATCH];
+  char ctrl[RUDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  int full = sizeof(rudp_hdr) + s->seg;
+  int sent = 0;
+
+  while (sent < s->nout) {
+    int m = 0;
+    for (int i = sent; i < s->nout; m++) {
+      int run = 1, bytes = out_len(s, i);
+      while (s->gso && i + run < s->nout && out_len(s, i + run - 1) == full &&
+          bytes + out_len(s, i + run) <= RUDP_MAX_DGRAM - 1024 && run < 64) {
+        bytes += out_len(s, i + run);
+        run++;
+      }
+      npkts[m] = run;
+      bzero(&msgs[m].msg_hdr, sizeof(struct msghdr));
+      msgs[m].msg_hdr.msg_name = peer;
+      msgs[m].msg_hdr.msg_namelen = sizeof(*peer);
+      msgs[m].msg_hdr.msg_iov = &s->out[2 * i];
+      msgs[m].msg_hdr.msg_iovlen = 2 * run;
+      if (run > 1) {
+        uint16_t gso = full;
+        msgs[m].msg_hdr.msg_control = ctrl[m];
+        msgs[m].msg_hdr.msg_controllen = sizeof(ctrl[m]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[m].msg_hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(gso));
+        memcpy(CMSG_DATA(cm), &gso, sizeof(gso));
+      }
+      i += run;
+    }
+
+    int n = sendmmsg(sockfd, msgs, m, 0);
+    if (n < 0 && s->gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+      s->gso = 0; // no UDP_SEGMENT here, fall back to one datagram per message
+      continue;
+    }
+    if (n < 0) {
+      perror("ERROR in sendmmsg");
+      return -1;
+    }
+    // count the packets in the messages that made it out
+    for (int k = 0; k < n; k++) {
+      sent += npkts[k];
+    }
+  }
+  s->nout = 0;
+  return 0;
+}
+
+// queue packet seq for sending, its payload taken from the mapping in place;
+// event tells a first send from a resend
+static int send_pkt(rudp_sender *s, uint32_t seq, int event, int sockfd, struct sockaddr_in *peer, uint64_t now) {
+  if (s->nout == RUDP_BATCH && flush_out(s, sockfd, peer) == -1) {
+    return -1;
+  }
+  rudp_hdr *h = &s->hdrs[s->nout];
+  struct iovec *iov = &s->out[2 * s->nout];
+  off_t off = (off_t) seq * s->seg;
+  int len = s->len - off < s->seg ? s->len - off : s->seg;
+  int slot = seq % RUDP_MAX_WINDOW;
+
+  if (s->map) {
+    iov[1].iov_base = s->data + off;
+  } else if (pread(s->fd, s->buf[s->nout], len, s->off + off) == len) {
+    iov[1].iov_base = s->buf[s->nout];
+  } else {
+    printf("Reading from file failed\n");
+    return -1;
+  }
+  iov[0].iov_base = h;
+  iov[0].iov_len = sizeof(*h);
+  iov[1].iov_len = len;
+  bzero(h, sizeof(*h));
+  h->type = RUDP_DATA;
+  h->len = htons(len);
+  h->session = htonl(s->session);
+  h->flags = s->round;
+  h->seq = htonl(seq);
+  h->ts = htonl((uint32_t) now);
+  s->nout++;
+
+  s->sent_at[slot] = now;
+  s->tx[slot] = ++s->tx_count;
+  s->inflight++;
+  s->st.pkts++;
+  if (event == RUDP_EV_RESEND) {
+    s->st.resent++;
+  } else {
+    s->st.bytes += len;
+  }
+  trace_snd(s, event, seq, s->srtt_us);
+  return 0;
+}
+
+static void paced(rudp_sender *s, uint64_t now);
+
+// fold the packet just queued, a first transmission of seq, into its block's
+// parity; the block's last packet is followed out by the parity packets
+static int add_parity(rudp_sender *s, uint32_t seq, int sockfd, struct sockaddr_in *peer, uint64_t now) {
+  uint32_t first = seq / RUDP_FEC_K * RUDP_FEC_K;
+  struct iovec *data = &s->out[2 * (s->nout - 1) + 1];
+
+  if (seq == first) {
+    bzero(s->parity, (size_t) s->m.parity * s->seg);
+  }
+  for (uint32_t j = 0; j < s->m.parity; j++) {
+    fec_mul_add((uint8_t *) s->parity + j * s->seg, data->iov_base, fec_coef(j, seq - first), data->iov_len);
+  }
+  if (seq + 1 < s->npkts && seq + 1 - first < RUDP_FEC_K) {
+    return 0;
+  }
+
+  for (uint32_t j = 0; j < s->m.parity; j++) {
+    if (s->nout == RUDP_BATCH && flush_out(s, sockfd, peer) == -1) {
+      return -1;
+    }
+    rudp_hdr *h = &s->hdrs[s->nout];
+    struct iovec *iov = &s->out[2 * s->nout];
+    memcpy(s->buf[s->nout], s->parity + j * s->seg, s->seg);
+    iov[0].iov_base = h;
+    iov[0].iov_len = sizeof(*h);
+    iov[1].iov_base = s->buf[s->nout];
+    iov[1].iov_len = s->seg;
+    bzero(h, sizeof(*h));
+    h->type = RUDP_PARITY;
+    h->len = htons(s->seg);
+    h->session = htonl(s->session);
+    h->flags = s->round;
+    h->seq = htonl(first);
+    h->ts = htonl((uint32_t) now);
+    h->sack_top = htonl(j);
+    s->nout++;
+    s->tx_count++;
+    s->st.parity++;
+    trace_snd(s, RUDP_EV_PARITY, first, s->srtt_us);
+    paced(s, now); // parity takes its share of the path, not of cwnd
+  }
+
+  // the block counts as sent along with its parity, so a lost packet is
+  // only given up on once packets sent after the parity are acked, by
+  // which time the receiver has rebuilt it if it could
+  for (uint32_t q = first; q <= seq; q++) {
+    int slot = q % RUDP_MAX_WINDOW;
+    if (!s->acked[slot] && !s->lost[slot] && s->retries[slot] == 0) {
+      s->tx[slot] = s->tx_count;
+    }
+  }
+  return 0;
+}
+
+// earliest time the pacer lets the next packet out; spreads cwnd packets
+// over one srtt, a little faster while probing in slow start
+static uint64_t pace_interval(rudp_sender *s) {
+  if (s->srtt_us == 0) {
+    return 0;
+  }
+  double gain = s->cwnd < s->ssthresh ? 2.0 : 1.25;
+  return s->srtt_us / (s->cwnd * gain);
+}
+
+static int can_send_new(rudp_sender *s, uint64_t now) {
+  return s->next < s->npkts &&
+    s->next - s->base < RUDP_MAX_WINDOW &&
+    s->next < s->cum + s->rwnd &&
+    s->inflight < (uint32_t) s->cwnd &&
+    now >= s->next_send_us;
+}
+
+static void paced(rudp_sender *s, uint64_t now) {
+  uint64_t interval = pace_interval(s);
+  uint64_t earliest = now - RUDP_PACE_BURST * interval;
+  if (s->next_send_us < earliest) {
+    s->next_send_us = earliest; // don't bank credit while idle
+  }
+  s->next_send_us += interval;
+}
+
+// oldest transmission still waiting for an ack, for the retransmission timer
+static uint64_t oldest_unacked(rudp_sender *s) {
+  uint64_t oldest = 0;
+  for (uint32_t seq = s->base; seq < s->next; seq++) {
+    int slot = seq % RUDP_MAX_WINDOW;
+    if (!s->acked[slot] && !s->lost[slot] && (oldest == 0 || s->sent_at[slot] < oldest)) {
+      oldest = s->sent_at[slot];
+    }
+  }
+  return oldest;
+}
+
+int rudp_sender_pump(rudp_sender *s, int sockfd, struct sockaddr_in *peer) {
+  uint64_t now = rudp_now_us();
+
+  // between rounds the manifest is resent until a need list comes back
+  if (s->phase == RUDP_PHASE_DONE) {
+    return 0;
+  }
+  if (s->phase == RUDP_PHASE_MANIFEST) {
+    if (s->manifest_at != 0 && now - s->manifest_at < s->rto_us) {
+      return 0;
+    }
+    if (s->manifest_tries >= RUDP_MAX_RETRIES) {
+      printf("Receiver stopped answering, giving up\n");
+      return -1;
+    }
+    return send_manifest(s, sockfd, peer, now);
+  }
+
+  // retransmission timeout: every unacked packet is presumed lost and cwnd
+  // restarts from the minimum, with the timer backed off
+  uint64_t oldest = oldest_unacked(s);
+  if (oldest != 0 && now - oldest >= s->rto_us) {
+    for (uint32_t seq = s->base; seq < s->next; seq++) {
+      int slot = seq % RUDP_MAX_WINDOW;
+      if (!s->acked[slot] && !s->lost[slot]) {
+        s->lost[slot] = 1;
+        s->inflight--;
+        s->st.lost++;
+      }
+    }
+    s->st.timeouts++;
+    trace_snd(s, RUDP_EV_RTO, s->base, s->srtt_us);
+    s->ssthresh = s->cwnd / 2 > RUDP_MIN_CWND ? s->cwnd / 2 : RUDP_MIN_CWND;
+    s->cwnd = RUDP_MIN_CWND;
+    s->rto_us = s->rto_us * 2 < RUDP_RTO_MAX_US ? s->rto_us * 2 : RUDP_RTO_MAX_US;
+    s->in_recovery = 1;
+    s->recover = s->next;
+  }
+
+  // resend lost packets first, they count against cwnd like new ones
+  for (uint32_t seq = s->base; seq < s->next && s->inflight < (uint32_t) s->cwnd; seq++) {
+    int slot = seq % RUDP_MAX_WINDOW;
+    if (s->acked[slot] || !s->lost[slot]) {
+      continue;
+    }
+    if (++s->retries[slot] > RUDP_MAX_RETRIES) {
+      printf("Packet %u was never acked, giving up\n", seq);
+      return -1;
+    }
+    if (send_pkt(s, seq, RUDP_EV_RESEND, sockfd, peer, now) == -1) {
+      return -1;
+    }
+    s->lost[slot] = 0;
+  }
+
+  // then new packets, as far as both windows and the pacer allow
+  while (1) {
+    skip_have(s);
+    if (!can_send_new(s, now)) {
+      break;
+    }
+    int slot = s->next % RUDP_MAX_WINDOW;
+    s->acked[slot] = 0;
+    s->lost[slot] = 0;
+    s->retries[slot] = 0;
+    if (send_pkt(s, s->next, RUDP_EV_SEND, sockfd, peer, now) == -1 ||
+        (s->m.parity > 0 && add_parity(s, s->next, sockfd, peer, now) == -1)) {
+      return -1;
+    }
+    s->next++;
+    paced(s, now);
+  }
+  return flush_out(s, sockfd, peer);
+}
+
+static void rtt_sample(rudp_sender *s, uint32_t rtt) {
+  if (s->srtt_us == 0) {
+    s->srtt_us = rtt;
+    s->rttvar_us = rtt / 2;
+  } else {
+    uint32_t err = rtt > s->srtt_us ? rtt - s->srtt_us : s->srtt_us - rtt;
+    s->rttvar_us = (3 * s->rttvar_us + err) / 4;
+    s->srtt_us = (7 * s->srtt_us + rtt) / 8;
+  }
+  // the floor applies to the slack over srtt: on a steady path rttvar
+  // shrinks towards zero and an rto of barely one srtt would fire on every
+  // slightly late ack
+  uint32_t slack = 4 * s->rttvar_us > RUDP_RTO_MIN_US ? 4 * s->rttvar_us : RUDP_RTO_MIN_US;
+  uint32_t rto = s->srtt_us + slack;
+  s->rto_us = rto > RUDP_RTO_MAX_US ? RUDP_RTO_MAX_US : rto;
+
+  if (s->st.rtt_n == 0 || rtt < s->st.rtt_min) {
+    s->st.rtt_min = rtt;
+  }
+  if (rtt > s->st.rtt_max) {
+    s->st.rtt_max = rtt;
+  }
+  s->st.rtt_n++;
+  s->st.rtt_sum += rtt;
+}
+
+static void ack_pkt(rudp_sender *s, uint32_t seq) {
+  int slot = seq % RUDP_MAX_WINDOW;
+  if (s->acked[slot]) {
+    return;
+  }
+  s->acked[slot] = 1;
+  if (s->lost[slot]) {
+    s->lost[slot] = 0; // arrived after all, it was not counted in flight
+  } else {
+    s->inflight--;
+  }
+  if (s->tx[slot] > s->acked_tx) {
+    s->acked_tx = s->tx[slot];
+  }
+
+  // grow: one packet per ack in slow start, one per window after
+  if (!s->in_recovery) {
+    s->cwnd += s->cwnd < s->ssthresh ? 1 : 1 / s->cwnd;
+    if (s->cwnd > RUDP_MAX_WINDOW) {
+      s->cwnd = RUDP_MAX_WINDOW;
+    }
+  }
+}
+
+int rudp_sender_on_ack(rudp_sender *s, char *pkt, int n) {
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  if (n < (int) sizeof(rudp_hdr) || ntohl(h->session) != s->session) {
+    return s->phase == RUDP_PHASE_DONE;
+  }
+  if (h->type == RUDP_NEED && s->phase == RUDP_PHASE_MANIFEST && ntohl(h->seq) == s->round) {
+    return on_need(s, pkt, n);
+  }
+  // acks left over from an earlier round would ack the wrong packets
+  if (h->type != RUDP_ACK || s->phase != RUDP_PHASE_DATA || h->flags != (uint8_t) s->round) {
+    return s->phase == RUDP_PHASE_DONE;
+  }
+  uint32_t cum = ntohl(h->seq);
+  uint32_t top = ntohl(h->sack_top);
+  uint64_t sack = be64toh(h->sack);
+
+  if (cum > s->cum) {
+    s->cum = cum;
+  }
+  s->rwnd = ntohl(h->wnd);
+  uint32_t rtt = (uint32_t) rudp_now_us() - ntohl(h->ts);
+  rtt_sample(s, rtt);
+
+  // everything below the cumulative ack, then the selectively acked packets
+  for (uint32_t seq = s->base; seq < cum && seq < s->next; seq++) {
+    ack_pkt(s, seq);
+  }
+  for (uint32_t i = 0; i < RUDP_SACK_BITS && i <= top; i++) {
+    uint32_t seq = top - i;
+    if ((sack >> i) & 1 && seq >= s->base && seq < s->next) {
+      ack_pkt(s, seq);
+    }
+  }
+
+  // a packet overtaken by RUDP_DUPTHRESH later transmissions is presumed
+  // lost; the first loss in a window halves cwnd
+  for (uint32_t seq = s->base; seq < s->next; seq++) {
+    int slot = seq % RUDP_MAX_WINDOW;
+    if (s->acked[slot] || s->lost[slot] || s->tx[slot] + RUDP_DUPTHRESH > s->acked_tx) {
+      continue;
+    }
+    if (s->m.parity > 0 && s->cwnd >= RUDP_FEC_K + s->m.parity &&
+        s->next < s->npkts && seq / RUDP_FEC_K == s->next / RUDP_FEC_K) {
+      continue; // its block's parity is due within this window
+    }
+    s->lost[slot] = 1;
+    s->inflight--;
+    s->st.lost++;
+    trace_snd(s, RUDP_EV_LOSS, seq, s->srtt_us);
+    if (!s->in_recovery) {
+      s->ssthresh = s->cwnd / 2 > RUDP_MIN_CWND ? s->cwnd / 2 : RUDP_MIN_CWND;
+      s->cwnd = s->ssthresh;
+      s->in_recovery = 1;
+      s->recover = s->next;
+    }
+  }
+
+  // slide the window past the acked prefix
+  while (s->base < s->next && s->acked[s->base % RUDP_MAX_WINDOW]) {
+    s->base++;
+  }
+  if (s->in_recovery && s->base >= s->recover) {
+    s->in_recovery = 0;
+  }
+  s->st.cwnd_sum += s->cwnd;
+  if (s->cwnd > s->st.cwnd_max) {
+    s->st.cwnd_max = s->cwnd;
+  }
+  trace_snd(s, RUDP_EV_ACK, top, rtt);
+
+  // round complete, ask the receiver what it still lacks
+  skip_have(s);
+  if (s->base == s->npkts) {
+    s->round++;
+    s->phase = RUDP_PHASE_MANIFEST;
+    s->manifest_at = 0;
+    s->manifest_tries = 0;
+  }
+  return 0;
+}
+
+int64_t rudp_sender_timeout(rudp_sender *s) {
+  uint64_t now = rudp_now_us();
+  uint64_t soonest = 0;
+
+  if (s->phase == RUDP_PHASE_DONE) {
+    return -1;
+  }
+  if (s->phase == RUDP_PHASE_MANIFEST) {
+    soonest = s->manifest_at + s->rto_us;
+    return s->manifest_at != 0 && soonest > now ? (int64_t) (soonest - now) : 0;
+  }
+
+  // the retransmission timer
+  uint64_t oldest = oldest_unacked(s);
+  if (oldest != 0) {
+    soonest = oldest + s->rto_us;
+  }
+
+  // the pacer, if it is the only thing holding back a new packet
+  if (s->next < s->npkts && s->next - s->base < RUDP_MAX_WINDOW &&
+      s->next < s->cum + s->rwnd && s->inflight < (uint32_t) s->cwnd &&
+      (soonest == 0 || s->next_send_us < soonest)) {
+    soonest = s->next_send_us;
+  }
+  if (soonest == 0) {
+    return -1;
+  }
+  return soonest > now ? (int64_t) (soonest - now) : 0;
+}
+
+/*
+ * receiver
+ */
+
+/* head of the <file>.rudp state file, followed by the verified bitmap */
+typedef struct {
+  char magic[8];
+  uint64_t off, len;
+  uint32_t seg, chunk_pkts, nchunks, root;
+} rudp_state;
+
+#define RUDP_STATE_MAGIC "RUDPST01"
+
+int rudp_receiver_init(rudp_receiver *r, uint32_t session, int sockfd, int fd, off_t off, off_t len, int seg, char *path) {
+  bzero(r, sizeof(*r));
+  r->session = session;
+  r->statefd = -1;
+  if (path != NULL && (r->state_path = malloc(strlen(path) + sizeof(RUDP_STATE_SUFFIX))) != NULL) {
+    sprintf(r->state_path, "%s%s", path, RUDP_STATE_SUFFIX);
+  }
+  r->fd = fd;
+  r->off = off;
+  r->len = len;
+  r->seg = seg;
+  r->npkts = num_pkts(len, seg);
+  r->have = calloc(r->npkts / 8 + 1, 1);
+  r->st.streams = 1;
+  r->trace = trace_alloc();
+
+  // advertise what the socket buffer can hold; the kernel charges roughly
+  // twice the datagram size against it
+  int rcvbuf = 0;
+  socklen_t optlen = sizeof(rcvbuf);
+  getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen);
+  r->wnd = rcvbuf / (2 * (sizeof(rudp_hdr) + seg));
+  if (r->wnd < RUDP_MIN_CWND) {
+    r->wnd = RUDP_MIN_CWND;
+  }
+  return r->have == NULL ? -1 : 0;
+}
+
+static int have_pkt(rudp_receiver *r, uint32_t seq) {
+  return bit(r->have, seq);
+}
+
+static uint32_t chunk_npkts(rudp_receiver *r, uint32_t c) {
+  uint32_t first = c * r->m.chunk_pkts;
+  return r->npkts - first < r->m.chunk_pkts ? r->npkts - first : r->m.chunk_pkts;
+}
+
+// check a chunk against the manifest and remember it if it is good
+static int check_chunk(rudp_receiver *r, uint32_t c) {
+  uint32_t crc;
+  if (chunk_crc(&r->m, r->fd, r->off, r->len, r->seg, c, r->chunk, &crc) == -1 || crc != r->m.crc[c]) {
+    r->verified[c / 8] &= ~(1 << (c % 8));
+    return 0;
+  }
+  set_bit(r->verified, c);
+  if (r->statefd >= 0) {
+    pwrite(r->statefd, &r->verified[c / 8], 1, sizeof(rudp_state) + c / 8);
+  }
+  // start writing the chunk out now rather than leave it to pile up in the
+  // page cache; this doesn't wait for the disk
+  off_t bytes = (off_t) r->m.chunk_pkts * r->seg;
+  sync_file_range(r->fd, r->off + c * bytes, bytes, SYNC_FILE_RANGE_WRITE);
+  return 1;
+}
+
+// pick up the chunks an earlier, interrupted transfer of the same file
+// already got right; they are checked again since the file may have changed
+static void load_state(rudp_receiver *r) {
+  rudp_state st, want;
+  int bytes = r->m.nchunks / 8 + 1;
+
+  if (r->state_path == NULL || (r->statefd = open(r->state_path, O_RDWR | O_CREAT, 0644)) < 0) {
+    return;
+  }
+  bzero(&want, sizeof(want));
+  memcpy(want.magic, RUDP_STATE_MAGIC, sizeof(want.magic));
+  want.off = r->off;
+  want.len = r->len;
+  want.seg = r->seg;
+  want.chunk_pkts = r->m.chunk_pkts;
+  want.nchunks = r->m.nchunks;
+  want.root = r->m.root;
+
+  if (pread(r->statefd, &st, sizeof(st), 0) == sizeof(st) && memcmp(&st, &want, sizeof(st)) == 0 &&
+      pread(r->statefd, r->verified, bytes, sizeof(st)) == bytes) {
+    int resumed = 0;
+    for (uint32_t c = 0; c < r->m.nchunks; c++) {
+      if (bit(r->verified, c)) {
+        resumed += check_chunk(r, c);
+      }
+    }
+    printf("Resuming, %d of %u chunks already here\n", resumed, r->m.nchunks);
+  } else {
+    bzero(r->verified, bytes);
+    if (ftruncate(r->statefd, 0) == -1 || pwrite(r->statefd, &want, sizeof(want), 0) != sizeof(want)) {
+      close(r->statefd);
+      r->statefd = -1;
+      return;
+    }
+  }
+  pwrite(r->statefd, r->verified, bytes, sizeof(st));
+}
+
+// re-read the whole file and compare the root hash; good or not the state
+// file has done its job
+static int check_file(rudp_receiver *r) {
+  uint32_t root = 0;
+  for (uint32_t c = 0; c < r->m.nchunks; c++) {
+    uint32_t crc;
+    if (chunk_crc(&r->m, r->fd, r->off, r->len, r->seg, c, r->chunk, &crc) == -1) {
+      return 0;
+    }
+    uint32_t be = htonl(crc);
+    root = rudp_crc32c(root, &be, sizeof(be));
+  }
+  return root == r->m.root;
+}
+
+// start a round: only packets of chunks not yet verified are expected
+static void reset_round(rudp_receiver *r) {
+  bzero(r->have, r->npkts / 8 + 1);
+  for (uint32_t c = 0; c < r->m.nchunks; c++) {
+    r->count[c] = 0;
+    if (bit(r->verified, c)) {
+      for (uint32_t seq = c * r->m.chunk_pkts; seq < c * r->m.chunk_pkts + chunk_npkts(r, c); seq++) {
+        set_bit(r->have, seq);
+      }
+    }
+  }
+  r->cum = 0;
+  while (r->cum < r->npkts && have_pkt(r, r->cum)) {
+    r->cum++;
+  }
+  r->unacked = 0;
+}
+
+static int send_need(rudp_receiver *r, int sockfd, struct sockaddr_in *peer) {
+  char pkt[sizeof(rudp_hdr) + RUDP_MAX_CHUNKS / 8 + 1];
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  uint8_t *need = (uint8_t *) pkt + sizeof(rudp_hdr);
+  int bytes = (r->m.nchunks + 7) / 8;
+
+  bzero(pkt, sizeof(rudp_hdr) + bytes);
+  h->type = RUDP_NEED;
+  h->session = htonl(r->session);
+  h->seq = htonl(r->round);
+  h->wnd = htonl(r->wnd);
+  for (uint32_t c = 0; c < r->m.nchunks && !r->done; c++) {
+    if (!bit(r->verified, c)) {
+      set_bit(need, c);
+    }
+  }
+  if (sendto(sockfd, pkt, sizeof(rudp_hdr) + bytes, 0, (struct sockaddr *) peer, sizeof(*peer)) < 0) {
+    perror("ERROR in sendto");
+    return -1;
+  }
+  trace_rcv(r, RUDP_EV_ROUND, r->round);
+  return 0;
+}
+
+#define RUDP_FEC_RING (RUDP_MAX_WINDOW / RUDP_FEC_K + 2) /* blocks one window spans */
+
+// room for the parity of every block a window can span, then for the
+// syndromes, the rebuilt packets and one packet read back while decoding
+static int fec_setup(rudp_receiver *r) {
+  size_t row = r->seg, rows = (size_t) r->m.parity * row;
+  r->fec = calloc(RUDP_FEC_RING, sizeof(rudp_fec_block));
+  r->fec_buf = malloc(RUDP_FEC_RING * rows + 2 * rows + row);
+  if (r->fec == NULL || r->fec_buf == NULL) {
+    return -1;
+  }
+  for (int i = 0; i < RUDP_FEC_RING; i++) {
+    r->fec[i].first = UINT32_MAX;
+    r->fec[i].rows = r->fec_buf + i * rows;
+  }
+  return 0;
+}
+
+// see what a round left unverified; with nothing missing the whole file is
+// checked once more and the transfer is done
+static void end_round(rudp_receiver *r) {
+  int missing = 0;
+  for (uint32_t c = 0; c < r->m.nchunks; c++) {
+    missing += !bit(r->verified, c);
+  }
+  if (missing == 0 && check_file(r)) {
+    r->done = 1;
+    r->st.end_us = rudp_now_us();
+    trace_rcv(r, RUDP_EV_DONE, r->round);
+    trace_flush(r->trace, &r->ntrace);
+    if (r->statefd >= 0) {
+      close(r->statefd);
+      r->statefd = -1;
+      unlink(r->state_path);
+    }
+  } else if (missing == 0) {
+    printf("File hash mismatch, starting over\n");
+    bzero(r->verified, r->m.nchunks / 8 + 1);
+    if (r->statefd >= 0) {
+      pwrite(r->statefd, r->verified, r->m.nchunks / 8 + 1, sizeof(rudp_state));
+    }
+  } else if (r->round > 0) {
+    printf("%d chunks failed their checksum, asking again\n", missing);
+  }
+  if (!r->done) {
+    r->st.rounds++;
+  }
+  reset_round(r);
+}
+
+// true once every page of the manifest is in
+static int have_manifest(rudp_receiver *r) {
+  return r->m.crc != NULL && r->pages == NULL;
+}
+
+// take one page of the first round's manifest, the first page to arrive
+// sets up the chunk checks; 1 once the last page is in and the root hash
+// matches
+static int manifest_page(rudp_receiver *r, uint32_t *body, int n) {
+  uint32_t per = manifest_per_page(r->seg);
+  if (n < (int) (sizeof(rudp_hdr) + 5 * sizeof(uint32_t))) {
+    return 0;
+  }
+  if (r->m.crc == NULL) {
+    rudp_manifest m;
+    m.chunk_pkts = ntohl(body[0]);
+    if (m.chunk_pkts == 0 || m.chunk_pkts % RUDP_FEC_K != 0 ||
+        ntohl(body[1]) != (r->npkts + m.chunk_pkts - 1) / m.chunk_pkts ||
+        ntohl(body[1]) > RUDP_MAX_CHUNKS || ntohl(body[3]) > RUDP_FEC_MAX) {
+      printf("Bad manifest\n");
+      return -1;
+    }
+    m.nchunks = ntohl(body[1]);
+    m.root = ntohl(body[2]);
+    m.parity = ntohl(body[3]);
+    m.crc = malloc(m.nchunks * sizeof(uint32_t) + 1);
+    r->verified = calloc(m.nchunks / 8 + 1, 1);
+    r->count = calloc(m.nchunks + 1, sizeof(*r->count));
+    r->chunk = malloc((size_t) m.chunk_pkts * r->seg);
+    r->pages_left = manifest_pages(&m, r->seg);
+    r->pages = calloc(r->pages_left / 8 + 1, 1);
+    if (m.crc == NULL || r->verified == NULL || r->count == NULL || r->chunk == NULL || r->pages == NULL) {
+      free(m.crc);
+      return -1;
+    }
+    r->m = m;
+    r->st.start_us = rudp_now_us();
+    if (m.parity > 0 && fec_setup(r) == -1) {
+      return -1;
+    }
+  }
+
+  // every page repeats the manifest's shape and starts on a page boundary
+  uint32_t first = ntohl(body[4]);
+  if (ntohl(body[0]) != r->m.chunk_pkts || ntohl(body[1]) != r->m.nchunks ||
+      ntohl(body[2]) != r->m.root || ntohl(body[3]) != r->m.parity ||
+      first % per != 0 || (first >= r->m.nchunks && first != 0)) {
+    printf("Bad manifest\n");
+    return -1;
+  }
+  uint32_t count = r->m.nchunks - first < per ? r->m.nchunks - first : per;
+  if (n != (int) (sizeof(rudp_hdr) + (5 + count) * sizeof(uint32_t))) {
+    printf("Bad manifest\n");
+    return -1;
+  }
+  if (bit(r->pages, first / per)) {
+    return 0;
+  }
+  set_bit(r->pages, first / per);
+  for (uint32_t c = 0; c < count; c++) {
+    r->m.crc[first + c] = ntohl(body[5 + c]);
+  }
+  if (--r->pages_left > 0) {
+    return 0;
+  }
+  free(r->pages);
+  r->pages = NULL;
+  if (manifest_root(&r->m) != r->m.root) {
+    printf("Bad manifest\n");
+    return -1;
+  }
+  return 1;
+}
+
+// a manifest opens every round; the first one sets up the chunk checks
+static int on_manifest(rudp_receiver *r, char *pkt, int n, int sockfd, struct sockaddr_in *peer) {
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  uint32_t *body = (uint32_t *) (pkt + sizeof(rudp_hdr));
+  uint32_t round = ntohl(h->seq);
+
+  if (!have_manifest(r) && round == 0) {
+    int whole = manifest_page(r, body, n);
+    if (whole != 1) {
+      return whole;
+    }
+    // an empty file, or one a resumed transfer already has whole, needs
+    // no data at all
+    load_state(r);
+    end_round(r);
+  }
+  else if (have_manifest(r) && round == r->round + 1 && !r->done) {
+    // the sender has every packet of the last round acked; what is still
+    // unverified came in corrupt
+    r->round = round;
+    end_round(r);
+  }
+  else if (!have_manifest(r) || round != r->round ||
+           n < (int) (sizeof(rudp_hdr) + 5 * sizeof(uint32_t)) || body[4] != 0) {
+    // one need list per resent manifest, not one per page
+    return r->done;
+  }
+
+  // a repeated manifest means our need list was lost, send it again
+  if (send_need(r, sockfd, peer) == -1) {
+    return -1;
+  }
+  return r->done;
+}
+
+int rudp_receiver_flush(rudp_receiver *r, int sockfd, struct sockaddr_in *peer);
+
+// queue an ack for packet seq: cumulative ack, echoed timestamp and the
+// packets just before it
+static int queue_ack(rudp_receiver *r, uint32_t seq, uint32_t ts, int sockfd, struct sockaddr_in *peer) {
+  if (r->nacks == RUDP_BATCH && rudp_receiver_flush(r, sockfd, peer) == -1) {
+    return -1;
+  }
+  rudp_hdr *h = &r->acks[r->nacks++];
+  uint64_t sack = 0;
+  for (uint32_t i = 0; i < RUDP_SACK_BITS && i <= seq; i++) {
+    if (seq - i < r->npkts && have_pkt(r, seq - i)) {
+      sack |= (uint64_t) 1 << i;
+    }
+  }
+  bzero(h, sizeof(*h));
+  h->type = RUDP_ACK;
+  h->flags = r->round;
+  h->session = htonl(r->session);
+  h->seq = htonl(r->cum);
+  h->ts = ts;
+  h->wnd = htonl(r->wnd);
+  h->sack_top = htonl(seq);
+  h->sack = htobe64(sack);
+  r->unacked = 0;
+  return 0;
+}
+
+int rudp_receiver_flush(rudp_receiver *r, int sockfd, struct sockaddr_in *peer) {
+  struct mmsghdr msgs[RUDP_BATCH];
+  struct iovec iov[RUDP_BATCH];
+
+  if (r->unacked > 0 && r->nacks < RUDP_BATCH) {
+    queue_ack(r, r->last_seq, r->last_ts, sockfd, peer);
+  }
+  for (int i = 0; i < r->nacks; i++) {
+    iov[i].iov_base = &r->acks[i];
+    iov[i].iov_len = sizeof(rudp_hdr);
+    bzero(&msgs[i].msg_hdr, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_name = peer;
+    msgs[i].msg_hdr.msg_namelen = sizeof(*peer);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (int sent = 0; sent < r->nacks; ) {
+    int n = sendmmsg(sockfd, msgs + sent, r->nacks - sent, 0);
+    if (n < 0) {
+      perror("ERROR in sendmmsg");
+      return -1;
+    }
+    sent += n;
+  }
+  r->nacks = 0;
+  return 0;
+}
+
+// write a packet at its offset; a chunk is checked as soon as its last
+// packet lands
+static int store_pkt(rudp_receiver *r, uint32_t seq, char *data, int len) {
+  if (pwrite(r->fd, data, len, r->off + (off_t) seq * r->seg) != len) {
+    printf("Writing to file failed\n");
+    return -1;
+  }
+  set_bit(r->have, seq);
+  while (r->cum < r->npkts && have_pkt(r, r->cum)) {
+    r->cum++;
+  }
+  r->st.bytes += len;
+  uint32_t c = seq / r->m.chunk_pkts;
+  if (++r->count[c] == chunk_npkts(r, c) && !check_chunk(r, c)) {
+    r->st.bad_chunks++;
+    trace_rcv(r, RUDP_EV_BAD_CHUNK, c);
+  }
+  return 0;
+}
+
+static int pkt_len(rudp_receiver *r, uint32_t seq) {
+  off_t off = (off_t) seq * r->seg;
+  return r->len - off < r->seg ? r->len - off : r->seg;
+}
+
+// rebuild the packets missing from block first once there is as much parity
+// as there are holes: the parity rows less the packets that did arrive leave
+// a small Cauchy system in the missing ones. Returns one past the last
+// packet rebuilt, 0 if none
+static int64_t fec_recover(rudp_receiver *r, uint32_t first) {
+  rudp_fec_block *b = &r->fec[first / RUDP_FEC_K % RUDP_FEC_RING];
+  uint32_t kb = r->npkts - first < RUDP_FEC_K ? r->npkts - first : RUDP_FEC_K;
+  int miss[RUDP_FEC_MAX], rows[RUDP_FEC_MAX];
+  int e = 0, nrows = 0;
+
+  if (b->first != first || b->round != r->round) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < kb; i++) {
+    if (!have_pkt(r, first + i)) {
+      if (e == RUDP_FEC_MAX) {
+        return 0;
+      }
+      miss[e++] = i;
+    }
+  }
+  if (e == 0) {
+    b->first = UINT32_MAX; // complete, its parity is no longer needed
+    return 0;
+  }
+  for (uint32_t j = 0; j < r->m.parity && nrows < e; j++) {
+    if ((b->got >> j) & 1) {
+      rows[nrows++] = j;
+    }
+  }
+  if (nrows < e) {
+    return 0;
+  }
+
+  // syndromes: each parity row with the packets we have taken back out
+  size_t seg = r->seg;
+  char *syn = r->fec_buf + RUDP_FEC_RING * r->m.parity * seg;
+  char *out = syn + e * seg;
+  char *tmp = out + e * seg;
+  for (int a = 0; a < e; a++) {
+    memcpy(syn + a * seg, b->rows + rows[a] * seg, seg);
+  }
+  for (uint32_t i = 0, a = 0; i < kb; i++) {
+    if (a < (uint32_t) e && miss[a] == (int) i) {
+      a++;
+      continue;
+    }
+    int len = pkt_len(r, first + i);
+    if (pread(r->fd, tmp, len, r->off + (off_t) (first + i) * r->seg) != len) {
+      return 0;
+    }
+    for (int k = 0; k < e; k++) {
+      fec_mul_add((uint8_t *) syn + k * seg, (uint8_t *) tmp, fec_coef(rows[k], i), len);
+    }
+  }
+
+  uint8_t m[RUDP_FEC_MAX * RUDP_FEC_MAX];
+  for (int k = 0; k < e; k++) {
+    for (int a = 0; a < e; a++) {
+      m[k * e + a] = fec_coef(rows[k], miss[a]);
+    }
+  }
+  if (fec_invert(m, e) == -1) {
+    return 0;
+  }
+  bzero(out, e * seg);
+  for (int a = 0; a < e; a++) {
+    for (int k = 0; k < e; k++) {
+      fec_mul_add((uint8_t *) out + a * seg, (uint8_t *) syn + k * seg, m[a * e + k], seg);
+    }
+    if (store_pkt(r, first + miss[a], out + a * seg, pkt_len(r, first + miss[a])) == -1) {
+      return -1;
+    }
+    r->st.rebuilt++;
+    trace_rcv(r, RUDP_EV_REBUILT, first + miss[a]);
+  }
+  b->first = UINT32_MAX;
+  return first + miss[e - 1] + 1;
+}
+
+// keep a parity packet for its block and rebuild what it can
+static int on_parity(rudp_receiver *r, char *pkt, int n, int sockfd, struct sockaddr_in *peer) {
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  uint32_t first = ntohl(h->seq);
+  uint32_t row = ntohl(h->sack_top);
+  if (r->fec == NULL || first % RUDP_FEC_K != 0 || first >= r->npkts || row >= r->m.parity ||
+      ntohs(h->len) != r->seg || n != (int) sizeof(rudp_hdr) + r->seg) {
+    return 0;
+  }
+  rudp_fec_block *b = &r->fec[first / RUDP_FEC_K % RUDP_FEC_RING];
+  r->st.parity++;
+  if (b->first != first || b->round != r->round) {
+    b->first = first;
+    b->round = r->round;
+    b->got = 0;
+  }
+  memcpy(b->rows + row * r->seg, pkt + sizeof(rudp_hdr), r->seg);
+  b->got |= 1 << row;
+
+  int64_t end = fec_recover(r, first);
+  if (end <= 0) {
+    return end;
+  }
+  return queue_ack(r, end - 1, h->ts, sockfd, peer);
+}
+
+int rudp_receiver_on_data(rudp_receiver *r, char *pkt, int n, int sockfd, struct sockaddr_in *peer) {
+  rudp_hdr *h = (rudp_hdr *) pkt;
+  if (n < (int) sizeof(rudp_hdr) || ntohl(h->session) != r->session) {
+    return r->done;
+  }
+  if (h->type == RUDP_MANIFEST) {
+    return on_manifest(r, pkt, n, sockfd, peer);
+  }
+  if ((h->type != RUDP_DATA && h->type != RUDP_PARITY) || !have_manifest(r) || r->done ||
+      h->flags != (uint8_t) r->round) {
+    return r->done;
+  }
+  if (h->type == RUDP_PARITY) {
+    return on_parity(r, pkt, n, sockfd, peer);
+  }
+  uint32_t seq = ntohl(h->seq);
+  int len = ntohs(h->len);
+  off_t off = (off_t) seq * r->seg;
+  int in_order = seq == r->cum;
+
+  // packets can arrive out of order, each one goes straight to its offset;
+  // with parity in, a late packet may be what completes a block's rebuild
+  r->st.pkts++;
+  if (seq < r->npkts && !have_pkt(r, seq) && len == n - (int) sizeof(rudp_hdr) &&
+      len <= r->seg && off + len <= r->len) {
+    trace_rcv(r, RUDP_EV_RECV, seq);
+    if (store_pkt(r, seq, pkt + sizeof(rudp_hdr), len) == -1 ||
+        (r->fec != NULL && fec_recover(r, seq / RUDP_FEC_K * RUDP_FEC_K) == -1)) {
+      return -1;
+    }
+  } else if (seq < r->npkts && have_pkt(r, seq)) {
+    r->st.resent++;
+    trace_rcv(r, RUDP_EV_DUP, seq);
+  }
+
+  // steady in-order data is acked every few packets; gaps, holes being
+  // filled, duplicates (the previous ack may have been lost) and the last
+  // packet are acked straight away
+  if (in_order && r->cum == seq + 1 && r->cum < r->npkts && ++r->unacked < RUDP_ACK_EVERY) {
+    r->last_seq = seq;
+    r->last_ts = h->ts;
+  } else if (queue_ack(r, seq, h->ts, sockfd, peer) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+void rudp_receiver_free(rudp_receiver *r) {
+  if (r->statefd >= 0) {
+    close(r->statefd);
+  }
+  free(r->have);
+  free(r->m.crc);
+  free(r->verified);
+  free(r->count);
+  free(r->pages);
+  free(r->chunk);
+  free(r->state_path);
+  free(r->fec);
+  free(r->fec_buf);
+  trace_flush(r->trace, &r->ntrace);
+  free(r->trace);
+  bzero(r, sizeof(*r));
+  r->statefd = -1;
+}
+
+/*
+ * blocking transfers
+ */
+
+static int wait_readable(int sockfd, int64_t timeout_us) {
+  struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+  struct timespec ts;
+  ts.tv_sec = timeout_us / 1000000;
+  ts.tv_nsec = (timeout_us % 1000000) * 1000;
+  return ppoll(&pfd, 1, timeout_us < 0 ? NULL : &ts, NULL);
+}
+
+int rudp_send_file(int sockfd, struct sockaddr_in *peer, uint32_t session, int fd, off_t off, off_t len, int seg, int parity, rudp_stats *st) {
+  rudp_sender *s = malloc(sizeof(rudp_sender));
+  rudp_batch *b = malloc(sizeof(rudp_batch));
+  int ret = 0;
+
+  if (s == NULL || b == NULL) {
+    free(s);
+    free(b);
+    return -1;
+  }
+  if (rudp_sender_init(s, session, fd, off, len, seg, parity) == -1) {
+    ret = -1;
+  }
+  while (ret == 0 && s->phase != RUDP_PHASE_DONE) {
+    if (rudp_sender_pump(s, sockfd, peer) == -1) {
+      ret = -1;
+      break;
+    }
+    if (wait_readable(sockfd, rudp_sender_timeout(s)) <= 0) {
+      continue;
+    }
+
+    // drain every queued ack before pumping again
+    while (rudp_recv_batch(sockfd, b, MSG_DONTWAIT) > 0) {
+      for (int i = 0; i < b->n; i++) {
+        if (from_peer(b->from[i], peer)) {
+          rudp_sender_on_ack(s, b->pkt[i], b->len[i]);
+        }
+      }
+    }
+  }
+  if (st != NULL) {
+    *st = s->st;
+  }
+  rudp_sender_free(s);
+  free(s);
+  free(b);
+  return ret;
+}
+
+int rudp_recv_file(int sockfd, struct sockaddr_in *peer, uint32_t session, int fd, off_t off, off_t len, int seg, char *path, rudp_stats *st) {
+  rudp_receiver r;
+  rudp_batch *b = malloc(sizeof(rudp_batch));
+  char buf[sizeof(rudp_hdr)];
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  int done = 0;
+
+  if (b == NULL || rudp_receiver_init(&r, session, sockfd, fd, off, len, seg, path) == -1) {
+    free(b);
+    return -1;
+  }
+
+  // once complete, keep acking retransmissions until the sender goes quiet
+  while (1) {
+    int ready = wait_readable(sockfd, (done ? RUDP_LINGER_MS : RUDP_IDLE_MS) * 1000L);
+    if (ready == 0) {
+      break;
+    }
+    if (ready < 0) {
+      perror("ERROR in ppoll");
+      break;
+    }
+    // while lingering, leave anything but this transfer's data (e.g. the
+    // peer's next command) in the socket for the caller
+    if (done) {
+      fromlen = sizeof(from);
+      int n = recvfrom(sockfd, buf, sizeof(buf), MSG_PEEK | MSG_TRUNC, (struct sockaddr *) &from, &fromlen);
+      if (n < 0 || !from_peer(&from, peer) || !rudp_is_pkt(buf, n) ||
+          (buf[0] != RUDP_DATA && buf[0] != RUDP_MANIFEST && buf[0] != RUDP_PARITY) ||
+          rudp_pkt_session(buf) != session) {
+        break;
+      }
+    }
+    if (rudp_recv_batch(sockfd, b, MSG_DONTWAIT) < 0) {
+      continue;
+    }
+    int ret = 0;
+    for (int i = 0; i < b->n && ret != -1; i++) {
+      // a stream receiver learns the sender's port from its first packet
+      if (peer->sin_port == 0 && rudp_is_pkt(b->pkt[i], b->len[i]) &&
+          rudp_pkt_session(b->pkt[i]) == session && b->from[i]->sin_addr.s_addr == peer->sin_addr.s_addr) {
+        peer->sin_port = b->from[i]->sin_port;
+      }
+      if (from_peer(b->from[i], peer)) {
+        ret = rudp_receiver_on_data(&r, b->pkt[i], b->len[i], sockfd, peer);
+        done |= ret == 1;
+      }
+    }
+    if (ret == -1 || rudp_receiver_flush(&r, sockfd, peer) == -1) {
+      break;
+    }
+  }
+  if (st != NULL) {
+    *st = r.st;
+  }
+  rudp_receiver_free(&r);
+  free(b);
+
+  if (!done) {
+    printf("Transfer timed out\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * parallel streams
+ */
+
+typedef struct {
+  int sockfd;
+  struct sockaddr_in peer;
+  uint32_t session;
+  int fd;
+  off_t off, len;
+  int seg;
+  int parity;
+  char path[256];
+  rudp_stats st;
+  int ret;
+} stream;
+
+// stream i of k covers a whole number of segments, the last one the rest
+static void stream_range(off_t len, int seg, int k, int i, off_t *off, off_t *rlen) {
+  off_t per = ((len + k - 1) / k + seg - 1) / seg * seg;
+  *off = per * i < len ? per * i : len;
+  *rlen = len - *off < per ? len - *off : per;
+}
+
+static void *send_stream(void *arg) {
+  stream *st = arg;
+  st->ret = rudp_send_file(st->sockfd, &st->peer, st->session, st->fd, st->off, st->len, st->seg, st->parity, &st->st);
+  return NULL;
+}
+
+static void *recv_stream(void *arg) {
+  stream *st = arg;
+  st->ret = rudp_recv_file(st->sockfd, &st->peer, st->session, st->fd, st->off, st->len, st->seg, st->path, &st->st);
+  return NULL;
+}
+
+// run one thread per stream and wait for all of them
+static int run_streams(int *socks, struct sockaddr_in *peers, int k, uint32_t session, int fd,
+    off_t len, int seg, int parity, char *path, rudp_stats *sum, void *(*fn)(void *)) {
+  stream st[RUDP_MAX_STREAMS];
+  pthread_t tid[RUDP_MAX_STREAMS];
+  int started[RUDP_MAX_STREAMS];
+  int ret = 0;
+
+  if (sum != NULL) {
+    bzero(sum, sizeof(*sum));
+  }
+  for (int i = 0; i < k; i++) {
+    st[i].sockfd = socks[i];
+    st[i].peer = peers[i];
+    st[i].session = session;
+    st[i].fd = fd;
+    st[i].seg = seg;
+    st[i].parity = parity;
+    stream_range(len, seg, k, i, &st[i].off, &st[i].len);
+    snprintf(st[i].path, sizeof(st[i].path), "%s.%d", path != NULL ? path : "", i);
+    bzero(&st[i].st, sizeof(st[i].st));
+    st[i].ret = -1;
+    started[i] = pthread_create(&tid[i], NULL, fn, &st[i]) == 0;
+  }
+  for (int i = 0; i < k; i++) {
+    if (started[i]) {
+      pthread_join(tid[i], NULL);
+    }
+    ret |= st[i].ret;
+    close(socks[i]);
+    if (sum != NULL) {
+      rudp_stats_add(sum, &st[i].st);
+    }
+  }
+  return ret == 0 ? 0 : -1;
+}
+
+int rudp_send_streams(int *socks, struct sockaddr_in *peers, int k, uint32_t session, int fd, off_t len, int seg, int parity, rudp_stats *st) {
+  return run_streams(socks, peers, k, session, fd, len, seg, parity, NULL, st, send_stream);
+}
+
+int rudp_recv_streams(int *socks, struct sockaddr_in *peer, int k, uint32_t session, int fd, off_t len, int seg, char *path, rudp_stats *st) {
+  struct sockaddr_in peers[RUDP_MAX_STREAMS];
+  for (int i = 0; i < k; i++) {
+    peers[i] = *peer;
+    peers[i].sin_port = 0; // learned from each sender's first packet
+  }
+  return run_streams(socks, peers, k, session, fd, len, seg, 0, path, st, recv_stream);
+}
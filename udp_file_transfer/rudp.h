@@ -0,0 +1,326 @@
+#ifndef RUDP_H
+#define RUDP_H
+
+/*
+ * rudp - sliding-window reliable file transfer over UDP, shared by the
+ * client and the server. Files are cut into numbered packets; the receiver
+ * answers each one with a cumulative ack, the packet's echoed timestamp,
+ * its receive window and a bitmap of the packets received just before it.
+ *
+ * The sender keeps min(cwnd, receive window) packets in flight. cwnd grows
+ * Reno-style (slow start, then +1 per round trip) and is halved once per
+ * window when the acks show a packet was overtaken by RUDP_DUPTHRESH later
+ * sends; a retransmission timeout collapses it. Sends are spread over the
+ * smoothed RTT rather than burst out, so a fast sender doesn't overrun the
+ * receiver's socket buffer or a bottleneck queue.
+ *
+ * Every packet carries the session ID of its transfer, chosen by the side
+ * sending the file, so one socket can carry several transfers at once and
+ * stray packets from an earlier transfer are ignored.
+ *
+ * The payload per datagram (the segment size) is sized to the path MTU and
+ * announced along with the session. Datagrams go out in batches with
+ * sendmmsg, runs of full segments as one UDP GSO send, and come in through
+ * recvmmsg with GRO, so a large file costs a few syscalls per window rather
+ * than one per kilobyte.
+ *
+ * Files move in chunks of RUDP_CHUNK_PKTS packets. The sender opens each
+ * round with a manifest (the CRC32C of every chunk and a root hash over
+ * them), cut into pages of one segment each so no datagram is fragmented
+ * on the way; the receiver answers with the chunks it still needs, checks
+ * each chunk as it completes and records the good ones in a <file>.rudp
+ * state file. Rounds repeat until nothing is needed, so a corrupt chunk is simply
+ * sent again, and a transfer retried after an interruption only moves what
+ * is missing. The state file goes away once the whole file checks out.
+ *
+ * Large files are split into up to RUDP_MAX_STREAMS byte ranges, each one
+ * an independent transfer over its own socket and thread, so one flow's
+ * per-packet work no longer caps the rate. The receiver opens the stream
+ * sockets and announces their ports; senders are recognised by session ID.
+ *
+ * The sender maps its range of the file and points each datagram's payload
+ * iovec straight at the mapping, so file data is copied once, by the
+ * kernel, on its way out. The receiver pwrites each packet at its offset
+ * and starts writeback of every chunk that checks out, so the disk keeps
+ * up with the network instead of facing one large flush at the end.
+ *
+ * On lossy links the sender can add parity: every RUDP_FEC_K data packets
+ * are followed by up to RUDP_FEC_MAX Reed-Solomon parity packets (see
+ * fec.h), the count announced in the manifest. A receiver missing no more
+ * packets of a block than it has parity for rebuilds them on the spot, and
+ * the sender holds off declaring a protected packet lost until packets
+ * sent after its parity are acked, so those losses cost no round trip.
+ *
+ * Both ends count what a transfer did in a rudp_stats: bytes and time,
+ * packets, resends, losses, timeouts, RTT samples and cwnd. The blocking
+ * calls hand them back for rudp_stats_print. With RUDP_TRACE naming a file
+ * every send, ack, loss and receive is also appended to it as a fixed-size
+ * rudp_trace_rec, buffered so tracing costs no syscall per packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#define RUDP_DEF_SEG 1024 /* file bytes per datagram when the path MTU is unknown */
+#define RUDP_MAX_SEG 8192 /* largest segment, even on jumbo or loopback paths */
+#define RUDP_MAX_DGRAM 65536 /* one GSO send or GRO receive */
+#define RUDP_BATCH 32 /* datagrams or GSO sends per sendmmsg/recvmmsg */
+#define RUDP_MAX_WINDOW 4096 /* upper bound on packets in flight */
+#define RUDP_SACK_BITS 64 /* packets at and before the acked one covered by an ack */
+#define RUDP_INIT_CWND 10 /* packets */
+#define RUDP_MIN_CWND 2 /* packets */
+#define RUDP_DUPTHRESH 3 /* later sends acked before a packet counts as lost */
+#define RUDP_RTO_INIT_US 200000 /* before the first rtt sample */
+#define RUDP_RTO_MIN_US 20000
+#define RUDP_RTO_MAX_US 2000000
+#define RUDP_PACE_BURST 8 /* packets that may leave back to back */
+#define RUDP_ACK_EVERY 8 /* in-order packets per ack; gaps are acked at once */
+#define RUDP_RCVBUF (4 * 1024 * 1024) /* requested receive socket buffer */
+#define RUDP_MAX_RETRIES 20 /* give up on a packet after this many resends */
+#define RUDP_IDLE_MS 5000 /* receiver gives up after this long without data */
+#define RUDP_LINGER_MS 500 /* receiver re-acks duplicates this long after finishing */
+#define RUDP_CHUNK_PKTS 64 /* packets per checksummed chunk, more for huge files */
+#define RUDP_MAX_CHUNKS (RUDP_DEF_SEG * 8) /* so a need list fits one segment */
+#define RUDP_STATE_SUFFIX ".rudp"
+#define RUDP_MAX_STREAMS 4 /* parallel ranges for one large file */
+#define RUDP_STREAM_MIN (32 * 1024 * 1024) /* bytes per stream, smaller files use one */
+#define RUDP_FEC_K 16 /* data packets per parity block, divides RUDP_CHUNK_PKTS */
+#define RUDP_FEC_MAX 8 /* parity packets per block */
+#define RUDP_TRACE_ENV "RUDP_TRACE" /* names the trace file, tracing is off without it */
+#define RUDP_TRACE_BUF 256 /* records buffered per transfer before a write */
+
+#define RUDP_DATA 1
+#define RUDP_ACK 2
+#define RUDP_MANIFEST 3 /* seq: round; payload: chunk_pkts, nchunks, root, parity, first, crc[first..] up to a segment */
+#define RUDP_NEED 4 /* seq: round; payload: bitmap of chunks still needed, empty when done */
+#define RUDP_PARITY 5 /* seq: first packet of the block; sack_top: parity row; payload: seg bytes */
+
+/* wire header, all fields in network byte order */
+typedef struct __attribute__((packed)) {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t len; /* DATA: payload bytes following the header */
+  uint32_t session; /* transfer this packet belongs to */
+  uint32_t seq; /* DATA: packet number; ACK: next packet expected */
+  uint32_t ts; /* DATA: send time in us; ACK: ts of the packet being acked */
+  uint32_t wnd; /* ACK: packets the receiver accepts past seq */
+  uint32_t sack_top; /* ACK: the packet being acked */
+  uint64_t sack; /* ACK: bit i set if packet sack_top - i was received */
+} rudp_hdr;
+
+/* what both ends know about the file's chunks */
+typedef struct {
+  uint32_t chunk_pkts;
+  uint32_t nchunks;
+  uint32_t root; /* CRC32C over crc[] */
+  uint32_t parity; /* parity packets per RUDP_FEC_K data packets, 0 for none */
+  uint32_t *crc; /* CRC32C of each chunk */
+} rudp_manifest;
+
+/* parity a receiver holds for one block until it can rebuild the block */
+typedef struct {
+  uint32_t first; /* first packet of the block */
+  uint32_t round;
+  uint32_t got; /* bit j set once parity row j is in */
+  char *rows; /* m.parity rows of seg bytes */
+} rudp_fec_block;
+
+enum { RUDP_PHASE_MANIFEST, RUDP_PHASE_DATA, RUDP_PHASE_DONE };
+
+/* what one end of a transfer did, or several streams' ends added up */
+typedef struct {
+  uint64_t start_us, end_us; /* first manifest to the receiver's last need list */
+  uint64_t bytes; /* file bytes moved, resends and duplicates not counted */
+  uint64_t pkts; /* data packets sent or received, resends and duplicates included */
+  uint64_t resent; /* sender: retransmissions; receiver: duplicates */
+  uint64_t lost; /* sender: packets presumed lost, by acks or a timeout */
+  uint64_t timeouts; /* sender: retransmission timeouts */
+  uint64_t parity; /* parity packets sent or received */
+  uint64_t rebuilt; /* receiver: packets rebuilt from parity */
+  uint64_t bad_chunks; /* receiver: chunks that failed their checksum */
+  uint32_t rounds; /* rounds that moved data */
+  uint32_t streams; /* transfers added up here */
+  uint64_t rtt_n, rtt_sum; /* sender: rtt samples, one per ack */
+  uint32_t rtt_min, rtt_max;
+  double cwnd_sum, cwnd_max; /* sender: cwnd after each ack */
+} rudp_stats;
+
+enum {
+  RUDP_EV_SEND = 1, /* sender: seq sent for the first time this round */
+  RUDP_EV_RESEND, /* sender: seq sent again */
+  RUDP_EV_PARITY, /* sender: parity for the block starting at seq */
+  RUDP_EV_ACK, /* sender: ack for seq, rtt_us is its sample */
+  RUDP_EV_LOSS, /* sender: seq presumed lost */
+  RUDP_EV_RTO, /* sender: retransmission timeout, seq is the oldest unacked */
+  RUDP_EV_ROUND, /* sender: round seq starts; receiver: need list for round seq sent */
+  RUDP_EV_RECV, /* receiver: seq written */
+  RUDP_EV_DUP, /* receiver: seq received again */
+  RUDP_EV_REBUILT, /* receiver: seq rebuilt from parity */
+  RUDP_EV_BAD_CHUNK, /* receiver: chunk seq failed its checksum */
+  RUDP_EV_DONE /* either: transfer complete */
+};
+
+/* one trace event, host byte order */
+typedef struct __attribute__((packed)) {
+  uint64_t t_us; /* rudp_now_us() */
+  uint32_t session;
+  uint8_t event; /* RUDP_EV_* */
+  uint8_t round;
+  uint16_t unused;
+  uint32_t seq;
+  uint32_t inflight; /* sender: packets in flight; receiver: cumulative ack */
+  uint32_t rtt_us; /* sender: srtt, or the sample for RUDP_EV_ACK */
+  float cwnd; /* sender: congestion window in packets */
+} rudp_trace_rec;
+
+typedef struct {
+  uint32_t session;
+  int fd; /* file being sent */
+  off_t off; /* where the range being sent starts */
+  off_t len;
+  int seg; /* payload bytes per packet */
+  uint32_t npkts;
+  char *map; /* the range mapped read-only, NULL to fall back on pread */
+  char *data; /* first byte of the range within map */
+  size_t maplen;
+  rudp_manifest m;
+  int phase; /* RUDP_PHASE_* */
+  uint32_t round;
+  uint8_t *skip; /* chunks the receiver has, not sent this round */
+  uint8_t *parity; /* parity rows of the block being sent */
+  uint64_t manifest_at; /* last manifest sent */
+  int manifest_tries;
+
+  uint32_t base; /* oldest unacked packet */
+  uint32_t next; /* next packet never sent */
+  uint32_t cum; /* receiver's cumulative ack */
+  uint32_t rwnd; /* receiver's advertised window */
+
+  // congestion control
+  double cwnd; /* packets */
+  double ssthresh;
+  uint32_t inflight; /* sent, not acked and not presumed lost */
+  int in_recovery; /* cwnd already cut for losses below recover */
+  uint32_t recover;
+
+  // rtt estimation (RFC 6298)
+  uint32_t srtt_us; /* 0 until the first sample */
+  uint32_t rttvar_us;
+  uint32_t rto_us;
+
+  // pacing
+  uint64_t next_send_us;
+
+  // per in-flight slot, indexed by seq % RUDP_MAX_WINDOW
+  uint64_t tx_count; /* transmissions so far, orders sends for loss detection */
+  uint64_t acked_tx; /* highest tx of an acked packet */
+  uint64_t sent_at[RUDP_MAX_WINDOW];
+  uint64_t tx[RUDP_MAX_WINDOW];
+  uint8_t acked[RUDP_MAX_WINDOW];
+  uint8_t lost[RUDP_MAX_WINDOW];
+  uint8_t retries[RUDP_MAX_WINDOW];
+
+  rudp_stats st;
+  rudp_trace_rec *trace; /* records not yet written, NULL when not tracing */
+  int ntrace;
+
+  // packets queued by the current pump: a header and a payload iovec each,
+  // the payload pointing into map, or into buf when the file isn't mapped
+  int gso; /* cleared if the socket turns out not to support UDP_SEGMENT */
+  int nout;
+  rudp_hdr hdrs[RUDP_BATCH];
+  struct iovec out[2 * RUDP_BATCH];
+  char buf[RUDP_BATCH][RUDP_MAX_SEG];
+} rudp_sender;
+
+typedef struct {
+  uint32_t session;
+  int fd; /* file being written */
+  off_t off; /* where the range being received starts */
+  off_t len;
+  int seg; /* payload bytes per packet */
+  uint32_t npkts;
+  rudp_manifest m; /* empty until the sender's arrives */
+  uint32_t round;
+  int done; /* whole file checked, told the sender */
+  uint8_t *verified; /* chunks whose checksum matched */
+  uint16_t *count; /* packets received per chunk this round */
+  uint8_t *pages; /* manifest pages received, NULL once the manifest is whole */
+  uint32_t pages_left;
+  char *chunk; /* a chunk read back for checking */
+  int statefd; /* persistent copy of verified, -1 if none */
+  char *state_path;
+  rudp_fec_block *fec; /* blocks with parity in, NULL if the sender adds none */
+  char *fec_buf; /* parity rows of every fec block, then room to decode */
+
+  uint32_t cum; /* every packet below cum has been written */
+  uint32_t wnd; /* advertised window, what the socket buffer can queue */
+  uint8_t *have; /* bitmap of received packets */
+
+  rudp_stats st;
+  rudp_trace_rec *trace; /* records not yet written, NULL when not tracing */
+  int ntrace;
+
+  // acks waiting to go out in one sendmmsg
+  int unacked; /* in-order packets since the last ack */
+  uint32_t last_seq, last_ts; /* newest of them */
+  int nacks;
+  rudp_hdr acks[RUDP_BATCH];
+} rudp_receiver;
+
+/* datagrams from one recvmmsg, GRO-coalesced buffers already split */
+typedef struct {
+  int n;
+  char *pkt[RUDP_BATCH * 64];
+  int len[RUDP_BATCH * 64];
+  struct sockaddr_in *from[RUDP_BATCH * 64];
+
+  struct mmsghdr msgs[RUDP_BATCH];
+  struct iovec iov[RUDP_BATCH];
+  struct sockaddr_in addrs[RUDP_BATCH];
+  char ctrl[RUDP_BATCH][CMSG_SPACE(sizeof(int))];
+  char bufs[RUDP_BATCH][RUDP_MAX_DGRAM];
+} rudp_batch;
+
+uint64_t rudp_now_us(void); // monotonic clock in us
+uint32_t rudp_new_session(void); // random nonzero session ID
+int  rudp_is_pkt(char *pkt, int n); // true if pkt is a transfer packet rather than a text command
+uint32_t rudp_pkt_session(char *pkt); // session ID of a packet
+uint32_t rudp_crc32c(uint32_t crc, const void *buf, size_t len); // continue a CRC32C, start with 0
+void rudp_socket_setup(int sockfd); // enable GRO and a large receive buffer
+int  rudp_path_seg(struct sockaddr_in *peer); // segment size that fits the path MTU to peer
+int  rudp_size_file(int fd, off_t len); // set a destination file's length and allocate its blocks
+int  rudp_streams(off_t len); // how many parallel streams a file of len bytes gets
+int  rudp_stream_socket(int *port); // a fresh socket on an ephemeral port for one stream
+void rudp_stats_add(rudp_stats *sum, rudp_stats *st); // add one transfer's counters to sum, which starts zeroed
+void rudp_stats_print(rudp_stats *st, int sending); // summary of a transfer, two lines on stdout
+
+int  rudp_recv_batch(int sockfd, rudp_batch *b, int flags); // fill b with waiting datagrams, -1 if none
+
+int  rudp_sender_init(rudp_sender *s, uint32_t session, int fd, off_t off, off_t len, int seg, int parity); // checksum len bytes of fd from off and prepare to send them with parity packets per block; the file must not shrink until rudp_sender_free
+int  rudp_sender_pump(rudp_sender *s, int sockfd, struct sockaddr_in *peer); // send what the windows and pacing allow, resend lost packets, -1 on give up
+int  rudp_sender_on_ack(rudp_sender *s, char *pkt, int n); // apply an ack or need list, 1 once the receiver has the whole file
+int64_t rudp_sender_timeout(rudp_sender *s); // us until the sender has something to do, -1 if only acks can unblock it
+void rudp_sender_free(rudp_sender *s);
+
+int  rudp_receiver_init(rudp_receiver *r, uint32_t session, int sockfd, int fd, off_t off, off_t len, int seg, char *path); // prepare to receive len bytes into fd at off; path names the state file
+int  rudp_receiver_on_data(rudp_receiver *r, char *pkt, int n, int sockfd, struct sockaddr_in *peer); // handle a manifest or write a packet, 1 once the file is complete and checked
+int  rudp_receiver_flush(rudp_receiver *r, int sockfd, struct sockaddr_in *peer); // send queued acks, call after each batch
+void rudp_receiver_free(rudp_receiver *r);
+
+int  rudp_send_file(int sockfd, struct sockaddr_in *peer, uint32_t session, int fd, off_t off, off_t len, int seg, int parity, rudp_stats *st); // blocking send, -1 on failure; st may be NULL
+int  rudp_recv_file(int sockfd, struct sockaddr_in *peer, uint32_t session, int fd, off_t off, off_t len, int seg, char *path, rudp_stats *st); // blocking receive, a zero peer port is learned from the sender, -1 on failure
+
+int  rudp_send_streams(int *socks, struct sockaddr_in *peers, int k, uint32_t session, int fd, off_t len, int seg, int parity, rudp_stats *st); // blocking send of k ranges in parallel, closes socks; st gets their sum
+int  rudp_recv_streams(int *socks, struct sockaddr_in *peer, int k, uint32_t session, int fd, off_t len, int seg, char *path, rudp_stats *st); // blocking receive of k ranges in parallel, closes socks
+
+#endif
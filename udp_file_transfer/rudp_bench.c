@@ -0,0 +1,311 @@
+/*
+ * rudp_bench.c - loopback benchmark of the rudp transfer engine
+ * usage: rudp_bench [sizes_mb [loss_pct [parity]]]
+ *        rudp_bench trace <file>
+ *
+ * Sends a file of each size, at each loss rate, from one socket to another
+ * through a relay thread that drops that share of the datagrams going
+ * either way, and prints a line of rudp_stats per run. The lists are comma
+ * separated, e.g. "rudp_bench 1,16,128 0,1,5 2". The relay copies every
+ * datagram, so absolute rates are lower than a direct transfer's; compare
+ * runs with each other.
+ *
+ * "trace" prints a file written with RUDP_TRACE set as text, one event per
+ * line, times relative to the earliest event. Each transfer's events are in
+ * order, but transfers write theirs in batches that interleave.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "rudp.h"
+
+#define MAX_RUNS 16
+#define BENCH_BLOCK (1024 * 1024) /* bytes per write and compare */
+
+/* forwards datagrams between the two ends, losing some */
+typedef struct {
+  int sockfd;
+  struct sockaddr_in snd, rcv;
+  double loss;
+  unsigned seed;
+  volatile int stop;
+} relay;
+
+/* one end's half of a run */
+typedef struct {
+  int sockfd;
+  struct sockaddr_in peer;
+  uint32_t session;
+  int fd;
+  off_t len;
+  int seg;
+  rudp_stats st;
+  int ret;
+} bench_end;
+
+void error(char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+static int same_addr(struct sockaddr_in *a, struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+void *relay_thread(void *arg) {
+  relay *rl = arg;
+  rudp_batch *b = malloc(sizeof(rudp_batch));
+  struct mmsghdr msgs[RUDP_BATCH];
+  struct iovec iov[RUDP_BATCH];
+  if (b == NULL) {
+    error("ERROR allocating relay buffers");
+  }
+
+  while (!rl->stop) {
+    struct pollfd pfd = { .fd = rl->sockfd, .events = POLLIN };
+    if (poll(&pfd, 1, 50) <= 0 || rudp_recv_batch(rl->sockfd, b, MSG_DONTWAIT) < 0) {
+      continue;
+    }
+    int m = 0;
+    for (int i = 0; i < b->n; i++) {
+      if ((double) rand_r(&rl->seed) / ((double) RAND_MAX + 1) < rl->loss) {
+        continue;
+      }
+      iov[m].iov_base = b->pkt[i];
+      iov[m].iov_len = b->len[i];
+      bzero(&msgs[m].msg_hdr, sizeof(struct msghdr));
+      msgs[m].msg_hdr.msg_name = same_addr(b->from[i], &rl->snd) ? &rl->rcv : &rl->snd;
+      msgs[m].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[m].msg_hdr.msg_iov = &iov[m];
+      msgs[m].msg_hdr.msg_iovlen = 1;
+      // GRO is off on the relay's socket, so a batch is at most RUDP_BATCH
+      if (++m == RUDP_BATCH) {
+        sendmmsg(rl->sockfd, msgs, m, 0);
+        m = 0;
+      }
+    }
+    if (m > 0) {
+      sendmmsg(rl->sockfd, msgs, m, 0);
+    }
+  }
+  free(b);
+  return NULL;
+}
+
+void *recv_thread(void *arg) {
+  bench_end *e = arg;
+  e->ret = rudp_recv_file(e->sockfd, &e->peer, e->session, e->fd, 0, e->len, e->seg, NULL, &e->st);
+  return NULL;
+}
+
+// a socket on 127.0.0.1 and its address
+int local_socket(struct sockaddr_in *addr, int setup) {
+  socklen_t addrlen = sizeof(*addr);
+  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sockfd < 0) {
+    error("ERROR opening socket");
+  }
+  bzero(addr, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sockfd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+      getsockname(sockfd, (struct sockaddr *) addr, &addrlen) < 0) {
+    error("ERROR on binding");
+  }
+  if (setup) {
+    rudp_socket_setup(sockfd);
+  } else {
+    int rcvbuf = RUDP_RCVBUF;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+  return sockfd;
+}
+
+// an unlinked scratch file of len bytes, random if fill is set
+int scratch_file(off_t len, int fill) {
+  char path[] = "/tmp/rudp_bench.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    error("ERROR creating scratch file");
+  }
+  unlink(path);
+  if (!fill) {
+    if (rudp_size_file(fd, len) == -1) {
+      error("ERROR sizing scratch file");
+    }
+    return fd;
+  }
+
+  uint64_t x = 88172645463325252ULL;
+  uint64_t *block = malloc(BENCH_BLOCK);
+  if (block == NULL) {
+    error("ERROR allocating buffer");
+  }
+  for (off_t off = 0; off < len; off += BENCH_BLOCK) {
+    for (size_t i = 0; i < BENCH_BLOCK / sizeof(uint64_t); i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      block[i] = x;
+    }
+    size_t n = len - off < BENCH_BLOCK ? len - off : BENCH_BLOCK;
+    if (pwrite(fd, block, n, off) != (ssize_t) n) {
+      error("ERROR writing scratch file");
+    }
+  }
+  free(block);
+  return fd;
+}
+
+// true if the first len bytes of both files match
+int same_data(int a, int b, off_t len) {
+  char *x = malloc(BENCH_BLOCK), *y = malloc(BENCH_BLOCK);
+  int same = x != NULL && y != NULL;
+  for (off_t off = 0; same && off < len; off += BENCH_BLOCK) {
+    size_t n = len - off < BENCH_BLOCK ? len - off : BENCH_BLOCK;
+    same = pread(a, x, n, off) == (ssize_t) n && pread(b, y, n, off) == (ssize_t) n && memcmp(x, y, n) == 0;
+  }
+  free(x);
+  free(y);
+  return same;
+}
+
+// one transfer of len bytes of src through a relay losing loss of its
+// datagrams; prints the run's line
+void bench_run(int src, off_t len, double loss, int parity) {
+  relay rl;
+  bench_end snd, rcv;
+  struct sockaddr_in relay_addr;
+  pthread_t relay_tid, recv_tid;
+
+  bzero(&rl, sizeof(rl));
+  bzero(&snd, sizeof(snd));
+  bzero(&rcv, sizeof(rcv));
+  rl.sockfd = local_socket(&relay_addr, 0);
+  rl.loss = loss;
+  rl.seed = 1;
+  snd.sockfd = local_socket(&rl.snd, 1);
+  rcv.sockfd = local_socket(&rl.rcv, 1);
+  snd.peer = rcv.peer = relay_addr;
+  snd.session = rcv.session = rudp_new_session();
+  snd.seg = rcv.seg = rudp_path_seg(&relay_addr);
+  snd.len = rcv.len = len;
+  snd.fd = src;
+  rcv.fd = scratch_file(len, 0);
+
+  if (pthread_create(&relay_tid, NULL, relay_thread, &rl) != 0 ||
+      pthread_create(&recv_tid, NULL, recv_thread, &rcv) != 0) {
+    error("ERROR starting threads");
+  }
+  snd.ret = rudp_send_file(snd.sockfd, &snd.peer, snd.session, snd.fd, 0, len, snd.seg, parity, &snd.st);
+  pthread_join(recv_tid, NULL);
+  rl.stop = 1;
+  pthread_join(relay_tid, NULL);
+
+  rudp_stats *st = &snd.st;
+  double secs = (st->end_us - st->start_us) / 1e6;
+  printf("%8.1f %6.2f %6d", len / 1e6, 100 * loss, parity);
+  if (snd.ret == -1 || rcv.ret == -1) {
+    printf("   failed\n");
+  } else {
+    printf(" %8.3f %9.1f %7.2f%% %8llu %8llu %8llu %8llu %s\n", secs, secs > 0 ? len / secs / 1e6 : 0,
+      st->pkts > 0 ? 100.0 * st->resent / st->pkts : 0.0, (unsigned long long) st->timeouts,
+      (unsigned long long) (st->rtt_n > 0 ? st->rtt_sum / st->rtt_n : 0),
+      (unsigned long long) rcv.st.rebuilt, (unsigned long long) rcv.st.resent,
+      same_data(src, rcv.fd, len) ? "ok" : "CORRUPT");
+  }
+  fflush(stdout);
+  close(rcv.fd);
+  close(rl.sockfd);
+  close(snd.sockfd);
+  close(rcv.sockfd);
+}
+
+// parse a comma separated list of numbers, at most MAX_RUNS
+int parse_list(char *s, double *v) {
+  int n = 0;
+  for (char *tok = strtok(s, ","); tok != NULL && n < MAX_RUNS; tok = strtok(NULL, ",")) {
+    v[n++] = atof(tok);
+  }
+  return n;
+}
+
+int print_trace(char *path) {
+  static const char *names[] = { "?", "send", "resend", "parity", "ack", "loss", "rto", "round",
+    "recv", "dup", "rebuilt", "badchunk", "done" };
+  rudp_trace_rec t;
+  uint64_t t0 = 0;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    error("ERROR opening trace file");
+  }
+  while (fread(&t, sizeof(t), 1, f) == 1) {
+    if (t0 == 0 || t.t_us < t0) {
+      t0 = t.t_us;
+    }
+  }
+  rewind(f);
+  printf("%12s %10s %-8s %5s %10s %8s %8s %8s\n", "us", "session", "event", "round", "seq",
+    "inflight", "rtt", "cwnd");
+  while (fread(&t, sizeof(t), 1, f) == 1) {
+    printf("%12llu %10u %-8s %5u %10u %8u %8u %8.1f\n", (unsigned long long) (t.t_us - t0), t.session,
+      t.event <= RUDP_EV_DONE ? names[t.event] : "?", t.round, t.seq, t.inflight, t.rtt_us, t.cwnd);
+  }
+  fclose(f);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char sizes_arg[256] = "1,16,64", loss_arg[256] = "0,0.5,2,5";
+  double sizes[MAX_RUNS], losses[MAX_RUNS];
+  int parity = 0;
+
+  if (argc == 3 && strcmp(argv[1], "trace") == 0) {
+    return print_trace(argv[2]);
+  }
+  if (argc > 4) {
+    fprintf(stderr, "usage: %s [sizes_mb [loss_pct [parity]]]\n       %s trace <file>\n", argv[0], argv[0]);
+    exit(1);
+  }
+  if (argc > 1) {
+    snprintf(sizes_arg, sizeof(sizes_arg), "%s", argv[1]);
+  }
+  if (argc > 2) {
+    snprintf(loss_arg, sizeof(loss_arg), "%s", argv[2]);
+  }
+  if (argc > 3) {
+    parity = atoi(argv[3]);
+  }
+  if (parity < 0 || parity > RUDP_FEC_MAX) {
+    fprintf(stderr, "parity must be 0 to %d\n", RUDP_FEC_MAX);
+    exit(1);
+  }
+  int nsizes = parse_list(sizes_arg, sizes);
+  int nlosses = parse_list(loss_arg, losses);
+
+  // one source file, each run sends a prefix of it
+  off_t max = 0;
+  for (int i = 0; i < nsizes; i++) {
+    if (sizes[i] * 1e6 > max) {
+      max = sizes[i] * 1e6;
+    }
+  }
+  int src = scratch_file(max, 1);
+
+  printf("%8s %6s %6s %8s %9s %8s %8s %8s %8s %8s\n", "MB", "loss%", "parity", "secs", "MB/s",
+    "resent", "rtos", "rtt_us", "rebuilt", "dups");
+  for (int i = 0; i < nsizes; i++) {
+    for (int j = 0; j < nlosses; j++) {
+      bench_run(src, sizes[i] * 1e6, losses[j] / 100, parity);
+    }
+  }
+  close(src);
+  return 0;
+}
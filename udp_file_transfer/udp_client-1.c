@@ -1,7 +1,8 @@
 /* 
  * udpclient.c - A simple UDP client
- * usage: udpclient <host> <port>
+ * usage: udpclient <host> <port> [parity]
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,8 +11,16 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h> 
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+
+#include "rudp.h"
+#include "ls.h"
 
 #define BUFSIZE 1024
+#define LS_WAIT_MS 500 /* most to wait before asking for listing pages again */
+#define LS_TRIES 10
 
 int get_func(char *buf, int n, int *sockfd, struct  
   sockaddr_in *serveraddr, int *serverlen);
@@ -20,6 +29,17 @@ int delete_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *ser
 int ls_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen);
 int exit_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen);
 int send_msg(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen);
+int recv_reply(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen);
+int recv_reply_wait(char *buf, int size, int *sockfd, struct sockaddr_in *serveraddr, int ms);
+
+int parity; /* parity packets per block on files we put, 0 for none */
+
+// the last full listing, shown again while the server says it is current
+struct {
+  uint64_t version;
+  char *blob;
+  size_t len;
+} listing;
 
 
 /* 
@@ -39,17 +59,23 @@ int main(int argc, char **argv) {
     char buf[BUFSIZE];
 
     /* check command line arguments */
-    if (argc != 3) {
-       fprintf(stderr,"usage: %s <hostname> <port>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+       fprintf(stderr,"usage: %s <hostname> <port> [parity]\n", argv[0]);
        exit(0);
     }
     hostname = argv[1];
     portno = atoi(argv[2]);
+    parity = argc == 4 ? atoi(argv[3]) : 0;
+    if (parity < 0 || parity > RUDP_FEC_MAX) {
+       fprintf(stderr,"parity must be 0 to %d packets per %d\n", RUDP_FEC_MAX, RUDP_FEC_K);
+       exit(0);
+    }
 
     /* socket: create the socket */
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) 
         error("ERROR opening socket");
+    rudp_socket_setup(sockfd);
 
     /* gethostbyname: get the server's DNS entry */
     server = gethostbyname(hostname);
@@ -107,10 +133,7 @@ int main(int argc, char **argv) {
         }
       }
       else if(strncmp(buf, "ls", 2) == 0) {
-        if(send_msg((char*)&buf, &sockfd, &serveraddr, &serverlen) == -1) {
-          printf("Failed to send message\n");
-        }
-
+        // ls_func asks for the pages itself
         if (ls_func((char*)&buf, &sockfd, &serveraddr, &serverlen) == -1) {
           printf("ls Failed\n");
         }
@@ -153,14 +176,9 @@ int get_func(char *buf, int n, int *sockfd, struct
   // move pointer back to beginning
   buf -= 4;
 
-  // recv either failed msg or file length
-  bzero(buf, BUFSIZE);
-  n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-    (struct sockaddr *) serveraddr, &(*serverlen));
-  if (n < 0) {
-    error("ERROR in recvfrom");
-    return -1;
-  }  
+  // recv either failed msg or file length, session ID, segment size and
+  // stream count
+  n = recv_reply(buf, sockfd, serveraddr, serverlen);
 
   // if fail message received from client, return -1 without writing
   if(strncmp(buf, "Get Failed", 10) == 0) {
@@ -168,55 +186,58 @@ int get_func(char *buf, int n, int *sockfd, struct
   }
   char *remaining;
   long len = strtol(buf, &remaining, 10);
+  uint32_t id = strtoul(remaining, &remaining, 10);
+  long seg = strtol(remaining, &remaining, 10);
+  long k = strtol(remaining, NULL, 10);
   printf("%ld\n", len);
+  if (k == 0) {
+    k = 1;
+  }
+  if (seg <= 0 || seg > RUDP_MAX_SEG || k < 1 || k > RUDP_MAX_STREAMS) {
+    return -1;
+  }
 
   // open file using filename
-  FILE *fp;
-  fp = fopen(fn, "w");
+  int fd;
+  fd = open(fn, O_RDWR | O_CREAT, 0644); // kept, an earlier get may be resumed
 
-  if(fp == NULL) {
+  if(fd < 0 || rudp_size_file(fd, len) == -1) {
     printf("File could not be opened\n");
     return -1;
   }
 
-  long total = 0;
-
-  while(total < len) {
-    // recv data from client
-    bzero(buf, BUFSIZE);
-    n = 0;
-    n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-      (struct sockaddr *) serveraddr, &(*serverlen));
-    if (n < 0) {
-      error("ERROR in recvfrom");
+  // packets may arrive out of order, the receiver writes each at its offset
+  rudp_stats st;
+  if (k == 1) {
+    n = rudp_recv_file(*sockfd, serveraddr, id, fd, 0, len, seg, fn, &st);
+    close(fd);
+    if (n == -1) {
       return -1;
     }
-    printf("Bytes Recv: %d\n", n);
-
-    total += n;
+    rudp_stats_print(&st, 0);
+    return 1;
+  }
 
-    // write to the file
-    int bytes_written = fwrite(buf, 1, n, fp);
-    if(bytes_written == -1) {
-      printf("Writing to file failed\n");
-      return -1;
+  // a large file comes in over k sockets at once; tell the server where
+  int socks[RUDP_MAX_STREAMS];
+  int m = sprintf(buf, "streams %u", id);
+  for (int i = 0; i < k; i++) {
+    int port;
+    if ((socks[i] = rudp_stream_socket(&port)) < 0) {
+      error("ERROR opening socket");
     }
+    m += sprintf(buf + m, " %d", port);
+  }
+  if (sendto(*sockfd, buf, m, 0, (struct sockaddr *) serveraddr, *serverlen) < 0) {
+    error("ERROR in sendto");
+  }
+  n = rudp_recv_streams(socks, serveraddr, k, id, fd, len, seg, fn, &st);
 
-    printf("Bytes Written: %d\n", bytes_written);
-    printf("%ld\n", total);
-
-    // send ack to server
-    bzero(buf, BUFSIZE);
-    sprintf(buf, "%d", n);
-    n = sendto(*sockfd, buf, strlen(buf), 0, 
-      (struct sockaddr *) &(*serveraddr), *serverlen);
-    if (n < 0) {
-      error("ERROR in sendto");
-      return -1;
-    }
+  close(fd);
+  if (n == -1) {
+    return -1;
   }
-    
-  fclose(fp);
+  rudp_stats_print(&st, 0);
   return 1;
 }
 
@@ -231,23 +252,25 @@ int put_func(char *buf, int n, int *sockfd, struct sockaddr_in *serveraddr, int
   buf -= 4;
 
   // open file
-  FILE *fp;
-  fp = fopen(fn, "r");
+  int fd;
+  fd = open(fn, O_RDONLY);
 
-  if(fp == NULL) {
+  if(fd < 0) {
     printf("File could not be opened\n");
     return -1;
   }
 
   // get size of file
   long len;
-  fseek(fp, 0L, SEEK_END);
-  len = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
+  len = lseek(fd, 0L, SEEK_END);
 
-  // send length of file to client
+  // send length of file, the transfer's session ID, segment size and
+  // stream count to server
+  uint32_t id = rudp_new_session();
+  int seg = rudp_path_seg(serveraddr);
+  int k = rudp_streams(len);
   bzero(buf, BUFSIZE);
-  sprintf(buf, "%ld", len);
+  sprintf(buf, "len %ld %u %d %d", len, id, seg, k);
   n = sendto(*sockfd, buf, strlen(buf), 0, 
     (struct sockaddr *) serveraddr, *serverlen);
   if (n < 0) {
@@ -257,69 +280,49 @@ int put_func(char *buf, int n, int *sockfd, struct sockaddr_in *serveraddr, int
 
   printf("File size: %ld\n", len);
 
-  long total = 0;
-
-  while(total < len) {
-    // read from file into buffer
-    bzero(buf, BUFSIZE);
-    int bytes_read;
-    int bytes_to_read = BUFSIZE;
-
-    // if there is a partial packet, use the size of the partial packet
-    if(len - total < BUFSIZE) {
-      bytes_to_read = len - total;
-    }
-
-    // read from file
-    bytes_read = fread(buf, 1, bytes_to_read, fp);
-    if (bytes_read == -1) {
-      printf("Reading from file failed\n");
-      fclose(fp);
-      return -1;
-    }
-
-    /* 
-    * sendto: send file data to the client 
-    */
-    n = sendto(*sockfd, buf, bytes_read, 0, 
-          (struct sockaddr *) serveraddr, *serverlen);
-    if (n < 0) {
-      error("ERROR in sendto");
-      fclose(fp);
+  // stream the file with the windowed protocol
+  rudp_stats st;
+  if (k == 1) {
+    n = rudp_send_file(*sockfd, serveraddr, id, fd, 0, len, seg, parity, &st);
+    close(fd);
+    if (n == -1) {
       return -1;
     }
+    rudp_stats_print(&st, 1);
+    return 1;
+  }
 
-    // update total bytes sent
-    total += n;
-    printf("Bytes sent: %d\n", n);
-
-    //if bytes sent is less than bytes read, seek back and reread them
-    if(n < bytes_read) {
-      fseek(fp, total, SEEK_SET);
-    }
-
-    // recv ack from client
-    bzero(buf, BUFSIZE);
-    n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-      (struct sockaddr *) (&(*serveraddr)), &(*serverlen));
-    if (n < 0) {
-      error("ERROR in recvfrom");
-      return -1;
+  // a large file goes out over k sockets at once, to the ports the server
+  // opened for it
+  int socks[RUDP_MAX_STREAMS];
+  struct sockaddr_in peers[RUDP_MAX_STREAMS];
+  n = recv_reply(buf, sockfd, serveraddr, serverlen);
+  if (strncmp(buf, "streams ", 8) != 0 || strtoul(buf + 8, &buf, 10) != id) {
+    close(fd);
+    return -1;
+  }
+  for (int i = 0; i < k; i++) {
+    int port;
+    peers[i] = *serveraddr;
+    peers[i].sin_port = htons(strtol(buf, &buf, 10));
+    if ((socks[i] = rudp_stream_socket(&port)) < 0) {
+      error("ERROR opening socket");
     }
+  }
+  n = rudp_send_streams(socks, peers, k, id, fd, len, seg, parity, &st);
 
+  close(fd);
+  if (n == -1) {
+    return -1;
   }
-  printf("%ld\n", total);
-    
-  fclose(fp);
+  rudp_stats_print(&st, 1);
   return 1;
 }
 
 int delete_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen) {
-  int n = 0;
-  bzero(buf, BUFSIZE);
-  n = recvfrom(*sockfd, buf, BUFSIZE, 0, (struct sockaddr *) (&(*serveraddr)), &(*serverlen));
-  if (n < 0) 
-    error("ERROR in recvfrom");
+  if (recv_reply(buf, sockfd, serveraddr, serverlen) <= 0) {
+    return -1;
+  }
 
   // if recv success msg -> print success msg
   if(strncmp(buf, "Delete successful", 17) == 0) {
@@ -334,26 +337,108 @@ int delete_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *ser
 }
 
 int ls_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen) {
-  int n = 0;
-  bzero(buf, BUFSIZE);
-  // recv and print
-  n = recvfrom(*sockfd, buf, BUFSIZE, 0, (struct sockaddr *) (&(*serveraddr)), &(*serverlen));
-  if (n < 0) 
-    error("ERROR in recvfrom");
-  else {
-    printf("%s", buf);
+  char page[LS_PAGE + 1];
+  char *blob = NULL;
+  size_t len = 0;
+  uint64_t version = 0; // of the listing being fetched
+  uint32_t next = 0, total = 0;
+  int tries = 0, ask = 1;
+  uint64_t asked_at = 0;
+  int wait_ms = LS_WAIT_MS; // a few round trips once one has been seen
+
+  while (1) {
+    // ask for the entries from next on; the cached version only matters
+    // for a listing from the top
+    if (ask) {
+      sprintf(buf, "ls %llu %u", (unsigned long long) (next == 0 ? listing.version : 0), next);
+      send_msg(buf, sockfd, serveraddr, serverlen);
+      asked_at = rudp_now_us();
+      ask = 0;
+    }
+    int n = recv_reply_wait(page, sizeof(page), sockfd, serveraddr, wait_ms);
+    if (n >= 0 && asked_at != 0) {
+      int rtt_ms = (rudp_now_us() - asked_at) / 1000;
+      wait_ms = 4 * rtt_ms + 10 < LS_WAIT_MS ? 4 * rtt_ms + 10 : LS_WAIT_MS;
+      asked_at = 0;
+    }
+    if (n < 0) {
+      if (++tries == LS_TRIES) {
+        free(blob);
+        return -1;
+      }
+      ask = 1;
+      continue;
+    }
+    ls_hdr *h = (ls_hdr *) page;
+    if (n < (int) sizeof(*h) || memcmp(h->magic, LS_MAGIC, sizeof(h->magic)) != 0) {
+      continue; // a late reply to something else
+    }
+    uint16_t flags = ntohs(h->flags);
+    if (flags & LS_UNCHANGED) {
+      if (be64toh(h->version) != listing.version) {
+        continue;
+      }
+      free(blob);
+      break;
+    }
+
+    // a page from a newer listing: the directory changed, start over
+    if (next > 0 && be64toh(h->version) != version) {
+      next = 0;
+      len = 0;
+    }
+    if (next == 0) {
+      version = be64toh(h->version);
+      total = ntohl(h->total);
+    }
+
+    // take the page if it is the next one, after checking its entries
+    // really are inside it
+    if (ntohl(h->from) == next) {
+      size_t at = sizeof(*h);
+      int count = ntohs(h->count);
+      for (int i = 0; i < count && at + sizeof(ls_entry) <= (size_t) n; i++) {
+        at += sizeof(ls_entry) + ((ls_entry *) (page + at))->namelen;
+      }
+      char *grown = at <= (size_t) n ? realloc(blob, len + at - sizeof(*h)) : NULL;
+      if (grown != NULL) {
+        blob = grown;
+        memcpy(blob + len, page + sizeof(*h), at - sizeof(*h));
+        len += at - sizeof(*h);
+        next += count;
+        tries = 0;
+      }
+    }
+    if (next >= total) {
+      free(listing.blob);
+      listing.blob = blob;
+      listing.len = len;
+      listing.version = version;
+      break;
+    }
+    // a lost page shows as one skipped; either way ask again after the burst
+    if (flags & LS_LAST) {
+      ask = 1;
+    }
   }
 
-  // printf("%d\n", n);
+  for (size_t at = 0; at < listing.len; ) {
+    ls_entry *e = (ls_entry *) (listing.blob + at);
+    time_t t = be64toh(e->mtime);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("%c %12llu %s %.*s\n", e->type, (unsigned long long) be64toh(e->size), when,
+      e->namelen, (char *) (e + 1));
+    at += sizeof(*e) + e->namelen;
+  }
+  return 0;
 }
 
 int exit_func(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen) {
-  int n = 0;
-  bzero(buf, BUFSIZE);
   // recv data from server
-  n = recvfrom(*sockfd, buf, BUFSIZE, 0, (struct sockaddr *) (&(*serveraddr)), &(*serverlen));
-  if (n < 0) 
-    error("ERROR in recvfrom");
+  if (recv_reply(buf, sockfd, serveraddr, serverlen) <= 0) {
+    return -1;
+  }
 
   // if recvd goodbye from server -> print goodbye and exit
   if(strncmp(buf, "Goodbye!", 8) == 0) {
@@ -372,4 +457,43 @@ int send_msg(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *server
     n = sendto(*sockfd, buf, strlen(buf), 0, (struct sockaddr *) (&(*serveraddr)), *serverlen);
     if (n < 0) 
       error("ERROR in sendto");
-}
\ No newline at end of file
+}
+
+// wrapper function for receiving the server's reply to a command, skipping
+// packets left over from an earlier transfer (GRO may have glued the reply
+// to them, so go through the batch receive that splits them apart)
+int recv_reply(char *buf, int *sockfd, struct sockaddr_in *serveraddr, int *serverlen) {
+    int n;
+    do { // a listing page turning up late is no reply to anything else
+      n = recv_reply_wait(buf, BUFSIZE, sockfd, serveraddr, -1);
+    } while (n >= 4 && memcmp(buf, LS_MAGIC, 4) == 0);
+    return n;
+}
+
+// the same into a buffer of size bytes, giving up after ms milliseconds
+// (-1 to wait for good); replies batched up behind the one returned are
+// kept for the next call
+int recv_reply_wait(char *buf, int size, int *sockfd, struct sockaddr_in *serveraddr, int ms) {
+    static rudp_batch *b;
+    static int next;
+    if (b == NULL && (b = calloc(1, sizeof(rudp_batch))) == NULL)
+      error("ERROR allocating receive batch");
+
+    while (1) {
+      for (; next < b->n; next++) {
+        if (!rudp_is_pkt(b->pkt[next], b->len[next])) {
+          int n = b->len[next] < size - 1 ? b->len[next] : size - 1;
+          bzero(buf, size);
+          memcpy(buf, b->pkt[next], n);
+          *serveraddr = *b->from[next++];
+          return n;
+        }
+      }
+      struct pollfd pfd = { .fd = *sockfd, .events = POLLIN };
+      if (ms >= 0 && poll(&pfd, 1, ms) == 0)
+        return -1;
+      next = 0;
+      if (rudp_recv_batch(*sockfd, b, MSG_WAITFORONE) < 0) 
+        error("ERROR in recvmmsg");
+    }
+}
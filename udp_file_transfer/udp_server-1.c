@@ -1,8 +1,9 @@
 /* 
  * udpserver.c - A simple UDP echo server 
- * usage: udpserver <port>
+ * usage: udpserver <port> [parity]
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -13,13 +14,101 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <dirent.h> 
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rudp.h"
+#include "ls.h"
 
 #define BUFSIZE 1024
+#define SESSION_BUCKETS 256
+
+/*
+ * A transfer in progress. Sessions are keyed by client address and session
+ * ID, so one client can run several and many clients can share the socket.
+ * A put waits for the client's length message with ID 0 before it has one;
+ * a large get waits for the client's stream ports before handing the file
+ * to a thread of its own.
+ */
+enum { SESS_SEND, SESS_AWAIT_LEN, SESS_RECV, SESS_AWAIT_STREAMS };
+
+typedef struct session {
+  struct sockaddr_in addr;
+  uint32_t id;
+  int state;
+  int fd;
+  rudp_sender *snd;
+  rudp_receiver rcv;
+  char fn[100]; /* file being transferred */
+  off_t len; /* SESS_AWAIT_STREAMS: what to send once the ports are known */
+  int seg;
+  int k;
+  int done; /* receiver has the whole file, lingering to re-ack */
+  uint64_t last_us; /* last packet from the client */
+  struct session *next;
+} session;
+
+session *sessions[SESSION_BUCKETS];
+int parity; /* parity packets per block on files we send, 0 for none */
+
+/*
+ * Files being sent, by inode. A get reads its file through a shared
+ * mapping, checksums and parity included, so a put that truncated the file
+ * under it would kill the server with SIGBUS; such puts are refused until
+ * the get is over. Stream threads release theirs, hence the lock.
+ */
+typedef struct sending_file {
+  dev_t dev;
+  ino_t ino;
+  int refs;
+  struct sending_file *next;
+} sending_file;
+
+sending_file *sending;
+pthread_mutex_t sending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int sending_hold(int fd);
+void sending_release(int fd);
+int sending_busy(int fd);
 
+/*
+ * The directory listing, encoded once in the ls.h format and kept until the
+ * directory's mtime moves or one of our own transfers writes a file (a
+ * file's size or contents changing leaves the directory alone).
+ */
+struct {
+  char *blob; /* entries back to back */
+  uint32_t *at; /* where each entry starts in blob, plus the end */
+  uint32_t n;
+  struct timespec mtime; /* of the directory when it was listed */
+  unsigned gen;
+  int racy; /* listed within the mtime's granularity of a change, recheck */
+  uint64_t version;
+} listing;
+unsigned files_gen; /* bumped whenever we write or remove a file */
+
+void files_changed(void);
+int listing_update(void);
+
+session *session_find(struct sockaddr_in *addr, uint32_t id);
+session *session_add(struct sockaddr_in *addr, uint32_t id, int state, int fd);
+void session_free(session *sess);
+int session_packet(session *sess, char *buf, int n, int sockfd);
+int64_t session_service(session *sess, int sockfd, uint64_t now);
+
+void handle_cmd(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
+  int *clientlen);
 int get_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   int *clientlen);
 int put_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   int *clientlen);
+int len_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr);
+int streams_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr);
+int start_streams(int sending, int *socks, struct sockaddr_in *peers, int k, uint32_t id,
+  int fd, off_t len, int seg, char *fn);
 int del_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   int *clientlen);
 int ls_func(char *buf, int *sockfd, struct sockaddr_in *clientaddr,
@@ -41,20 +130,23 @@ int main(int argc, char **argv) {
   int clientlen; /* byte size of client's address */
   struct sockaddr_in serveraddr; /* server's addr */
   struct sockaddr_in clientaddr; /* client addr */
-  struct hostent *hostp; /* client host info */
   char buf[BUFSIZE]; /* message buf */
-  char *hostaddrp; /* dotted decimal host addr string */
   int optval; /* flag value for setsockopt */
   int n; /* message byte size */
 
   /* 
    * check command line arguments 
    */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s <port> [parity]\n", argv[0]);
     exit(1);
   }
   portno = atoi(argv[1]);
+  parity = argc == 3 ? atoi(argv[2]) : 0;
+  if (parity < 0 || parity > RUDP_FEC_MAX) {
+    fprintf(stderr, "parity must be 0 to %d packets per %d\n", RUDP_FEC_MAX, RUDP_FEC_K);
+    exit(1);
+  }
 
   /* 
    * socket: create the parent socket 
@@ -86,75 +178,110 @@ int main(int argc, char **argv) {
   if (bind(sockfd, (struct sockaddr *) &serveraddr, 
 	   sizeof(serveraddr)) < 0) 
     error("ERROR on binding");
+  rudp_socket_setup(sockfd);
+  rudp_batch *batch = malloc(sizeof(rudp_batch));
+  if (batch == NULL)
+    error("ERROR allocating receive batch");
 
   /* 
-   * main loop: wait for a datagram, then echo it
+   * main loop: drain the socket, dispatching transfer packets to their
+   * session and commands to the handlers, then give every session a turn
+   * and sleep until the nearest retransmission, pacing or idle deadline
    */
   clientlen = sizeof(clientaddr);
   while (1) {
+    uint64_t now = rudp_now_us();
+    int64_t timeout = -1;
+    for (int i = 0; i < SESSION_BUCKETS; i++) {
+      session *sess = sessions[i];
+      while (sess != NULL) {
+        session *next = sess->next;
+        int64_t t = session_service(sess, sockfd, now);
+        if (t == -2) {
+          session_free(sess);
+        } else if (t >= 0 && (timeout == -1 || t < timeout)) {
+          timeout = t;
+        }
+        sess = next;
+      }
+    }
+
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    struct timespec ts = { timeout / 1000000, (timeout % 1000000) * 1000 };
+    if (ppoll(&pfd, 1, timeout < 0 ? NULL : &ts, NULL) <= 0) {
+      continue;
+    }
 
     /*
-     * recvfrom: receive a UDP datagram from a client
+     * recvmmsg: receive every waiting datagram from the clients
      */
-    bzero(buf, BUFSIZE);
-    n = recvfrom(sockfd, buf, BUFSIZE, 0,
-		 (struct sockaddr *) &clientaddr, &clientlen);
-    if (n < 0)
-      error("ERROR in recvfrom");
-
-    // Handle keywords
-    if(strncmp(buf, "get ", 4) == 0) {
-      if (get_func(&buf[4], n - 4 - 1, &sockfd, &clientaddr, &clientlen) == -1) {
-        perror("\nError:");
-        printf("get failed\n");
+    while (rudp_recv_batch(sockfd, batch, MSG_DONTWAIT) > 0) {
+      for (int i = 0; i < batch->n; i++) {
+        char *pkt = batch->pkt[i];
+        n = batch->len[i];
+        clientaddr = *batch->from[i];
+        if (rudp_is_pkt(pkt, n)) {
+          session *sess = session_find(&clientaddr, rudp_pkt_session(pkt));
+          if (sess != NULL && session_packet(sess, pkt, n, sockfd) == -1) {
+            printf("transfer failed\n");
+            session_free(sess);
+          }
+        } else {
+          if (n >= BUFSIZE) {
+            n = BUFSIZE - 1;
+          }
+          memcpy(buf, pkt, n);
+          buf[n] = '\0';
+          handle_cmd(buf, n, &sockfd, &clientaddr, &clientlen);
+        }
       }
     }
-    else if(strncmp(buf, "put ", 4) == 0) {
-      if (put_func(&buf[4], n - 4 - 1, &sockfd, &clientaddr, &clientlen) == -1) {
-        perror("\nError:");
-        printf("put failed\n");
-      }
+  }
+}
+
+void handle_cmd(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
+  int *clientlen) {
+  // no reverse lookup: it would stall every transfer on the event loop
+  printf("server received datagram from %s\n", inet_ntoa(clientaddr->sin_addr));
+
+  // Handle keywords
+  if(strncmp(buf, "get ", 4) == 0) {
+    if (get_func(&buf[4], n - 4 - 1, sockfd, clientaddr, clientlen) == -1) {
+      perror("\nError:");
+      printf("get failed\n");
     }
-    else if(strncmp(buf, "delete ", 7) == 0) {
-      if (del_func(&buf[7], n - 7 - 1, &sockfd, &clientaddr, &clientlen) == -1) {
-        perror("\nError:");
-        printf("delete failed\n");
-      }
+  }
+  else if(strncmp(buf, "put ", 4) == 0) {
+    if (put_func(&buf[4], n - 4 - 1, sockfd, clientaddr, clientlen) == -1) {
+      perror("\nError:");
+      printf("put failed\n");
     }
-    else if(strncmp(buf, "ls", 2) == 0) {
-      if (ls_func((char*)&buf, &sockfd, &clientaddr, &clientlen) == -1) {
-        printf("ls failed\n");
-      }
+  }
+  else if(strncmp(buf, "streams ", 8) == 0) {
+    if (streams_func(&buf[8], n - 8, sockfd, clientaddr) == -1) {
+      printf("get failed\n");
     }
-    else if(strncmp(buf, "exit", 4) == 0) {
-      if (exit_func(&sockfd, &clientaddr, &clientlen) == -1) {
-        printf("exit failed\n");
-      }
+  }
+  else if(strncmp(buf, "len ", 4) == 0) {
+    if (len_func(&buf[4], n - 4, sockfd, clientaddr) == -1) {
+      printf("put failed\n");
+    }
+  }
+  else if(strncmp(buf, "delete ", 7) == 0) {
+    if (del_func(&buf[7], n - 7 - 1, sockfd, clientaddr, clientlen) == -1) {
+      perror("\nError:");
+      printf("delete failed\n");
+    }
+  }
+  else if(strncmp(buf, "ls", 2) == 0) {
+    if (ls_func(buf, sockfd, clientaddr, clientlen) == -1) {
+      printf("ls failed\n");
+    }
+  }
+  else if(strncmp(buf, "exit", 4) == 0) {
+    if (exit_func(sockfd, clientaddr, clientlen) == -1) {
+      printf("exit failed\n");
     }
-
-
-
-    /* 
-     * gethostbyaddr: determine who sent the datagram
-     */
-    hostp = gethostbyaddr((const char *)&clientaddr.sin_addr.s_addr, 
-			  sizeof(clientaddr.sin_addr.s_addr), AF_INET);
-    if (hostp == NULL)
-      error("ERROR on gethostbyaddr");
-    hostaddrp = inet_ntoa(clientaddr.sin_addr);
-    if (hostaddrp == NULL)
-      error("ERROR on inet_ntoa\n");
-    printf("server received datagram from %s (%s)\n", 
-	   hostp->h_name, hostaddrp);
-    // printf("server received %ld/%d bytes: %s\n", strlen(buf), n, buf);
-    
-    /* 
-     * sendto: echo the input back to the client 
-     */
-    // n = sendto(sockfd, buf, strlen(buf), 0, 
-	  //      (struct sockaddr *) &clientaddr, clientlen);
-    // if (n < 0) 
-    //   error("ERROR in sendto");
   }
 }
 
@@ -168,11 +295,11 @@ int get_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   // move pointer back to beginning
   buf -= 4;
 
-  FILE *fp;
-  fp = fopen(fn, "r");
+  int fd;
+  fd = open(fn, O_RDONLY);
 
   // try to open file - if failed, send failed msg
-  if(fp == NULL) {
+  if(fd < 0) {
     printf("File could not be opened\n");
     char *msg = "Get Failed";
     n = sendto(*sockfd, msg, strlen(msg), 0, 
@@ -185,13 +312,15 @@ int get_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
 
   // get size of file
   long len;
-  fseek(fp, 0L, SEEK_END);
-  len = ftell(fp);
-  fseek(fp, 0L, SEEK_SET);
+  len = lseek(fd, 0L, SEEK_END);
 
-  // send length of file to client
+  // send length of file, the transfer's session ID, segment size and
+  // stream count to client
+  uint32_t id = rudp_new_session();
+  int seg = rudp_path_seg(clientaddr);
+  int k = rudp_streams(len);
   bzero(buf, BUFSIZE);
-  sprintf(buf, "%ld", len);
+  sprintf(buf, "%ld %u %d %d", len, id, seg, k);
   n = sendto(*sockfd, buf, strlen(buf), 0, 
     (struct sockaddr *) clientaddr, *clientlen);
   if (n < 0) {
@@ -200,59 +329,27 @@ int get_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   }
   printf("File size: %ld\n", len);
 
-  long total = 0;
-
-  while(total < len) {
-    // read from file into buffer
-    bzero(buf, BUFSIZE);
-    int bytes_read;
-    int bytes_to_read = BUFSIZE;
-
-    // if there is a partial packet, use the size of the partial packet
-    if(len - total < BUFSIZE) {
-      bytes_to_read = len - total;
-    }
-
-    // read from file
-    bytes_read = fread(buf, 1, bytes_to_read, fp);
-    if (bytes_read == -1) {
-      printf("Reading from file failed\n");
-      fclose(fp);
-      return -1;
-    }
-
-    /* 
-    * sendto: send file data to the client 
-    */
-    n = sendto(*sockfd, buf, bytes_read, 0, 
-          (struct sockaddr *) clientaddr, *clientlen);
-    if (n < 0) {
-      error("ERROR in sendto");
-      fclose(fp);
+  // large files wait for the client's stream ports, see streams_func
+  if (k > 1) {
+    session *sess = session_add(clientaddr, id, SESS_AWAIT_STREAMS, fd);
+    if (sess == NULL) {
       return -1;
     }
+    strcpy(sess->fn, fn);
+    sess->len = len;
+    sess->seg = seg;
+    sess->k = k;
+    return 1;
+  }
 
-    total += n;
-    printf("Bytes sent: %d\n", n);
-
-    //if bytes sent is less than bytes read, seek back and reread them
-    if(n < bytes_read) {
-      fseek(fp, total, SEEK_SET);
-    }
-
-    // recv ack from client
-    bzero(buf, BUFSIZE);
-    n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-      (struct sockaddr *) (&(*clientaddr)), &(*clientlen));
-    if (n < 0) {
-      error("ERROR in recvfrom");
-      return -1;
+  // the main loop streams the file from here on
+  session *sess = session_add(clientaddr, id, SESS_SEND, fd);
+  if (sess == NULL || rudp_sender_init(sess->snd, id, fd, 0, len, seg, parity) == -1) {
+    if (sess != NULL) {
+      session_free(sess);
     }
-    
+    return -1;
   }
-  printf("%ld\n", total);
-    
-  fclose(fp);
   return 1;
 }
 
@@ -267,65 +364,202 @@ int put_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   // move pointer back to beginning
   buf -= 4;
 
-  FILE *fp;
-  fp = fopen(fn, "w");
+  int fd;
+  fd = open(fn, O_RDWR | O_CREAT, 0644); // kept, an earlier put may be resumed
 
-  if(fp == NULL) {
+  if(fd < 0) {
     printf("File could not be opened\n");
     return -1;
   }
-  printf("true");
 
-  // recv either failed msg or file length
-  bzero(buf, BUFSIZE);
-  n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-    (struct sockaddr *) clientaddr, &(*clientlen));
-  if (n < 0) {
-    error("ERROR in recvfrom");
+  // the client's length message names the session, see len_func
+  session *sess = session_find(clientaddr, 0);
+  if (sess != NULL) {
+    session_free(sess); // an earlier put that never sent its length
+  }
+  sess = session_add(clientaddr, 0, SESS_AWAIT_LEN, fd);
+  if (sess == NULL) {
+    return -1;
+  }
+  strcpy(sess->fn, fn);
+  return 1;
+}
+
+int len_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr) {
+  session *sess = session_find(clientaddr, 0);
+  if (sess == NULL || sess->state != SESS_AWAIT_LEN) {
     return -1;
-  }  
+  }
+
+  // recv file length, session ID, segment size and stream count
   char *remaining;
   long len = strtol(buf, &remaining, 10);
+  uint32_t id = strtoul(remaining, &remaining, 10);
+  long seg = strtol(remaining, &remaining, 10);
+  long k = strtol(remaining, NULL, 10);
   printf("%ld\n", len);
+  if (k == 0) {
+    k = 1;
+  }
+  if (sending_busy(sess->fd)) {
+    printf("%s is being sent, refusing the put\n", sess->fn);
+    session_free(sess);
+    return -1;
+  }
+  if (id == 0 || seg <= 0 || seg > RUDP_MAX_SEG || k < 1 || k > RUDP_MAX_STREAMS ||
+      session_find(clientaddr, id) != NULL || rudp_size_file(sess->fd, len) == -1) {
+    session_free(sess);
+    return -1;
+  }
+  files_changed();
 
-  long total = 0;
-
-  while(total < len) {
-    // recv data from client
-    bzero(buf, BUFSIZE);
-    n = 0;
-    n = recvfrom(*sockfd, buf, BUFSIZE, 0,
-      (struct sockaddr *) clientaddr, &(*clientlen));
-    if (n < 0) {
-      error("ERROR in recvfrom");
-      return -1;
+  // packets may arrive out of order, the receiver writes each at its offset
+  int fd = sess->fd;
+  char fn[100];
+  strcpy(fn, sess->fn);
+  sess->fd = -1;
+  session_free(sess);
+
+  // a large put gets its own sockets and threads; tell the client where
+  if (k > 1) {
+    int socks[RUDP_MAX_STREAMS];
+    struct sockaddr_in peers[RUDP_MAX_STREAMS];
+    char msg[BUFSIZE];
+    int m = sprintf(msg, "streams %u", id);
+    for (int i = 0; i < k; i++) {
+      int port;
+      if ((socks[i] = rudp_stream_socket(&port)) < 0) {
+        while (i-- > 0) {
+          close(socks[i]);
+        }
+        close(fd);
+        return -1;
+      }
+      m += sprintf(msg + m, " %d", port);
+      peers[i] = *clientaddr;
+    }
+    if (sendto(*sockfd, msg, m, 0, (struct sockaddr *) clientaddr, sizeof(*clientaddr)) < 0) {
+      error("ERROR in sendto");
     }
-    printf("Bytes Recv: %d\n", n);
+    return start_streams(0, socks, peers, k, id, fd, len, seg, fn);
+  }
+
+  sess = session_add(clientaddr, id, SESS_RECV, fd);
+  if (sess == NULL) {
+    return -1;
+  }
+  if (rudp_receiver_init(&sess->rcv, id, *sockfd, fd, 0, len, seg, fn) == -1) {
+    session_free(sess);
+    return -1;
+  }
+  return 1;
+}
 
-    total += n;
+int streams_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr) {
+  // recv session ID and the client's stream ports
+  char *remaining;
+  uint32_t id = strtoul(buf, &remaining, 10);
+  session *sess = session_find(clientaddr, id);
+  if (sess == NULL || sess->state != SESS_AWAIT_STREAMS) {
+    return -1;
+  }
 
-    // write to the file
-    int bytes_written = fwrite(buf, 1, n, fp);
-    if(bytes_written == -1) {
-      printf("Writing to file failed\n");
+  int socks[RUDP_MAX_STREAMS];
+  struct sockaddr_in peers[RUDP_MAX_STREAMS];
+  int k = sess->k;
+  for (int i = 0; i < k; i++) {
+    peers[i] = *clientaddr;
+    peers[i].sin_port = htons(strtol(remaining, &remaining, 10));
+    int port;
+    if (peers[i].sin_port == 0 || (socks[i] = rudp_stream_socket(&port)) < 0) {
+      while (i-- > 0) {
+        close(socks[i]);
+      }
+      session_free(sess);
       return -1;
     }
+  }
 
-    printf("Bytes Written: %d\n", bytes_written);
-    printf("%ld\n", total);
+  // the file now belongs to the stream threads
+  int fd = sess->fd;
+  sess->fd = -1;
+  int ret = start_streams(1, socks, peers, k, id, fd, sess->len, sess->seg, sess->fn);
+  session_free(sess);
+  return ret;
+}
 
-    // send ack to server
-    bzero(buf, BUFSIZE);
-    sprintf(buf, "%d", n);
-    n = sendto(*sockfd, buf, strlen(buf), 0, 
-      (struct sockaddr *) &(*clientaddr), *clientlen);
-    if (n < 0) {
-      error("ERROR in sendto");
-      return -1;
+typedef struct {
+  int sending;
+  int socks[RUDP_MAX_STREAMS];
+  struct sockaddr_in peers[RUDP_MAX_STREAMS];
+  int k;
+  uint32_t id;
+  int fd;
+  off_t len;
+  int seg;
+  char fn[100];
+} stream_job;
+
+// runs a whole multi-stream transfer so the main loop never waits on it
+void *stream_thread(void *arg) {
+  stream_job *job = arg;
+  rudp_stats st;
+  int n;
+  if (job->sending) {
+    n = rudp_send_streams(job->socks, job->peers, job->k, job->id, job->fd, job->len, job->seg, parity, &st);
+  } else {
+    n = rudp_recv_streams(job->socks, &job->peers[0], job->k, job->id, job->fd, job->len, job->seg, job->fn, &st);
+  }
+  printf("%s of %s over %d streams %s\n", job->sending ? "get" : "put", job->fn, job->k,
+    n == -1 ? "failed" : "done");
+  if (n != -1) {
+    rudp_stats_print(&st, job->sending);
+  }
+  if (job->sending) {
+    sending_release(job->fd);
+  } else {
+    files_changed();
+  }
+  close(job->fd);
+  free(job);
+  return NULL;
+}
+
+int start_streams(int sending, int *socks, struct sockaddr_in *peers, int k, uint32_t id,
+  int fd, off_t len, int seg, char *fn) {
+  pthread_t tid;
+  stream_job *job = malloc(sizeof(stream_job));
+  if (job == NULL) {
+    for (int i = 0; i < k; i++) {
+      close(socks[i]);
+    }
+    if (sending) {
+      sending_release(fd);
+    }
+    close(fd);
+    return -1;
+  }
+  job->sending = sending;
+  memcpy(job->socks, socks, k * sizeof(int));
+  memcpy(job->peers, peers, k * sizeof(struct sockaddr_in));
+  job->k = k;
+  job->id = id;
+  job->fd = fd;
+  job->len = len;
+  job->seg = seg;
+  strcpy(job->fn, fn);
+  if (pthread_create(&tid, NULL, stream_thread, job) != 0) {
+    for (int i = 0; i < k; i++) {
+      close(socks[i]);
+    }
+    if (sending) {
+      sending_release(fd);
     }
+    close(fd);
+    free(job);
+    return -1;
   }
-    
-  fclose(fp);
+  pthread_detach(tid);
   return 1;
 }
 
@@ -341,6 +575,7 @@ int del_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
   if(remove(fn) == 0) {
     msg = "Delete successful";
     ret_val = 0;
+    files_changed();
   }
   else {
     msg = "Delete failed";
@@ -358,42 +593,145 @@ int del_func(char *buf, int n, int *sockfd, struct sockaddr_in *clientaddr,
 
 int ls_func(char *buf, int *sockfd, struct sockaddr_in *clientaddr,
   int *clientlen) {
-  bzero(buf, BUFSIZE); // clear buf
-  char *st = buf;
-  int s = 0;
+  static char pages[LS_BURST][LS_PAGE];
+  struct mmsghdr msgs[LS_BURST];
+  struct iovec iov[LS_BURST];
+  unsigned long long version = 0;
+  unsigned long from = 0;
+
+  // "ls <version> <from>", a bare "ls" being the whole listing. A listing
+  // is a snapshot as of its first page; the rest come from the same one
+  sscanf(buf + 2, "%llu %lu", &version, &from);
+  if ((from == 0 || listing.blob == NULL) && listing_update() == -1) {
+    return -1;
+  }
+  int unchanged = from == 0 && version == listing.version;
+  uint32_t i = from < listing.n ? from : listing.n;
+
+  // whole entries per page, as many pages as the burst allows
+  int m = 0;
+  do {
+    ls_hdr *h = (ls_hdr *) pages[m];
+    uint32_t first = i;
+    size_t len = sizeof(*h);
+    while (!unchanged && i < listing.n && len + listing.at[i + 1] - listing.at[i] <= LS_PAGE) {
+      memcpy(pages[m] + len, listing.blob + listing.at[i], listing.at[i + 1] - listing.at[i]);
+      len += listing.at[i + 1] - listing.at[i];
+      i++;
+    }
+    memcpy(h->magic, LS_MAGIC, sizeof(h->magic));
+    h->version = htobe64(listing.version);
+    h->total = htonl(listing.n);
+    h->from = htonl(first);
+    h->count = htons(i - first);
+    h->flags = htons(unchanged ? LS_UNCHANGED : 0);
+    iov[m].iov_base = pages[m];
+    iov[m].iov_len = len;
+    bzero(&msgs[m].msg_hdr, sizeof(struct msghdr));
+    msgs[m].msg_hdr.msg_name = clientaddr;
+    msgs[m].msg_hdr.msg_namelen = *clientlen;
+    msgs[m].msg_hdr.msg_iov = &iov[m];
+    msgs[m].msg_hdr.msg_iovlen = 1;
+    m++;
+  } while (!unchanged && m < LS_BURST && i < listing.n);
+  ((ls_hdr *) pages[m - 1])->flags |= htons(LS_LAST);
+
+  for (int sent = 0; sent < m; ) {
+    int n = sendmmsg(*sockfd, msgs + sent, m - sent, 0);
+    if (n < 0) {
+      error("ERROR in sendmmsg");
+      return -1;
+    }
+    sent += n;
+  }
+  return 0;
+}
 
-  DIR *d;
-  struct dirent *dir;
-  d = opendir(".");
-  if (d) {
-    while ((dir = readdir(d)) != NULL) {
-      int dir_len = strlen(dir->d_name);
+void files_changed(void) {
+  __atomic_add_fetch(&files_gen, 1, __ATOMIC_RELAXED);
+}
 
-      printf("%s\n", dir->d_name);
-      memcpy(buf, dir->d_name, dir_len);
-      buf[dir_len] = '\n'; // append new line char to end of each dir name
-      buf += dir_len + 1;
-      // printf("%s\n", st);
-    }
-    closedir(d);
-    
+// list the directory again unless the cached listing is still good
+int listing_update(void) {
+  struct stat st;
+  unsigned gen = __atomic_load_n(&files_gen, __ATOMIC_RELAXED);
+  if (stat(".", &st) == -1) {
+    return -1;
   }
-  else {
-    return(-1);
+  if (listing.blob != NULL && !listing.racy && gen == listing.gen &&
+      st.st_mtim.tv_sec == listing.mtime.tv_sec && st.st_mtim.tv_nsec == listing.mtime.tv_nsec) {
+    return 0;
   }
-  /* 
-  * sendto: send directory layout to the client 
-  */
-  int n;
-  n = sendto(*sockfd, st, strlen(st), 0, 
-        (struct sockaddr *) &(*clientaddr), *clientlen);
-  if (n < 0) {
-    error("ERROR in sendto");
+
+  DIR *d = opendir(".");
+  if (d == NULL) {
     return -1;
   }
-  // printf("%d\n", n);
-
-  return(0);
+  size_t cap = 4096, len = 0;
+  uint32_t n = 0, ncap = 64;
+  char *blob = malloc(cap);
+  uint32_t *at = malloc(ncap * sizeof(uint32_t));
+  struct dirent *dir;
+  while (blob != NULL && at != NULL && (dir = readdir(d)) != NULL) {
+    struct stat fst;
+    size_t namelen = strlen(dir->d_name);
+    if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0 || namelen > 255 ||
+        fstatat(dirfd(d), dir->d_name, &fst, AT_SYMLINK_NOFOLLOW) == -1) {
+      continue;
+    }
+    if (len + sizeof(ls_entry) + namelen > cap) {
+      char *grown = realloc(blob, cap *= 2);
+      if (grown == NULL) {
+        free(blob);
+      }
+      blob = grown;
+    }
+    if (n + 2 > ncap) {
+      uint32_t *grown = realloc(at, (ncap *= 2) * sizeof(uint32_t));
+      if (grown == NULL) {
+        free(at);
+      }
+      at = grown;
+    }
+    if (blob == NULL || at == NULL) {
+      break;
+    }
+    ls_entry *e = (ls_entry *) (blob + len);
+    e->size = htobe64(fst.st_size);
+    e->mtime = htobe64(fst.st_mtime);
+    e->type = S_ISREG(fst.st_mode) ? 'f' : S_ISDIR(fst.st_mode) ? 'd' : S_ISLNK(fst.st_mode) ? 'l' : '?';
+    e->namelen = namelen;
+    memcpy(e + 1, dir->d_name, namelen);
+    at[n++] = len;
+    len += sizeof(ls_entry) + namelen;
+  }
+  closedir(d);
+  if (blob == NULL || at == NULL) {
+    free(blob);
+    free(at);
+    return -1;
+  }
+  at[n] = len;
+
+  // the same entries as before keep their version, so a client part way
+  // through them needn't start over
+  int same = listing.blob != NULL && n == listing.n && len == listing.at[n] &&
+    memcmp(blob, listing.blob, len) == 0;
+  free(listing.blob);
+  free(listing.at);
+  listing.blob = blob;
+  listing.at = at;
+  listing.n = n;
+  listing.mtime = st.st_mtim;
+  listing.gen = gen;
+  // a change in the same clock tick as this listing wouldn't move the mtime
+  listing.racy = st.st_mtime >= time(NULL) - 1;
+  if (!same) {
+    // versions start from the clock so a restarted server doesn't reuse one
+    listing.version = listing.version != 0 ? listing.version + 1 : (uint64_t) time(NULL) << 20;
+    printf("Listed %u entries\n", n);
+  }
+  return 0;
 }
 
 int exit_func(int *sockfd, struct sockaddr_in *clientaddr,
@@ -415,4 +753,176 @@ int exit_func(int *sockfd, struct sockaddr_in *clientaddr,
   printf("%d", n);
 
   return(0);
-}
\ No newline at end of file
+}
+
+static int session_bucket(struct sockaddr_in *addr, uint32_t id) {
+  return (addr->sin_addr.s_addr ^ addr->sin_port ^ id) % SESSION_BUCKETS;
+}
+
+session *session_find(struct sockaddr_in *addr, uint32_t id) {
+  session *sess = sessions[session_bucket(addr, id)];
+  while (sess != NULL) {
+    if (sess->id == id && sess->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+        sess->addr.sin_port == addr->sin_port) {
+      return sess;
+    }
+    sess = sess->next;
+  }
+  return NULL;
+}
+
+// register a session that owns fd from now on; a file to send is held
+// against puts until the session is freed
+session *session_add(struct sockaddr_in *addr, uint32_t id, int state, int fd) {
+  int sends = state == SESS_SEND || state == SESS_AWAIT_STREAMS;
+  session *sess = calloc(1, sizeof(session));
+  if (sess == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if ((state == SESS_SEND && (sess->snd = malloc(sizeof(rudp_sender))) == NULL) ||
+      (sends && sending_hold(fd) == -1)) {
+    free(sess->snd);
+    free(sess);
+    close(fd);
+    return NULL;
+  }
+  sess->addr = *addr;
+  sess->id = id;
+  sess->state = state;
+  sess->fd = fd;
+  sess->last_us = rudp_now_us();
+
+  int b = session_bucket(addr, id);
+  sess->next = sessions[b];
+  sessions[b] = sess;
+  return sess;
+}
+
+void session_free(session *sess) {
+  session **p = &sessions[session_bucket(&sess->addr, sess->id)];
+  while (*p != sess) {
+    p = &(*p)->next;
+  }
+  *p = sess->next;
+
+  if (sess->state == SESS_RECV) {
+    rudp_receiver_free(&sess->rcv);
+  }
+  if (sess->state == SESS_RECV || sess->state == SESS_AWAIT_LEN) {
+    files_changed();
+  }
+  if (sess->fd >= 0) {
+    if (sess->state == SESS_SEND || sess->state == SESS_AWAIT_STREAMS) {
+      sending_release(sess->fd);
+    }
+    close(sess->fd);
+  }
+  if (sess->snd != NULL) {
+    rudp_sender_free(sess->snd);
+  }
+  free(sess->snd);
+  free(sess);
+}
+
+// feed a packet to its session's state machine, -1 if the transfer failed
+int session_packet(session *sess, char *buf, int n, int sockfd) {
+  if (sess->state == SESS_SEND) {
+    rudp_sender_on_ack(sess->snd, buf, n);
+  }
+  else if (sess->state == SESS_RECV) {
+    int ret = rudp_receiver_on_data(&sess->rcv, buf, n, sockfd, &sess->addr);
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret == 1 && !sess->done) {
+      rudp_stats_print(&sess->rcv.st, 0);
+      sess->done = 1;
+    }
+    sess->last_us = rudp_now_us();
+  }
+  return 0;
+}
+
+// send what is due and check deadlines; us until the session next needs a
+// turn, -1 if only a packet can wake it, -2 once it is finished
+int64_t session_service(session *sess, int sockfd, uint64_t now) {
+  if (sess->state == SESS_SEND) {
+    rudp_sender *s = sess->snd;
+    if (s->phase == RUDP_PHASE_DONE) {
+      rudp_stats_print(&s->st, 1);
+      return -2;
+    }
+    if (rudp_sender_pump(s, sockfd, &sess->addr) == -1) {
+      printf("get failed\n");
+      return -2;
+    }
+    return rudp_sender_timeout(s);
+  }
+
+  // acks for the packets of the last batch go out together
+  if (sess->state == SESS_RECV && rudp_receiver_flush(&sess->rcv, sockfd, &sess->addr) == -1) {
+    return -2;
+  }
+
+  // receivers give up when the client goes quiet, and stop re-acking
+  // duplicates a while after the file is complete
+  uint64_t deadline = sess->last_us + (sess->done ? RUDP_LINGER_MS : RUDP_IDLE_MS) * 1000L;
+  if (now >= deadline) {
+    if (!sess->done) {
+      printf("Transfer timed out\n");
+    }
+    return -2;
+  }
+  return deadline - now;
+}
+
+// find fd's file among those being sent; call with sending_lock held
+static sending_file **sending_find(int fd, struct stat *st) {
+  sending_file **p = &sending;
+  if (fstat(fd, st) == -1) {
+    return NULL;
+  }
+  while (*p != NULL && ((*p)->dev != st->st_dev || (*p)->ino != st->st_ino)) {
+    p = &(*p)->next;
+  }
+  return p;
+}
+
+int sending_hold(int fd) {
+  struct stat st;
+  int ret = -1;
+  pthread_mutex_lock(&sending_lock);
+  sending_file **p = sending_find(fd, &st);
+  if (p != NULL && *p == NULL && (*p = calloc(1, sizeof(sending_file))) != NULL) {
+    (*p)->dev = st.st_dev;
+    (*p)->ino = st.st_ino;
+  }
+  if (p != NULL && *p != NULL) {
+    (*p)->refs++;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&sending_lock);
+  return ret;
+}
+
+void sending_release(int fd) {
+  struct stat st;
+  pthread_mutex_lock(&sending_lock);
+  sending_file **p = sending_find(fd, &st);
+  if (p != NULL && *p != NULL && --(*p)->refs == 0) {
+    sending_file *f = *p;
+    *p = f->next;
+    free(f);
+  }
+  pthread_mutex_unlock(&sending_lock);
+}
+
+int sending_busy(int fd) {
+  struct stat st;
+  pthread_mutex_lock(&sending_lock);
+  sending_file **p = sending_find(fd, &st);
+  int busy = p == NULL || *p != NULL;
+  pthread_mutex_unlock(&sending_lock);
+  return busy;
+}